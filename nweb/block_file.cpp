@@ -1,8 +1,41 @@
-﻿#include "block_file.h"
+﻿#include <cstring>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#include "block_file.h"
+#ifdef _WIN32
+#include <winioctl.h>
+#endif
 
 
 namespace nweb
 {
+
+std::string BlockFile::GetPathFromFullName(const char * fullname)
+{
+    std::string path;
+    if(!fullname)
+        return path;
+
+    auto last_backslash = std::strrchr(fullname, '\\');
+    auto last_slash = std::strrchr(fullname, '/');
+    auto slash = (std::max)(last_backslash, last_slash);
+
+    if(!slash)
+        return path;
+
+    return path.assign(fullname, slash - fullname);
+}
+
+#ifdef _WIN32
 //static member functions
 int UTF8Decode(const char * multibyte,	const int multibyte_size,	
                wchar_t * widechar, int widechar_size)
@@ -30,22 +63,6 @@ void UnixTimeToFileTime( time_t t, LPFILETIME pft )
     pft->dwHighDateTime = ui.HighPart;
 }
 
-std::string BlockFile::GetPathFromFullName(const char * fullname)
-{
-    std::string path;
-    if(!fullname)
-        return path;
-
-    auto last_backslash = std::strrchr(fullname, '\\');
-    auto last_slash = std::strrchr(fullname, '/');
-    auto slash = (std::max)(last_backslash, last_slash);
-
-    if(!slash)
-        return path;
-
-    return path.assign(fullname, slash - fullname);
-}
-
 bool BlockFile::CreateDirectoryRecursive(const char * name)
 {
     bool result = false;
@@ -98,7 +115,16 @@ bool BlockFile::RemoveFile(const char * file)
     return true;
 }
 
-void BlockFile::CloseMapping(void * file_mapping_data)
+bool BlockFile::RenameFile(const char * from, const char * to)
+{
+    wchar_t from16[MAX_PATH] = {0};
+    wchar_t to16[MAX_PATH] = {0};
+    if(!UTF8Decode(from, -1, from16, MAX_PATH) || !UTF8Decode(to, -1, to16, MAX_PATH))
+        return false;
+    return ::MoveFileEx(from16, to16, MOVEFILE_REPLACE_EXISTING) != FALSE;
+}
+
+void BlockFile::CloseMapping(void * file_mapping_data, uint64_t size)
 {
     if (file_mapping_data) 
         ::UnmapViewOfFile(file_mapping_data);
@@ -136,6 +162,11 @@ void BlockFile::Close()
 }
 
 bool BlockFile::Open(const char * file, bool bcreate)
+{
+    return Open(file, bcreate, true);
+}
+
+bool BlockFile::Open(const char * file, bool bcreate, bool write_through)
 {
     wchar_t name16[MAX_PATH] = {0};    
     if(!UTF8Decode(file, -1, name16, MAX_PATH))
@@ -152,7 +183,20 @@ bool BlockFile::Open(const char * file, bool bcreate)
 
     handle_ = ::CreateFile(name16, GENERIC_READ | GENERIC_WRITE, 
                            FILE_SHARE_READ, 0, dwCreationDisposition,
-                           FILE_FLAG_WRITE_THROUGH, 0);
+                           write_through ? FILE_FLAG_WRITE_THROUGH : 0, 0);
+
+    return INVALID_HANDLE_VALUE != handle_;
+}
+
+bool BlockFile::OpenForRead(const char * file)
+{
+    wchar_t name16[MAX_PATH] = {0};    
+    if(!UTF8Decode(file, -1, name16, MAX_PATH))
+        return false;
+
+    handle_ = ::CreateFile(name16, GENERIC_READ, 
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 
+                           0, OPEN_EXISTING, 0, 0);
 
     return INVALID_HANDLE_VALUE != handle_;
 }
@@ -204,6 +248,35 @@ bool BlockFile::Write(const void * data, uint32_t size_to_write)
     return true;
 }
 
+bool BlockFile::Read(void * data, uint32_t size_to_read, uint64_t offset) const
+{
+    if(handle_ == INVALID_HANDLE_VALUE)
+        return false;
+
+    if(data == 0)
+        return false;
+
+    DWORD transfered = 0;
+    OVERLAPPED status;
+    char * blob = reinterpret_cast<char *>(data);
+    while(size_to_read)
+    {
+        memset(&status, 0 , sizeof(status));
+        status.Offset = static_cast<uint32_t>(offset);
+        status.OffsetHigh = static_cast<uint32_t>(offset >> 32);
+
+        if(!::ReadFile(handle_, blob, size_to_read, &transfered, &status))
+            return false;
+        //文件已到末尾
+        if(!transfered)
+            return false;
+        size_to_read -= transfered;
+        offset += transfered;
+        blob += transfered; 
+    }
+    return true;
+}
+
 bool BlockFile::IsFileExist(const char * name)
 {//文件是否存在
     wchar_t name16[MAX_PATH] = {0};    
@@ -257,6 +330,12 @@ bool BlockFile::Flush()
     return ::FlushFileBuffers(handle_) != FALSE;
 }
 
+bool BlockFile::DropCache(uint64_t offset, uint64_t size)
+{
+    //write through打开的文件不在系统缓存中积压
+    return handle_ != INVALID_HANDLE_VALUE;
+}
+
 bool BlockFile::SetLastWriteTime()
 {
     if(handle_ == INVALID_HANDLE_VALUE)
@@ -298,6 +377,11 @@ bool BlockFile::IsValid() const
     return handle_ != INVALID_HANDLE_VALUE;
 }
 
+intptr_t BlockFile::GetNativeHandle() const
+{
+    return reinterpret_cast<intptr_t>(handle_);
+}
+
 void * BlockFile::OpenMapping(BlockFile & file)
 {
     void * mapping = nullptr;
@@ -321,4 +405,400 @@ bool BlockFile::Truncate()
     return false;
 }
 
-}
\ No newline at end of file
+bool BlockFile::CloneFrom(const BlockFile & source, uint64_t source_offset, 
+                          uint64_t offset, uint64_t size)
+{
+    if(handle_ == INVALID_HANDLE_VALUE || source.handle_ == INVALID_HANDLE_VALUE)
+        return false;
+
+    //ReFS的块克隆, 旧版SDK中没有这些定义
+#ifndef FSCTL_DUPLICATE_EXTENTS_TO_FILE
+#define FSCTL_DUPLICATE_EXTENTS_TO_FILE \
+    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 209, METHOD_BUFFERED, FILE_WRITE_DATA)
+    struct DUPLICATE_EXTENTS_DATA
+    {
+        HANDLE FileHandle;
+        LARGE_INTEGER SourceFileOffset;
+        LARGE_INTEGER TargetFileOffset;
+        LARGE_INTEGER ByteCount;
+    };
+#endif
+    DUPLICATE_EXTENTS_DATA extents;
+    extents.FileHandle = source.handle_;
+    extents.SourceFileOffset.QuadPart = source_offset;
+    extents.TargetFileOffset.QuadPart = offset;
+    extents.ByteCount.QuadPart = size;
+    DWORD transfered = 0;
+    return ::DeviceIoControl(handle_, FSCTL_DUPLICATE_EXTENTS_TO_FILE, 
+                             &extents, sizeof(extents), 0, 0, &transfered, 0) != FALSE;
+}
+
+#else
+//static member functions
+bool BlockFile::CreateDirectoryRecursive(const char * name)
+{
+    struct stat st;
+    if(!stat(name, &st))
+        return S_ISDIR(st.st_mode);
+
+    std::string partical;
+    for(const char * p = name; ; ++p)
+    {
+        char ch = *p;
+        if((ch == '/' || ch == '\\' || ch == 0) && !partical.empty())
+        {
+            if(stat(partical.data(), &st))
+            {
+                if(mkdir(partical.data(), 0755) && errno != EEXIST)
+                    return false;
+            }
+            else if(!S_ISDIR(st.st_mode))
+            {
+                return false;
+            }
+        }
+        if(ch == 0)
+            break;
+        partical += (ch == '\\') ? '/' : ch;
+    }
+    return true;
+}
+
+bool BlockFile::RemoveFile(const char * file)
+{
+    if(IsFileExist(file))
+    {//文件存在
+        return unlink(file) == 0;
+    }
+    return true;
+}
+
+bool BlockFile::RenameFile(const char * from, const char * to)
+{
+    return ::rename(from, to) == 0;
+}
+
+void BlockFile::CloseMapping(void * file_mapping_data, uint64_t size)
+{
+    if (file_mapping_data)
+        munmap(file_mapping_data, static_cast<size_t>(size));
+    return;
+}
+
+bool BlockFile::FlushMapping( void* file_mapping_data, int32_t size )
+{
+    if (!file_mapping_data)
+        return false;
+
+    return msync(file_mapping_data, size, MS_SYNC) == 0;
+}
+
+//nonstatic member funtions
+BlockFile::BlockFile()
+{
+    fd_ = -1;
+    pinned_time_ = -1;
+}
+
+BlockFile::~BlockFile()
+{
+    Close();
+}
+
+
+void BlockFile::Close()
+{
+    if (-1 != fd_)
+    {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    std::lock_guard<std::mutex> guard(time_lock_);
+    pinned_time_ = -1;
+    return ;
+}
+
+bool BlockFile::Open(const char * file, bool bcreate)
+{
+    return Open(file, bcreate, true);
+}
+
+bool BlockFile::Open(const char * file, bool bcreate, bool write_through)
+{
+    int flags = O_RDWR | O_CLOEXEC;
+    if(bcreate)
+    {//目录不存在 则创建目录
+        flags |= O_CREAT | O_TRUNC;
+        auto path = GetPathFromFullName(file);
+        if(!path.empty())
+            CreateDirectoryRecursive(path.data());
+    }
+    //对应FILE_FLAG_WRITE_THROUGH
+    if(write_through)
+        flags |= O_DSYNC;
+
+    fd_ = ::open(file, flags, 0644);
+    std::lock_guard<std::mutex> guard(time_lock_);
+    pinned_time_ = -1;
+    return -1 != fd_;
+}
+
+bool BlockFile::OpenForRead(const char * file)
+{
+    fd_ = ::open(file, O_RDONLY | O_CLOEXEC);
+    std::lock_guard<std::mutex> guard(time_lock_);
+    pinned_time_ = -1;
+    return -1 != fd_;
+}
+
+bool BlockFile::Write(const void * data, uint32_t size_to_write, uint64_t offset)
+{
+    if(fd_ == -1)
+        return false;
+
+    if(data == 0)
+        return false;
+
+    const char * blob = reinterpret_cast<const char *>(data);
+    while(size_to_write)
+    {
+        ssize_t transfered = ::pwrite(fd_, blob, size_to_write, offset);
+        if(transfered < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        size_to_write -= static_cast<uint32_t>(transfered);
+        offset += transfered;
+        blob += transfered;
+    }
+    return true;
+}
+
+bool BlockFile::Write(const void * data, uint32_t size_to_write)
+{
+    if(fd_ == -1)
+        return false;
+
+    if(data == 0)
+        return false;
+
+    const char * blob = reinterpret_cast<const char *>(data);
+    while(size_to_write)
+    {
+        ssize_t transfered = ::write(fd_, blob, size_to_write);
+        if(transfered < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        size_to_write -= static_cast<uint32_t>(transfered);
+        blob += transfered;
+    }
+    return true;
+}
+
+bool BlockFile::Read(void * data, uint32_t size_to_read, uint64_t offset) const
+{
+    if(fd_ == -1)
+        return false;
+
+    if(data == 0)
+        return false;
+
+    char * blob = reinterpret_cast<char *>(data);
+    while(size_to_read)
+    {
+        ssize_t transfered = ::pread(fd_, blob, size_to_read, offset);
+        if(transfered < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        //文件已到末尾
+        if(!transfered)
+            return false;
+        size_to_read -= static_cast<uint32_t>(transfered);
+        offset += transfered;
+        blob += transfered;
+    }
+    return true;
+}
+
+bool BlockFile::IsFileExist(const char * name)
+{//文件是否存在
+    struct stat st;
+    if(stat(name, &st))
+        return false;
+    return S_ISREG(st.st_mode);
+}
+
+bool BlockFile::SetSize64(uint64_t file_size)
+{
+    if(fd_ == -1)
+        return false;
+
+    uint64_t current = 0;
+    if(!GetSize64(current))
+        return false;
+
+#ifdef __linux__
+    //预先分配磁盘空间, 避免下载时产生碎片
+    //文件系统不支持时退回ftruncate, 生成稀疏文件而不是填零
+    if(file_size > current)
+    {
+        if(!::fallocate(fd_, 0, 0, static_cast<off_t>(file_size)))
+            return true;
+        if(errno != EOPNOTSUPP && errno != ENOSYS)
+            return false;
+    }
+#endif
+    return ::ftruncate(fd_, static_cast<off_t>(file_size)) == 0;
+}
+
+bool BlockFile::GetSize64(uint64_t & file_size) const
+{
+    if(fd_ == -1)
+        return false;
+
+    struct stat st;
+    if(::fstat(fd_, &st))
+        return false;
+    file_size = st.st_size;
+    return true;
+}
+
+bool BlockFile::Flush()
+{
+    if(fd_ == -1)
+        return false;
+
+    //此前的写入改变了写入时间, 每次落盘时恢复一次
+    RestoreWriteTime();
+    return ::fdatasync(fd_) == 0;
+}
+
+bool BlockFile::DropCache(uint64_t offset, uint64_t size)
+{
+    if(fd_ == -1)
+        return false;
+
+#ifdef POSIX_FADV_DONTNEED
+    //只对已落盘的页面生效, 需在Flush之后调用
+    return ::posix_fadvise(fd_, static_cast<off_t>(offset),
+                           static_cast<off_t>(size), POSIX_FADV_DONTNEED) == 0;
+#else
+    return true;
+#endif
+}
+
+bool BlockFile::SetLastWriteTime()
+{
+    return SetLastWriteTime(time(0));
+}
+
+bool BlockFile::SetLastWriteTime(time_t time)
+{
+    if(fd_ == -1)
+        return false;
+
+    std::lock_guard<std::mutex> guard(time_lock_);
+    pinned_time_ = time;
+    return ApplyWriteTime(time);
+}
+
+bool BlockFile::ApplyWriteTime(time_t time)
+{
+    timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = time;
+    times[1].tv_nsec = 0;
+    return ::futimens(fd_, times) == 0;
+}
+
+
+bool BlockFile::GetLastWriteTime( time_t & last_modify )
+{
+    if(fd_ == -1)
+        return false;
+
+    struct stat st;
+    if(::fstat(fd_, &st))
+        return false;
+    last_modify = st.st_mtime;
+    return true;
+}
+
+bool BlockFile::IsValid() const
+{
+    return fd_ != -1;
+}
+
+intptr_t BlockFile::GetNativeHandle() const
+{
+    return fd_;
+}
+
+void * BlockFile::OpenMapping(BlockFile & file)
+{
+    if(file.fd_ == -1)
+        return nullptr;
+
+    uint64_t size = 0;
+    if(!file.GetSize64(size) || !size)
+        return nullptr;
+
+    //映射在文件关闭后仍然有效
+    void * mapping = ::mmap(0, static_cast<size_t>(size), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, file.fd_, 0);
+    return mapping == MAP_FAILED ? nullptr : mapping;
+}
+
+bool BlockFile::Truncate()
+{
+    if(fd_ == -1)
+        return false;
+
+    off_t position = ::lseek(fd_, 0, SEEK_CUR);
+    if(position < 0)
+        return false;
+    return ::ftruncate(fd_, position) == 0;
+}
+
+bool BlockFile::CloneFrom(const BlockFile & source, uint64_t source_offset, 
+                          uint64_t offset, uint64_t size)
+{
+    if(fd_ == -1 || source.fd_ == -1)
+        return false;
+
+#ifdef FICLONERANGE
+    file_clone_range range;
+    range.src_fd = source.fd_;
+    range.src_offset = source_offset;
+    range.src_length = size;
+    range.dest_offset = offset;
+    if(::ioctl(fd_, FICLONERANGE, &range))
+        return false;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void BlockFile::RestoreWriteTime()
+{
+    //Windows上显式设置的写入时间不再随写入改变, 日志依赖这一点校验目标文件
+    //每次写入后都恢复代价过高, 只在Flush时恢复, 之间的写入时间与日志不符
+    //同时设置新时间的线程不会被旧时间覆盖
+    std::lock_guard<std::mutex> guard(time_lock_);
+    if(pinned_time_ != -1)
+        ApplyWriteTime(pinned_time_);
+}
+
+#endif
+
+}
@@ -1,6 +1,9 @@
 ﻿#ifndef NWEB_BLOCK_FILE_H_
 #define NWEB_BLOCK_FILE_H_
 
+#ifndef _WIN32
+#include <mutex>
+#endif
 #include "nweb.h"
 
 namespace nweb
@@ -15,6 +18,8 @@ public:
     static bool IsFileExist(const char * name);
 
     static bool RemoveFile(const char * file);
+    //目标已存在时覆盖
+    static bool RenameFile(const char * from, const char * to);
 
     static std::string GetPathFromFullName(const char * fullname);
 
@@ -24,9 +29,13 @@ public:
 
     static void * OpenMapping(BlockFile & file);
 
-    static void CloseMapping(void * mapping);
+    static void CloseMapping(void * mapping, uint64_t size);
 
     bool Open(const char * file, bool bcreate);
+    //write_through为false时写入经过系统缓存, 由Flush保证落盘
+    bool Open(const char * file, bool bcreate, bool write_through);
+    //只读打开已存在的文件, 不妨碍其他句柄同时读写或删除
+    bool OpenForRead(const char * file);
 
     void Close();
 
@@ -34,7 +43,12 @@ public:
 
     bool Write(const void * data, uint32_t size_to_write);
 
+    bool Read(void * data, uint32_t size_to_read, uint64_t offset) const;
+
+    //Linux上同时恢复SetLastWriteTime(time)设置的写入时间
     bool Flush();
+    //已落盘的区间不再保留在系统缓存中, 避免大文件挤占缓存
+    bool DropCache(uint64_t offset, uint64_t size);
 
     bool SetSize64(uint64_t file_size);
 
@@ -47,11 +61,29 @@ public:
     bool GetLastWriteTime(time_t & time);
 
     bool IsValid() const;
+    //系统文件句柄(Windows上为HANDLE), 供异步写入使用
+    intptr_t GetNativeHandle() const;
 
     bool Truncate();
+    //与source共享[source_offset, source_offset + size)的数据块(reflink), 写入到offset处
+    //只改变文件系统的元数据, 文件系统不支持或区间未按簇对齐时返回false
+    bool CloneFrom(const BlockFile & source, uint64_t source_offset, 
+                   uint64_t offset, uint64_t size);
 private:
+#ifdef _WIN32
     /* data */
     HANDLE handle_;
+#else
+    void RestoreWriteTime();
+
+    bool ApplyWriteTime(time_t time);
+
+    int fd_;
+    //写入线程与下载线程都会改写时间, 读取pinned_time_与设置时间须在同一锁内
+    std::mutex time_lock_;
+    //显式设置的写入时间, -1表示未设置
+    time_t pinned_time_;
+#endif
 };
 
     
@@ -0,0 +1,212 @@
+﻿#include <string.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#include "block_pool.h"
+
+namespace nweb
+{
+
+namespace
+{
+
+BlockPool g_block_pool;
+
+}
+
+BlockPool & BlockPool::Instance()
+{
+    return g_block_pool;
+}
+
+BlockPool::BlockPool()
+    : capacity_(0), large_pages_(false), starved_(false)
+{
+    memset(&stats_, 0, sizeof(stats_));
+}
+
+BlockPool::~BlockPool()
+{
+    Trim();
+    //仍在使用的缓冲随进程退出释放
+}
+
+void BlockPool::SetCapacity(uint64_t capacity)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    capacity_ = capacity;
+    NotifyAvailable();
+}
+
+uint64_t BlockPool::GetCapacity() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return capacity_;
+}
+
+void BlockPool::EnableLargePages(bool enable)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    large_pages_ = enable;
+}
+
+void * BlockPool::Acquire()
+{
+    std::lock_guard<std::mutex> guard(lock_);
+
+    Buffer buffer = {0, false};
+    if(!idle_.empty())
+    {
+        buffer = idle_.back();
+        idle_.pop_back();
+        stats_.hits++;
+    }
+    else
+    {
+        if(capacity_ && stats_.reserved + kBufferSize > capacity_)
+        {
+            stats_.rejected++;
+            starved_ = true;
+            return 0;
+        }
+        buffer.data = Allocate(buffer.large);
+        if(!buffer.data)
+        {
+            stats_.rejected++;
+            starved_ = true;
+            return 0;
+        }
+        stats_.reserved += kBufferSize;
+        stats_.peak_reserved = (std::max)(stats_.peak_reserved, stats_.reserved);
+    }
+
+    busy_.push_back(buffer);
+    stats_.acquired++;
+    stats_.in_use++;
+    stats_.peak_in_use = (std::max)(stats_.peak_in_use, stats_.in_use);
+    return buffer.data;
+}
+
+void BlockPool::Release(void * buffer)
+{
+    if(!buffer)
+        return;
+
+    std::lock_guard<std::mutex> guard(lock_);
+    for(size_t i = 0; i < busy_.size(); ++i)
+    {
+        if(busy_[i].data != buffer)
+            continue;
+
+        Buffer released = busy_[i];
+        busy_[i] = busy_.back();
+        busy_.pop_back();
+        stats_.in_use--;
+        //超出新的上限时直接归还系统
+        if(capacity_ && stats_.reserved > capacity_)
+        {
+            Free(released.data, released.large);
+            stats_.reserved -= kBufferSize;
+        }
+        else
+        {
+            idle_.push_back(released);
+        }
+        NotifyAvailable();
+        return;
+    }
+    assert(0);
+}
+
+void BlockPool::AddListener(Listener * listener)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    listeners_.push_back(listener);
+}
+
+void BlockPool::RemoveListener(Listener * listener)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    auto iter = std::find(listeners_.begin(), listeners_.end(), listener);
+    if(iter != listeners_.end())
+        listeners_.erase(iter);
+}
+
+void BlockPool::NotifyAvailable()
+{
+    if(!starved_)
+        return;
+    if(idle_.empty() && capacity_ && stats_.reserved + kBufferSize > capacity_)
+        return;
+    starved_ = false;
+    for(size_t i = 0; i < listeners_.size(); ++i)
+        listeners_[i]->BufferAvailable();
+}
+
+void BlockPool::Trim()
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    for(size_t i = 0; i < idle_.size(); ++i)
+    {
+        Free(idle_[i].data, idle_[i].large);
+        stats_.reserved -= kBufferSize;
+    }
+    idle_.clear();
+}
+
+BlockPool::Stats BlockPool::GetStats() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return stats_;
+}
+
+void * BlockPool::Allocate(bool & large)
+{
+    large = false;
+#ifdef _WIN32
+    if(large_pages_)
+    {
+        SIZE_T page = GetLargePageMinimum();
+        if(page && kBufferSize % page == 0)
+        {
+            void * data = VirtualAlloc(0, kBufferSize,
+                                       MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+                                       PAGE_READWRITE);
+            if(data)
+            {
+                large = true;
+                return data;
+            }
+        }
+    }
+    return VirtualAlloc(0, kBufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void * data = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if(large_pages_)
+    {
+        data = mmap(0, kBufferSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        large = data != MAP_FAILED;
+    }
+#endif
+    if(data == MAP_FAILED)
+        data = mmap(0, kBufferSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return data == MAP_FAILED ? 0 : data;
+#endif
+}
+
+void BlockPool::Free(void * buffer, bool large)
+{
+#ifdef _WIN32
+    VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+    //large pages are released the same way
+    (void)large;
+    munmap(buffer, kBufferSize);
+#endif
+}
+
+}
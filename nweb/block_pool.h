@@ -0,0 +1,102 @@
+﻿#ifndef NWEB_BLOCK_POOL_H_
+#define NWEB_BLOCK_POOL_H_
+
+#include <mutex>
+#include <vector>
+#include "nweb.h"
+
+namespace nweb
+{
+
+//进程内共享的块缓冲池
+//缓冲大小固定且按页对齐, 空闲的缓冲被复用而不是归还给系统,
+//达到内存上限后Acquire失败, 调用者应等待其他缓冲释放
+class BlockPool
+{
+public:
+    struct Stats
+    {
+        uint64_t acquired;      //成功分配的次数
+        uint64_t hits;          //复用空闲缓冲的次数
+        uint64_t rejected;      //因达到上限而失败的次数
+        uint32_t in_use;        //正在使用的缓冲数
+        uint32_t peak_in_use;   //同时使用的缓冲数峰值
+        uint64_t reserved;      //已向系统申请的字节数
+        uint64_t peak_reserved; //已申请字节数的峰值
+    };
+
+    //Acquire失败后有缓冲可用时得到通知
+    class Listener
+    {
+    public:
+        virtual ~Listener() {}
+        //在释放缓冲的线程中调用, 不能再调用BlockPool
+        virtual void BufferAvailable() = 0;
+    };
+
+    //与MassFile的块大小一致
+    static const uint32_t kBufferSize = 0x400000;
+
+public:
+    BlockPool();
+
+    ~BlockPool();
+
+    static BlockPool & Instance();
+
+    //内存上限(字节), 0表示不限制, 已分配的缓冲不受影响
+    void SetCapacity(uint64_t capacity);
+
+    uint64_t GetCapacity() const;
+
+    //使用大页分配缓冲, 系统不支持或没有权限时退回普通页
+    void EnableLargePages(bool enable);
+
+    //获取一个kBufferSize大小的缓冲, 达到上限时返回0
+    void * Acquire();
+
+    void Release(void * buffer);
+
+    //释放所有空闲缓冲
+    void Trim();
+
+    //RemoveListener返回后不会再收到通知
+    void AddListener(Listener * listener);
+
+    void RemoveListener(Listener * listener);
+
+    Stats GetStats() const;
+
+private:
+    BlockPool(const BlockPool &);
+    BlockPool & operator=(const BlockPool &);
+
+    void * Allocate(bool & large);
+
+    void Free(void * buffer, bool large);
+
+    //有缓冲可用且此前Acquire失败过时通知所有Listener, 调用时持有锁
+    void NotifyAvailable();
+
+private:
+    struct Buffer
+    {
+        void * data;
+        bool large;
+    };
+    typedef std::vector<Buffer> Buffers;
+
+    mutable std::mutex lock_;
+    Buffers idle_;
+    Buffers busy_;
+    uint64_t capacity_;
+    bool large_pages_;
+    Stats stats_;
+    std::vector<Listener *> listeners_;
+    //上次通知之后有Acquire失败
+    bool starved_;
+};
+
+}
+
+#endif
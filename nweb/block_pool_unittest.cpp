@@ -0,0 +1,81 @@
+﻿#include "nweb_test.h"
+#include "block_pool.h"
+
+TEST(BlockPool, CapacityAndReuse)
+{
+    using namespace nweb;
+
+    BlockPool pool;
+    pool.SetCapacity(2 * BlockPool::kBufferSize);
+
+    void * first = pool.Acquire();
+    void * second = pool.Acquire();
+    ASSERT_TRUE(first != 0);
+    ASSERT_TRUE(second != 0);
+    //按页对齐
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(first) % 4096);
+    //达到上限
+    EXPECT_TRUE(pool.Acquire() == 0);
+
+    pool.Release(first);
+    void * third = pool.Acquire();
+    EXPECT_EQ(first, third);
+
+    auto stats = pool.GetStats();
+    EXPECT_EQ(3, stats.acquired);
+    EXPECT_EQ(1, stats.hits);
+    EXPECT_EQ(1, stats.rejected);
+    EXPECT_EQ(2, stats.peak_in_use);
+    EXPECT_EQ(2 * BlockPool::kBufferSize, stats.peak_reserved);
+
+    pool.Release(second);
+    pool.Release(third);
+    pool.Trim();
+    EXPECT_EQ(0, pool.GetStats().reserved);
+}
+
+namespace
+{
+
+class CountingListener : public nweb::BlockPool::Listener
+{
+public:
+    CountingListener() : count_(0) {}
+
+    void BufferAvailable()
+    {
+        ++count_;
+    }
+
+    int count_;
+};
+
+}
+
+TEST(BlockPool, NotifyAfterRejection)
+{
+    using namespace nweb;
+
+    BlockPool pool;
+    CountingListener listener;
+    pool.AddListener(&listener);
+    pool.SetCapacity(BlockPool::kBufferSize);
+
+    void * first = pool.Acquire();
+    ASSERT_TRUE(first != 0);
+    //没有Acquire失败过时不通知
+    pool.Release(first);
+    EXPECT_EQ(0, listener.count_);
+
+    first = pool.Acquire();
+    EXPECT_TRUE(pool.Acquire() == 0);
+    pool.Release(first);
+    EXPECT_EQ(1, listener.count_);
+
+    pool.RemoveListener(&listener);
+    first = pool.Acquire();
+    EXPECT_TRUE(pool.Acquire() == 0);
+    pool.Release(first);
+    EXPECT_EQ(1, listener.count_);
+    pool.Trim();
+}
@@ -0,0 +1,152 @@
+﻿#include <stdio.h>
+#include <vector>
+#include "block_pool.h"
+#include "block_file.h"
+#include "mass_file.h"
+#include "block_store.h"
+
+#ifndef _WIN32
+//POSIX上没有sprintf_s, 调用处都给出了缓冲长度
+#define sprintf_s snprintf
+#endif
+
+namespace nweb
+{
+
+BlockStore::BlockStore()
+{
+}
+
+bool BlockStore::Open(const char * root)
+{
+    root_.clear();
+    if(!root || !*root)
+        return false;
+    if(!BlockFile::CreateDirectoryRecursive(root))
+        return false;
+    root_ = root;
+    return true;
+}
+
+void BlockStore::Close()
+{
+    root_.clear();
+}
+
+bool BlockStore::IsOpen() const
+{
+    return !root_.empty();
+}
+
+bool BlockStore::IsUsable(const BlockManifest & manifest)
+{
+    return manifest.GetAlgorithm() == BlockManifest::kAlgorithmSha256 && 
+           !manifest.IsEmpty();
+}
+
+bool BlockStore::Contains(const BlockManifest & manifest, uint32_t block_id, 
+                          size_t size) const
+{
+    std::string path = GetPath(manifest, block_id, size);
+    return !path.empty() && BlockFile::IsFileExist(path.data());
+}
+
+bool BlockStore::Insert(const BlockManifest & manifest, uint32_t block_id, 
+                        const void * data, size_t size)
+{
+    std::string path = GetPath(manifest, block_id, size);
+    if(path.empty())
+        return false;
+    if(BlockFile::IsFileExist(path.data()))
+        return true;
+
+    //写完整之后才出现在仓库中, 中途失败不会留下残缺的块
+    std::string temp = path + ".tmp";
+    BlockFile file;
+    if(!file.Open(temp.data(), true, false))
+        return false;
+    bool bret = file.Write(data, static_cast<uint32_t>(size), 0);
+    file.Close();
+    if(bret)
+        bret = BlockFile::RenameFile(temp.data(), path.data());
+    if(!bret)
+        BlockFile::RemoveFile(temp.data());
+    return bret;
+}
+
+bool BlockStore::Load(const BlockManifest & manifest, uint32_t block_id, 
+                      void * buffer, size_t size)
+{
+    std::string path = GetPath(manifest, block_id, size);
+    if(path.empty() || !BlockFile::IsFileExist(path.data()))
+        return false;
+
+    BlockFile file;
+    if(!file.OpenForRead(path.data()))
+        return false;
+    return Verify(manifest, block_id, file, path, buffer, size);
+}
+
+bool BlockStore::Clone(const BlockManifest & manifest, uint32_t block_id, 
+                       MassFile & file, size_t size)
+{
+    std::string path = GetPath(manifest, block_id, size);
+    if(path.empty() || !BlockFile::IsFileExist(path.data()))
+        return false;
+
+    BlockFile source;
+    if(!source.OpenForRead(path.data()))
+        return false;
+
+    //内存达到上限时使用临时缓冲
+    void * buffer = BlockPool::Instance().Acquire();
+    std::vector<uint8_t> scratch;
+    void * data = buffer;
+    if(!data)
+    {
+        scratch.resize(size);
+        data = scratch.data();
+    }
+    bool bret = Verify(manifest, block_id, source, path, data, size) && 
+                (file.CloneBlockData(block_id, source) || 
+                 file.WriteBlockData(block_id, data, size));
+    BlockPool::Instance().Release(buffer);
+    return bret;
+}
+
+bool BlockStore::Verify(const BlockManifest & manifest, uint32_t block_id, 
+                        BlockFile & file, const std::string & path, 
+                        void * buffer, size_t size)
+{
+    if(file.Read(buffer, static_cast<uint32_t>(size), 0) && 
+       manifest.Match(block_id, buffer, size))
+        return true;
+
+    file.Close();
+    BlockFile::RemoveFile(path.data());
+    return false;
+}
+
+std::string BlockStore::GetPath(const BlockManifest & manifest, uint32_t block_id, 
+                                size_t size) const
+{
+    std::string path;
+    if(root_.empty() || !IsUsable(manifest))
+        return path;
+
+    uint8_t digest[BlockManifest::kMaxDigestSize] = {0};
+    if(!manifest.GetDigest(block_id, digest))
+        return path;
+
+    size_t digest_size = BlockManifest::GetDigestSize(manifest.GetAlgorithm());
+    char hex[BlockManifest::kMaxDigestSize * 2 + 1] = {0};
+    for(size_t i = 0; i < digest_size; ++i)
+        sprintf_s(hex + i * 2, sizeof(hex) - i * 2, "%02x", digest[i]);
+
+    char name[128];
+    sprintf_s(name, sizeof(name), "/%.2s/%s-%u", hex, hex, static_cast<uint32_t>(size));
+    path = root_ + name;
+    return path;
+}
+
+}
@@ -0,0 +1,65 @@
+﻿#ifndef NWEB_BLOCK_STORE_H_
+#define NWEB_BLOCK_STORE_H_
+
+#include <string>
+#include "nweb.h"
+#include "block_verifier.h"
+
+namespace nweb
+{
+
+class MassFile;
+class BlockFile;
+
+//按内容寻址的本地块仓库, 在多次下载之间共享内容相同的块
+//以清单中的SHA-256校验值为键, 每块保存为 <root>/<校验值前2位>/<校验值>-<大小>
+//CRC32不足以区分内容, 其他算法的清单不使用仓库
+//Open之后的方法可在多个线程同时调用, 块文件以共享方式只读打开
+class BlockStore
+{
+public:
+    BlockStore();
+
+    //目录不存在时创建
+    bool Open(const char * root);
+
+    void Close();
+
+    bool IsOpen() const;
+
+    //清单能否用于仓库
+    static bool IsUsable(const BlockManifest & manifest);
+
+    bool Contains(const BlockManifest & manifest, uint32_t block_id, size_t size) const;
+
+    //保存通过校验的块, 已存在时直接返回true
+    //先写临时文件再改名, 不等待落盘, 崩溃后残缺的文件在读取时被发现并删除
+    bool Insert(const BlockManifest & manifest, uint32_t block_id, 
+                const void * data, size_t size);
+
+    //读出块的内容并按清单校验, 不一致的文件被删除
+    bool Load(const BlockManifest & manifest, uint32_t block_id, 
+              void * buffer, size_t size);
+
+    //在文件系统支持时把块共享到目标文件(reflink), 否则写入读出的数据
+    //共享前仍读出校验一次, 不一致的文件被删除
+    //不更新目标文件的日志, 可在其他线程调用, 成功后由调用者MarkBlockSaved
+    bool Clone(const BlockManifest & manifest, uint32_t block_id, 
+               MassFile & file, size_t size);
+
+private:
+    //读出文件并按清单校验, 不一致时删除
+    bool Verify(const BlockManifest & manifest, uint32_t block_id, 
+                BlockFile & file, const std::string & path, 
+                void * buffer, size_t size);
+
+    std::string GetPath(const BlockManifest & manifest, uint32_t block_id, 
+                        size_t size) const;
+
+private:
+    std::string root_;
+};
+
+}
+
+#endif
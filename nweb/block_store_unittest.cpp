@@ -0,0 +1,131 @@
+﻿#include "nweb_test.h"
+#include <vector>
+#include "block_pool.h"
+#include "mass_file.h"
+#include "block_store.h"
+
+TEST(BlockStore, InsertLoadClone)
+{
+    using namespace nweb;
+
+    const char * content_path = ".\\build\\test\\store.bin";
+    const size_t kBlock = BlockPool::kBufferSize;
+    BlockFile::RemoveFile(content_path);
+    BlockFile::RemoveFile(".\\build\\test\\store.bin.ns");
+
+    std::vector<uint8_t> first(kBlock, 1);
+    std::vector<uint8_t> last(1024 * 1024, 2);
+    uint8_t digest[BlockManifest::kMaxDigestSize];
+    BlockManifest manifest;
+    manifest.Reset(BlockManifest::kAlgorithmSha256);
+    ASSERT_TRUE(BlockManifest::Digest(BlockManifest::kAlgorithmSha256, 
+                                      first.data(), first.size(), digest));
+    ASSERT_TRUE(manifest.SetDigest(0, digest, 32));
+    ASSERT_TRUE(BlockManifest::Digest(BlockManifest::kAlgorithmSha256, 
+                                      last.data(), last.size(), digest));
+    ASSERT_TRUE(manifest.SetDigest(1, digest, 32));
+
+    BlockStore store;
+    ASSERT_TRUE(store.Open(".\\build\\test\\store"));
+    //CRC32清单不使用仓库
+    BlockManifest crc;
+    crc.Reset(BlockManifest::kAlgorithmCrc32);
+    ASSERT_TRUE(crc.SetDigest(0, "00000000"));
+    EXPECT_FALSE(store.Insert(crc, 0, first.data(), first.size()));
+
+    ASSERT_TRUE(store.Insert(manifest, 0, first.data(), first.size()));
+    EXPECT_TRUE(store.Contains(manifest, 0, first.size()));
+    EXPECT_FALSE(store.Contains(manifest, 0, last.size()));
+
+    //内容与清单不一致的文件在读取时被删除
+    ASSERT_TRUE(store.Insert(manifest, 1, first.data(), last.size()));
+    std::vector<uint8_t> buffer(kBlock);
+    EXPECT_FALSE(store.Load(manifest, 1, buffer.data(), last.size()));
+    EXPECT_FALSE(store.Contains(manifest, 1, last.size()));
+    ASSERT_TRUE(store.Insert(manifest, 1, last.data(), last.size()));
+    ASSERT_TRUE(store.Load(manifest, 1, buffer.data(), last.size()));
+    EXPECT_EQ(0, memcmp(buffer.data(), last.data(), last.size()));
+
+    MassFile file;
+    ASSERT_TRUE(file.Create(content_path, kBlock + last.size()));
+    //文件系统不支持reflink时写入读出的数据, 由调用者记入日志
+    for(uint32_t bid = 0; bid < 2; ++bid)
+    {
+        size_t size = bid ? last.size() : first.size();
+        ASSERT_TRUE(store.Clone(manifest, bid, file, size));
+        EXPECT_FALSE(file.IsBlockValid(bid));
+        ASSERT_TRUE(file.MarkBlockSaved(bid));
+    }
+    EXPECT_TRUE(file.HasFinished());
+    uint8_t data[2] = {0};
+    ASSERT_TRUE(file.Read(kBlock - 1, data, 2, 0));
+    EXPECT_EQ(1, data[0]);
+    EXPECT_EQ(2, data[1]);
+
+    file.Close();
+    BlockFile::RemoveFile(content_path);
+    file.Finish();
+}
+
+TEST(BlockStore, FetchInBackground)
+{
+    using namespace nweb;
+
+    const char * content_path = ".\\build\\test\\fetch.bin";
+    const size_t kBlock = BlockPool::kBufferSize;
+    BlockFile::RemoveFile(content_path);
+    BlockFile::RemoveFile(".\\build\\test\\fetch.bin.ns");
+
+    std::vector<uint8_t> first(kBlock, 3);
+    std::vector<uint8_t> last(1024, 4);
+    uint8_t digest[BlockManifest::kMaxDigestSize];
+    BlockManifest manifest;
+    manifest.Reset(BlockManifest::kAlgorithmSha256);
+    ASSERT_TRUE(BlockManifest::Digest(BlockManifest::kAlgorithmSha256, 
+                                      first.data(), first.size(), digest));
+    ASSERT_TRUE(manifest.SetDigest(0, digest, 32));
+    ASSERT_TRUE(BlockManifest::Digest(BlockManifest::kAlgorithmSha256, 
+                                      last.data(), last.size(), digest));
+    ASSERT_TRUE(manifest.SetDigest(1, digest, 32));
+
+    BlockStore store;
+    ASSERT_TRUE(store.Open(".\\build\\test\\store"));
+    BlockVerifier verifier;
+    BlockVerifier::Outcomes outcomes;
+    //通过校验的块在校验线程中存入仓库
+    verifier.SetStore(&store);
+    void * buffer = BlockPool::Instance().Acquire();
+    ASSERT_TRUE(buffer != 0);
+    memcpy(buffer, first.data(), first.size());
+    verifier.Verify(manifest, 0, buffer, first.size());
+    verifier.Wait();
+    EXPECT_TRUE(store.Contains(manifest, 0, first.size()));
+
+    MassFile file;
+    ASSERT_TRUE(file.Create(content_path, kBlock + last.size()));
+    file.DeferValidation(true);
+    verifier.Fetch(manifest, store, file, 0, first.size());
+    verifier.Fetch(manifest, store, file, 1, last.size());
+    BlockVerifier::Outcomes all;
+    while(all.size() < 2)
+    {
+        verifier.Collect(outcomes);
+        all.insert(all.end(), outcomes.begin(), outcomes.end());
+        Sleep(1);
+    }
+    for(size_t i = 0; i < all.size(); ++i)
+    {
+        EXPECT_TRUE(all[i].fetched);
+        EXPECT_EQ(all[i].block_id == 0, all[i].passed);
+    }
+    //日志由调用者更新
+    EXPECT_FALSE(file.IsBlockValid(0));
+    ASSERT_TRUE(file.MarkBlockSaved(0));
+    uint8_t data = 0;
+    ASSERT_TRUE(file.Read(kBlock - 1, &data, 1, 0));
+    EXPECT_EQ(3, data);
+
+    file.Close();
+    BlockFile::RemoveFile(content_path);
+    BlockFile::RemoveFile(".\\build\\test\\fetch.bin.ns");
+}
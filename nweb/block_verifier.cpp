@@ -0,0 +1,314 @@
+﻿#include <string.h>
+#include <zlib/zlib.h>
+#include <cyassl/ctaocrypt/sha256.h>
+#include "block_pool.h"
+#include "block_store.h"
+#include "mass_file.h"
+#include "thread_pool.h"
+#include "block_verifier.h"
+
+namespace nweb
+{
+
+namespace
+{
+
+//校验线程池, 第一次提交任务时启动
+ThreadPool g_hash_threads(BlockVerifier::kDefaultThreadCount);
+
+int HexValue(char c)
+{
+    if('0' <= c && c <= '9')
+        return c - '0';
+    if('a' <= c && c <= 'f')
+        return c - 'a' + 10;
+    if('A' <= c && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+}
+
+/*
+BlockManifest
+*/
+BlockManifest::BlockManifest()
+    : algorithm_(kAlgorithmNone)
+{
+}
+
+void BlockManifest::Reset(Algorithm algorithm)
+{
+    algorithm_ = algorithm;
+    digests_.clear();
+    present_.clear();
+}
+
+BlockManifest::Algorithm BlockManifest::GetAlgorithm() const
+{
+    return algorithm_;
+}
+
+bool BlockManifest::IsEmpty() const
+{
+    return algorithm_ == kAlgorithmNone || present_.empty();
+}
+
+bool BlockManifest::SetDigest(uint32_t block_id, const void * digest, size_t size)
+{
+    size_t digest_size = GetDigestSize(algorithm_);
+    if(!digest_size || size != digest_size || !digest)
+        return false;
+
+    if(present_.size() <= block_id)
+    {
+        present_.resize(block_id + 1, false);
+        digests_.resize(present_.size() * digest_size, 0);
+    }
+    memcpy(&digests_[block_id * digest_size], digest, size);
+    present_[block_id] = true;
+    return true;
+}
+
+bool BlockManifest::SetDigest(uint32_t block_id, const char * hex)
+{
+    size_t digest_size = GetDigestSize(algorithm_);
+    if(!hex || strlen(hex) != digest_size * 2)
+        return false;
+
+    uint8_t digest[kMaxDigestSize] = {0};
+    for(size_t i = 0; i < digest_size; ++i)
+    {
+        int hi = HexValue(hex[i * 2]);
+        int lo = HexValue(hex[i * 2 + 1]);
+        if(hi < 0 || lo < 0)
+            return false;
+        digest[i] = static_cast<uint8_t>((hi << 4) | lo);
+    }
+    return SetDigest(block_id, digest, digest_size);
+}
+
+bool BlockManifest::HasDigest(uint32_t block_id) const
+{
+    return block_id < present_.size() && present_[block_id];
+}
+
+bool BlockManifest::GetDigest(uint32_t block_id, uint8_t * digest) const
+{
+    if(!HasDigest(block_id))
+        return false;
+
+    size_t digest_size = GetDigestSize(algorithm_);
+    memcpy(digest, &digests_[block_id * digest_size], digest_size);
+    return true;
+}
+
+bool BlockManifest::Match(uint32_t block_id, const void * data, size_t size) const
+{
+    if(!HasDigest(block_id))
+        return true;
+
+    uint8_t digest[kMaxDigestSize] = {0};
+    if(!Digest(algorithm_, data, size, digest))
+        return false;
+    size_t digest_size = GetDigestSize(algorithm_);
+    return !memcmp(digest, &digests_[block_id * digest_size], digest_size);
+}
+
+size_t BlockManifest::GetDigestSize(Algorithm algorithm)
+{
+    switch(algorithm)
+    {
+    case kAlgorithmCrc32:
+        return 4;
+    case kAlgorithmSha256:
+        return 32;
+    default:
+        return 0;
+    }
+}
+
+bool BlockManifest::Digest(Algorithm algorithm, const void * data, size_t size, 
+                           uint8_t * digest)
+{
+    const uint8_t * blob = reinterpret_cast<const uint8_t *>(data);
+    switch(algorithm)
+    {
+    case kAlgorithmCrc32:
+        {
+            uLong crc = crc32(0L, Z_NULL, 0);
+            crc = crc32(crc, blob, static_cast<uInt>(size));
+            digest[0] = static_cast<uint8_t>(crc >> 24);
+            digest[1] = static_cast<uint8_t>(crc >> 16);
+            digest[2] = static_cast<uint8_t>(crc >> 8);
+            digest[3] = static_cast<uint8_t>(crc);
+            return true;
+        }
+    case kAlgorithmSha256:
+        {
+            Sha256 sha;
+            if(InitSha256(&sha))
+                return false;
+            if(Sha256Update(&sha, blob, static_cast<word32>(size)))
+                return false;
+            return !Sha256Final(&sha, digest);
+        }
+    default:
+        return false;
+    }
+}
+
+/*
+BlockVerifier
+*/
+BlockVerifier::BlockVerifier()
+    : store_(0)
+{
+}
+
+BlockVerifier::~BlockVerifier()
+{
+    Wait();
+}
+
+void BlockVerifier::SetThreadCount(uint32_t count)
+{
+    g_hash_threads.SetThreadCount(count);
+}
+
+void BlockVerifier::SetStore(BlockStore * store)
+{
+    store_ = store;
+}
+
+void BlockVerifier::SetNotify(const std::function<void ()> & notify)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    notify_ = notify;
+}
+
+void BlockVerifier::Verify(const BlockManifest & manifest, uint32_t block_id, 
+                           void * buffer, size_t size)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        pending_.insert(block_id);
+    }
+
+    const BlockManifest * target = &manifest;
+    BlockStore * store = store_;
+    g_hash_threads.Post([=]()
+    {
+        Outcome outcome = {block_id, buffer, size, false, false};
+        outcome.passed = target->Match(block_id, buffer, size);
+        //缓冲交给写入线程之前存一份到仓库
+        if(outcome.passed && store)
+            store->Insert(*target, block_id, buffer, size);
+        Done(outcome);
+    });
+}
+
+void BlockVerifier::VerifyFile(const BlockManifest & manifest, const MassFile & file,
+                               uint32_t block_id, size_t size)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        pending_.insert(block_id);
+    }
+
+    const BlockManifest * target = &manifest;
+    const MassFile * source = &file;
+    g_hash_threads.Post([=]()
+    {
+        Outcome outcome = {block_id, 0, size, false, false};
+        //内存达到上限时使用临时缓冲
+        void * buffer = BlockPool::Instance().Acquire();
+        std::vector<uint8_t> scratch;
+        void * data = buffer;
+        if(!data)
+        {
+            scratch.resize(size);
+            data = scratch.data();
+        }
+        if(source->ReadBlock(block_id, data, size))
+            outcome.passed = target->Match(block_id, data, size);
+        BlockPool::Instance().Release(buffer);
+        Done(outcome);
+    });
+}
+
+void BlockVerifier::Fetch(const BlockManifest & manifest, BlockStore & store, 
+                          MassFile & file, uint32_t block_id, size_t size)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        pending_.insert(block_id);
+    }
+
+    const BlockManifest * target = &manifest;
+    BlockStore * source = &store;
+    MassFile * dest = &file;
+    g_hash_threads.Post([=]()
+    {
+        Outcome outcome = {block_id, 0, size, false, true};
+        //优先共享数据, 文件系统不支持时读出后写入
+        if(source->Contains(*target, block_id, size))
+            outcome.passed = source->Clone(*target, block_id, *dest, size);
+        Done(outcome);
+    });
+}
+
+void BlockVerifier::Collect(Outcomes & outcomes)
+{
+    outcomes.clear();
+    std::lock_guard<std::mutex> guard(lock_);
+    outcomes.swap(done_);
+    for(size_t i = 0; i < outcomes.size(); ++i)
+        pending_.erase(outcomes[i].block_id);
+}
+
+void BlockVerifier::Wait()
+{
+    Outcomes outcomes;
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        while(pending_.size() > done_.size())
+            idle_.wait(guard);
+        outcomes.swap(done_);
+        pending_.clear();
+    }
+    Discard(outcomes);
+}
+
+bool BlockVerifier::IsPending(uint32_t block_id) const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return pending_.count(block_id) != 0;
+}
+
+size_t BlockVerifier::PendingCount() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return pending_.size();
+}
+
+void BlockVerifier::Done(const Outcome & outcome)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        done_.push_back(outcome);
+        //持有锁调用, Wait返回后不会再有通知
+        if(notify_)
+            notify_();
+    }
+    idle_.notify_all();
+}
+
+void BlockVerifier::Discard(Outcomes & outcomes)
+{
+    for(size_t i = 0; i < outcomes.size(); ++i)
+        BlockPool::Instance().Release(outcomes[i].buffer);
+    outcomes.clear();
+}
+
+}
@@ -0,0 +1,140 @@
+﻿#ifndef NWEB_BLOCK_VERIFIER_H_
+#define NWEB_BLOCK_VERIFIER_H_
+
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+#include "nweb.h"
+
+namespace nweb
+{
+
+class MassFile;
+class BlockStore;
+
+//每块的校验值清单
+class BlockManifest
+{
+public:
+    enum Algorithm
+    {
+        kAlgorithmNone,
+        kAlgorithmCrc32,
+        kAlgorithmSha256,
+    };
+
+    static const uint32_t kMaxDigestSize = 32;
+
+public:
+    BlockManifest();
+
+    //清空清单并指定算法
+    void Reset(Algorithm algorithm);
+
+    Algorithm GetAlgorithm() const;
+
+    bool IsEmpty() const;
+
+    bool SetDigest(uint32_t block_id, const void * digest, size_t size);
+    //十六进制字符串, CRC32按大端序写成8个字符
+    bool SetDigest(uint32_t block_id, const char * hex);
+
+    bool HasDigest(uint32_t block_id) const;
+    //digest至少GetDigestSize字节, 块没有校验值时返回false
+    bool GetDigest(uint32_t block_id, uint8_t * digest) const;
+
+    //计算数据的校验值并与清单比较, 块没有校验值时视为通过
+    bool Match(uint32_t block_id, const void * data, size_t size) const;
+
+    static size_t GetDigestSize(Algorithm algorithm);
+
+    static bool Digest(Algorithm algorithm, const void * data, size_t size, 
+                       uint8_t * digest);
+
+private:
+    Algorithm algorithm_;
+    std::vector<uint8_t> digests_;
+    std::vector<bool> present_;
+};
+
+//在后台线程校验块数据, 下载循环只提交任务和取回结果
+//所有BlockVerifier共用一组校验线程
+class BlockVerifier
+{
+public:
+    struct Outcome
+    {
+        uint32_t block_id;
+        void * buffer;      //Verify提交的缓冲, VerifyFile和Fetch时为0
+        size_t size;
+        bool passed;
+        bool fetched;       //Fetch的结果, passed表示块已从仓库写入文件
+    };
+    typedef std::vector<Outcome> Outcomes;
+
+    static const uint32_t kDefaultThreadCount = 2;
+
+public:
+    BlockVerifier();
+
+    //等待所有任务结束
+    ~BlockVerifier();
+
+    //校验线程数, 对之后启动的线程生效
+    static void SetThreadCount(uint32_t count);
+
+    //Verify通过的块在校验线程中存入仓库, 0时不存
+    //对之后提交的任务生效, store在任务结束前须保持打开
+    void SetStore(BlockStore * store);
+
+    //每有一个任务完成就在校验线程中调用notify, 用于唤醒下载循环
+    //notify不能再调用本对象, 传空对象取消
+    void SetNotify(const std::function<void ()> & notify);
+
+    //校验内存中的块, buffer来自BlockPool, 在结果中交还调用者
+    //manifest在任务结束前须保持有效
+    void Verify(const BlockManifest & manifest, uint32_t block_id, 
+                void * buffer, size_t size);
+
+    //从文件读出写满的块再校验, file在任务结束前须保持打开
+    void VerifyFile(const BlockManifest & manifest, const MassFile & file,
+                    uint32_t block_id, size_t size);
+
+    //在校验线程中从仓库取得块并写入file, 不更新日志
+    //结果的passed为false时仓库中没有可用的数据
+    //store和file在任务结束前须保持打开
+    void Fetch(const BlockManifest & manifest, BlockStore & store, 
+               MassFile & file, uint32_t block_id, size_t size);
+
+    //取出已完成的结果, 不等待
+    void Collect(Outcomes & outcomes);
+
+    //等待所有任务结束, 未取回的结果被丢弃
+    void Wait();
+
+    bool IsPending(uint32_t block_id) const;
+
+    size_t PendingCount() const;
+
+private:
+    BlockVerifier(const BlockVerifier &);
+    BlockVerifier & operator=(const BlockVerifier &);
+
+    void Done(const Outcome & outcome);
+
+    void Discard(Outcomes & outcomes);
+
+private:
+    BlockStore * store_;
+    std::function<void ()> notify_;
+    mutable std::mutex lock_;
+    std::condition_variable idle_;
+    std::unordered_set<uint32_t> pending_;
+    Outcomes done_;
+};
+
+}
+
+#endif
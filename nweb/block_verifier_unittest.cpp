@@ -0,0 +1,59 @@
+﻿#include "nweb_test.h"
+#include "block_pool.h"
+#include "block_verifier.h"
+
+TEST(BlockManifest, Digest)
+{
+    using namespace nweb;
+
+    const char * data = "123456789";
+    BlockManifest manifest;
+    manifest.Reset(BlockManifest::kAlgorithmCrc32);
+    ASSERT_TRUE(manifest.SetDigest(0, "cbf43926"));
+    EXPECT_FALSE(manifest.SetDigest(1, "cbf439"));
+    EXPECT_TRUE(manifest.Match(0, data, 9));
+    EXPECT_FALSE(manifest.Match(0, data, 8));
+    //没有校验值的块视为通过
+    EXPECT_TRUE(manifest.Match(2, data, 8));
+
+    manifest.Reset(BlockManifest::kAlgorithmSha256);
+    ASSERT_TRUE(manifest.SetDigest(0, 
+        "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+    EXPECT_TRUE(manifest.Match(0, "abc", 3));
+    EXPECT_FALSE(manifest.Match(0, "abd", 3));
+}
+
+TEST(BlockVerifier, VerifyInBackground)
+{
+    using namespace nweb;
+
+    BlockManifest manifest;
+    manifest.Reset(BlockManifest::kAlgorithmCrc32);
+    manifest.SetDigest(0, "cbf43926");
+    manifest.SetDigest(1, "00000000");
+
+    BlockVerifier verifier;
+    void * good = BlockPool::Instance().Acquire();
+    void * bad = BlockPool::Instance().Acquire();
+    ASSERT_TRUE(good != 0 && bad != 0);
+    memcpy(good, "123456789", 9);
+    memcpy(bad, "123456789", 9);
+    verifier.Verify(manifest, 0, good, 9);
+    verifier.Verify(manifest, 1, bad, 9);
+    EXPECT_TRUE(verifier.IsPending(0));
+
+    BlockVerifier::Outcomes all;
+    BlockVerifier::Outcomes outcomes;
+    while(all.size() < 2)
+    {
+        verifier.Collect(outcomes);
+        all.insert(all.end(), outcomes.begin(), outcomes.end());
+        Sleep(1);
+    }
+    EXPECT_EQ(0, verifier.PendingCount());
+    for(size_t i = 0; i < all.size(); ++i)
+    {
+        EXPECT_EQ(all[i].block_id == 0, all[i].passed);
+        BlockPool::Instance().Release(all[i].buffer);
+    }
+}
@@ -0,0 +1,438 @@
+﻿#include <errno.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define NWEB_HAS_URING
+#endif
+#include "block_pool.h"
+#include "mass_file.h"
+#include "thread_pool.h"
+#include "block_writer.h"
+
+namespace nweb
+{
+
+namespace
+{
+
+//写入线程池, 第一次提交任务时启动
+ThreadPool g_write_threads(BlockWriter::kDefaultThreadCount);
+
+//提交队列长度, 也是io_uring上同时在途的写入数
+const uint32_t kUringEntries = 32;
+
+}
+
+struct BlockWriter::Task
+{
+    Outcome outcome;
+    intptr_t handle;
+    uint64_t offset;
+    size_t written;
+};
+
+#ifdef NWEB_HAS_URING
+//直接使用系统调用的最小io_uring封装, 只提交IORING_OP_WRITE
+class BlockWriter::Uring
+{
+public:
+    Uring()
+        : fd_(-1), sq_ring_(MAP_FAILED), cq_ring_(MAP_FAILED), sqes_(MAP_FAILED),
+          sq_ring_size_(0), cq_ring_size_(0), sqes_size_(0), entries_(0), inflight_(0)
+    {
+    }
+
+    ~Uring()
+    {
+        if(sqes_ != MAP_FAILED)
+            munmap(sqes_, sqes_size_);
+        if(cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+            munmap(cq_ring_, cq_ring_size_);
+        if(sq_ring_ != MAP_FAILED)
+            munmap(sq_ring_, sq_ring_size_);
+        if(fd_ != -1)
+            close(fd_);
+    }
+
+    bool Init(uint32_t entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if(fd_ < 0)
+            return false;
+        //IORING_OP_WRITE与IORING_FEAT_RW_CUR_POS同时出现(5.6)
+        if(!(params.features & IORING_FEAT_RW_CUR_POS))
+            return false;
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if(single)
+            sq_ring_size_ = cq_ring_size_ = (std::max)(sq_ring_size_, cq_ring_size_);
+
+        sq_ring_ = mmap(0, sq_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if(sq_ring_ == MAP_FAILED)
+            return false;
+        cq_ring_ = sq_ring_;
+        if(!single)
+        {
+            cq_ring_ = mmap(0, cq_ring_size_, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+            if(cq_ring_ == MAP_FAILED)
+                return false;
+        }
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = mmap(0, sqes_size_, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if(sqes_ == MAP_FAILED)
+            return false;
+
+        char * sq = reinterpret_cast<char *>(sq_ring_);
+        sq_tail_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<uint32_t *>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<uint32_t *>(sq + params.sq_off.array);
+        char * cq = reinterpret_cast<char *>(cq_ring_);
+        cq_head_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<uint32_t *>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<uint32_t *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        entries_ = params.sq_entries;
+        return true;
+    }
+
+    //每次提交一项并立即进入内核, 完成队列不会溢出
+    bool Write(int fd, const void * data, uint32_t size, uint64_t offset,
+               uint64_t user_data)
+    {
+        if(inflight_ >= entries_)
+            return false;
+
+        uint32_t tail = *sq_tail_;
+        uint32_t index = tail & sq_mask_;
+        io_uring_sqe & sqe = reinterpret_cast<io_uring_sqe *>(sqes_)[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_WRITE;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(data);
+        sqe.len = size;
+        sqe.off = offset;
+        sqe.user_data = user_data;
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+        int ret = 0;
+        do
+        {
+            ret = static_cast<int>(syscall(__NR_io_uring_enter, fd_, 1, 0, 0, 0, 0));
+        } while(ret < 0 && errno == EINTR);
+        if(ret != 1)
+        {//未被内核取走, 撤回
+            __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+            return false;
+        }
+        inflight_++;
+        return true;
+    }
+
+    bool Complete(uint64_t & user_data, int & result, bool wait)
+    {
+        uint32_t head = *cq_head_;
+        while(head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+        {
+            if(!wait || !inflight_)
+                return false;
+            long ret = syscall(__NR_io_uring_enter, fd_, 0, 1,
+                               IORING_ENTER_GETEVENTS, 0, 0);
+            if(ret < 0 && errno != EINTR)
+                return false;
+        }
+        const io_uring_cqe & cqe = cqes_[head & cq_mask_];
+        user_data = cqe.user_data;
+        result = cqe.res;
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        inflight_--;
+        return true;
+    }
+
+    uint32_t InFlight() const
+    {
+        return inflight_;
+    }
+
+private:
+    int fd_;
+    void * sq_ring_;
+    void * cq_ring_;
+    void * sqes_;
+    size_t sq_ring_size_;
+    size_t cq_ring_size_;
+    size_t sqes_size_;
+    uint32_t * sq_tail_;
+    uint32_t sq_mask_;
+    uint32_t * sq_array_;
+    uint32_t * cq_head_;
+    uint32_t * cq_tail_;
+    uint32_t cq_mask_;
+    io_uring_cqe * cqes_;
+    uint32_t entries_;
+    uint32_t inflight_;
+};
+#else
+//没有io_uring的平台, Init总是失败
+class BlockWriter::Uring
+{
+public:
+    bool Init(uint32_t entries)
+    {
+        return false;
+    }
+
+    bool Write(int fd, const void * data, uint32_t size, uint64_t offset,
+               uint64_t user_data)
+    {
+        return false;
+    }
+
+    bool Complete(uint64_t & user_data, int & result, bool wait)
+    {
+        return false;
+    }
+
+    uint32_t InFlight() const
+    {
+        return 0;
+    }
+};
+#endif
+
+/*
+BlockWriter
+*/
+BlockWriter::BlockWriter()
+    : budget_(kDefaultBudget), inflight_(0),
+      uring_enabled_(true), uring_tried_(false), uring_(0)
+{
+}
+
+BlockWriter::~BlockWriter()
+{
+    Wait();
+    //未取回的缓冲归还BlockPool
+    Outcomes outcomes;
+    Collect(outcomes);
+    for(size_t i = 0; i < outcomes.size(); ++i)
+        BlockPool::Instance().Release(outcomes[i].buffer);
+    delete uring_;
+}
+
+void BlockWriter::SetThreadCount(uint32_t count)
+{
+    g_write_threads.SetThreadCount(count);
+}
+
+void BlockWriter::EnableUring(bool enable)
+{
+    uring_enabled_ = enable;
+}
+
+void BlockWriter::SetBudget(uint64_t budget)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    budget_ = budget;
+}
+
+void BlockWriter::SetNotify(const std::function<void ()> & notify)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    notify_ = notify;
+}
+
+bool BlockWriter::Write(MassFile & file, uint32_t block_id, void * buffer, size_t size)
+{
+    uint64_t block_start = 0;
+    size_t block_size = 0;
+    if(!file.GetBlockInfo(block_id, block_start, block_size) || block_size != size)
+        return false;
+
+    bool notifying = false;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if(inflight_ && inflight_ + size > budget_)
+            return false;
+        inflight_ += size;
+        pending_.insert(block_id);
+        notifying = static_cast<bool>(notify_);
+    }
+
+    if(!uring_tried_)
+    {//第一次写入时创建, 失败后不再尝试
+        uring_tried_ = true;
+        if(uring_enabled_)
+        {
+            uring_ = new Uring;
+            if(!uring_->Init(kUringEntries))
+            {
+                delete uring_;
+                uring_ = 0;
+            }
+        }
+    }
+
+    if(uring_ && !notifying)
+    {
+        //先腾出已完成的位置
+        Reap(false);
+        Task * task = new Task;
+        Outcome outcome = {block_id, buffer, size, false};
+        task->outcome = outcome;
+        task->handle = file.GetNativeHandle();
+        task->offset = block_start;
+        task->written = 0;
+        if(SubmitUring(task))
+        {
+            uring_tasks_.insert(task);
+            return true;
+        }
+        //队列已满, 交给写入线程
+        delete task;
+    }
+
+    MassFile * target = &file;
+    g_write_threads.Post([=]()
+    {
+        Outcome outcome = {block_id, buffer, size, false};
+        outcome.written = target->WriteBlockData(block_id, buffer, size);
+        Done(outcome);
+    });
+    return true;
+}
+
+void BlockWriter::Collect(Outcomes & outcomes)
+{
+    if(uring_)
+        Reap(false);
+
+    outcomes.clear();
+    std::lock_guard<std::mutex> guard(lock_);
+    outcomes.swap(done_);
+    for(size_t i = 0; i < outcomes.size(); ++i)
+    {
+        pending_.erase(outcomes[i].block_id);
+        inflight_ -= outcomes[i].size;
+    }
+}
+
+bool BlockWriter::Wait()
+{
+    bool reaped = true;
+    //io_uring上的写入只能在本线程取回
+    while(uring_ && uring_->InFlight())
+    {
+        if(!Reap(true))
+        {//取不回的写入永远不会完成, 不能再等
+            AbandonUring();
+            reaped = false;
+        }
+    }
+
+    std::unique_lock<std::mutex> guard(lock_);
+    while(pending_.size() > done_.size())
+        idle_.wait(guard);
+    return reaped;
+}
+
+bool BlockWriter::IsPending(uint32_t block_id) const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return pending_.count(block_id) != 0;
+}
+
+size_t BlockWriter::PendingCount() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return pending_.size();
+}
+
+uint64_t BlockWriter::InflightSize() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return inflight_;
+}
+
+bool BlockWriter::IsUringActive() const
+{
+    return uring_ != 0;
+}
+
+bool BlockWriter::SubmitUring(Task * task)
+{
+    const char * data = reinterpret_cast<const char *>(task->outcome.buffer);
+    size_t rest = task->outcome.size - task->written;
+    return uring_->Write(static_cast<int>(task->handle), data + task->written,
+                         static_cast<uint32_t>(rest), task->offset + task->written,
+                         reinterpret_cast<uint64_t>(task));
+}
+
+size_t BlockWriter::Reap(bool wait)
+{
+    size_t count = 0;
+    uint64_t user_data = 0;
+    int result = 0;
+    while(uring_->Complete(user_data, result, wait))
+    {
+        wait = false;
+        count++;
+        Task * task = reinterpret_cast<Task *>(user_data);
+        if(result > 0)
+            task->written += result;
+        //写入不完整或被中断时提交剩余部分
+        bool retry = result > 0 ? task->written < task->outcome.size
+                                : result == -EINTR || result == -EAGAIN;
+        if(retry && SubmitUring(task))
+            continue;
+
+        task->outcome.written = task->written == task->outcome.size;
+        Done(task->outcome);
+        uring_tasks_.erase(task);
+        delete task;
+    }
+    return count;
+}
+
+void BlockWriter::AbandonUring()
+{
+    for(auto iter = uring_tasks_.begin(); iter != uring_tasks_.end(); ++iter)
+    {
+        Task * task = *iter;
+        task->outcome.written = false;
+        //内核可能仍在读取, 缓冲宁可不再使用
+        task->outcome.buffer = 0;
+        Done(task->outcome);
+        delete task;
+    }
+    uring_tasks_.clear();
+    //关闭后内核取消或做完剩余的请求, 不会再产生完成事件
+    delete uring_;
+    uring_ = 0;
+}
+
+void BlockWriter::Done(const Outcome & outcome)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        done_.push_back(outcome);
+        //持有锁调用, Wait返回后不会再有通知
+        if(notify_)
+            notify_();
+    }
+    idle_.notify_all();
+}
+
+}
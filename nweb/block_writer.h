@@ -0,0 +1,112 @@
+﻿#ifndef NWEB_BLOCK_WRITER_H_
+#define NWEB_BLOCK_WRITER_H_
+
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+#include "nweb.h"
+
+namespace nweb
+{
+
+class MassFile;
+
+//在后台写入整块数据, 下载循环只提交任务和取回结果
+//Linux上使用io_uring, 内核不支持或其他平台上退回写入线程池
+//写入完成后由调用者记入日志(MassFile::MarkBlockSaved), 块在数据写完之前不会被标记为有效
+class BlockWriter
+{
+public:
+    struct Outcome
+    {
+        uint32_t block_id;
+        void * buffer;      //Write提交的缓冲, 在结果中交还调用者
+        size_t size;
+        bool written;
+    };
+    typedef std::vector<Outcome> Outcomes;
+
+    static const uint32_t kDefaultThreadCount = 2;
+    //在途数据量的默认上限(字节)
+    static const uint64_t kDefaultBudget = 0x4000000;
+
+public:
+    BlockWriter();
+
+    //等待所有写入结束
+    ~BlockWriter();
+
+    //写入线程数, 对之后启动的线程生效
+    static void SetThreadCount(uint32_t count);
+
+    //是否尝试使用io_uring, 需在第一次Write之前设置
+    void EnableUring(bool enable);
+
+    //在途数据量上限, 结果取回之前的块都计入, 没有在途写入时总是接受一块
+    void SetBudget(uint64_t budget);
+
+    //每有一个写入完成就在写入线程中调用notify, 用于唤醒下载循环
+    //io_uring的完成事件只在下载线程取回, 设置后新的写入都交给写入线程
+    //notify不能再调用本对象, 传空对象取消
+    void SetNotify(const std::function<void ()> & notify);
+
+    //提交整块写入, 在途数据超出上限时返回false, 调用者应同步写入
+    //buffer来自BlockPool, 在结果中交还调用者, file在写入结束前须保持打开
+    bool Write(MassFile & file, uint32_t block_id, void * buffer, size_t size);
+
+    //取出已完成的结果, 不等待
+    void Collect(Outcomes & outcomes);
+
+    //等待所有写入结束, 结果留待Collect取回
+    //io_uring无法取回完成事件时不再等待, 在途的写入记为失败并返回false
+    //这些结果的buffer为0, 缓冲可能仍被内核读取, 不再交还BlockPool
+    bool Wait();
+
+    bool IsPending(uint32_t block_id) const;
+
+    size_t PendingCount() const;
+
+    //已提交但结果尚未取回的数据量
+    uint64_t InflightSize() const;
+
+    //写入经由io_uring提交
+    bool IsUringActive() const;
+
+private:
+    BlockWriter(const BlockWriter &);
+    BlockWriter & operator=(const BlockWriter &);
+
+    class Uring;
+    struct Task;
+
+    bool SubmitUring(Task * task);
+
+    //取回io_uring的完成事件, wait为true时至少等待一个, 返回取回的数量
+    size_t Reap(bool wait);
+
+    //io_uring出错后放弃在途的写入并关闭它, 之后的写入交给写入线程
+    void AbandonUring();
+
+    void Done(const Outcome & outcome);
+
+private:
+    mutable std::mutex lock_;
+    std::condition_variable idle_;
+    std::unordered_set<uint32_t> pending_;
+    Outcomes done_;
+    uint64_t budget_;
+    uint64_t inflight_;
+    std::function<void ()> notify_;
+    bool uring_enabled_;
+    bool uring_tried_;
+    //只在下载线程使用, 未启用时为0
+    Uring * uring_;
+    //已提交到io_uring尚未完成的任务, 只在下载线程使用
+    std::unordered_set<Task *> uring_tasks_;
+};
+
+}
+
+#endif
@@ -0,0 +1,121 @@
+﻿#include "nweb_test.h"
+#include <vector>
+#include "block_pool.h"
+#include "mass_file.h"
+#include "block_writer.h"
+
+TEST(BlockWriter, WriteInBackground)
+{
+    using namespace nweb;
+
+    const char * content_path = ".\\build\\test\\writer.bin";
+    const size_t kBlock = BlockPool::kBufferSize;
+    BlockFile::RemoveFile(content_path);
+    BlockFile::RemoveFile(".\\build\\test\\writer.bin.ns");
+
+    MassFile file;
+    ASSERT_TRUE(file.Create(content_path, 9 * 1024 * 1024));
+
+    BlockWriter writer;
+    writer.SetBudget(2 * kBlock);
+    void * first = BlockPool::Instance().Acquire();
+    void * second = BlockPool::Instance().Acquire();
+    void * last = BlockPool::Instance().Acquire();
+    ASSERT_TRUE(first != 0 && second != 0 && last != 0);
+    memset(first, 1, kBlock);
+    memset(second, 2, kBlock);
+    memset(last, 3, kBlock);
+
+    ASSERT_TRUE(writer.Write(file, 0, first, kBlock));
+    ASSERT_TRUE(writer.Write(file, 1, second, kBlock));
+    //超出在途上限, 由调用者同步写入
+    EXPECT_FALSE(writer.Write(file, 2, last, 1024 * 1024));
+    EXPECT_TRUE(writer.IsPending(1));
+    //写入结果取回之前块不是有效的
+    EXPECT_FALSE(file.IsBlockValid(0));
+
+    writer.Wait();
+    BlockWriter::Outcomes outcomes;
+    writer.Collect(outcomes);
+    ASSERT_EQ(2, outcomes.size());
+    EXPECT_EQ(0, writer.InflightSize());
+    for(size_t i = 0; i < outcomes.size(); ++i)
+    {
+        EXPECT_TRUE(outcomes[i].written);
+        EXPECT_TRUE(file.MarkBlockSaved(outcomes[i].block_id));
+        BlockPool::Instance().Release(outcomes[i].buffer);
+    }
+
+    ASSERT_TRUE(writer.Write(file, 2, last, 1024 * 1024));
+    writer.Wait();
+    writer.Collect(outcomes);
+    ASSERT_EQ(1, outcomes.size());
+    EXPECT_TRUE(outcomes[0].written);
+    EXPECT_TRUE(file.MarkBlockSaved(2));
+    BlockPool::Instance().Release(last);
+
+    EXPECT_TRUE(file.HasFinished());
+    char data[4] = {0};
+    ASSERT_TRUE(file.Read(kBlock - 2, data, 4, 0));
+    EXPECT_EQ(1, data[1]);
+    EXPECT_EQ(2, data[2]);
+
+    file.Close();
+    BlockFile::RemoveFile(content_path);
+    file.Finish();
+}
+
+TEST(BlockWriter, WriteWhileReverifying)
+{
+    using namespace nweb;
+
+    const char * content_path = ".\\build\\test\\reverify.bin";
+    const size_t kBlock = BlockPool::kBufferSize;
+    const uint32_t kCount = 16;
+    BlockFile::RemoveFile(content_path);
+    BlockFile::RemoveFile(".\\build\\test\\reverify.bin.ns");
+
+    MassFile file;
+    ASSERT_TRUE(file.Create(content_path, kCount * kBlock));
+    file.DeferValidation(true);
+    std::vector<uint8_t> data(kBlock, 4);
+    for(uint32_t i = 0; i < kCount / 2; ++i)
+        ASSERT_TRUE(file.SaveBlock(i, data.data(), kBlock));
+
+    //后一半在后台写入时, 前一半重新校验, 日志随之加长并重新映射
+    BlockWriter writer;
+    writer.SetBudget(kCount * kBlock);
+    for(uint32_t i = kCount / 2; i < kCount; ++i)
+    {
+        void * buffer = BlockPool::Instance().Acquire();
+        ASSERT_TRUE(buffer != 0);
+        memset(buffer, 5, kBlock);
+        ASSERT_TRUE(writer.Write(file, i, buffer, kBlock));
+    }
+    ASSERT_EQ(kCount / 2, file.ReopenBlocks());
+    for(uint32_t i = 0; i < kCount / 2; ++i)
+        ASSERT_TRUE(file.CommitBlock(i));
+
+    writer.Wait();
+    BlockWriter::Outcomes outcomes;
+    writer.Collect(outcomes);
+    ASSERT_EQ(kCount / 2, outcomes.size());
+    for(size_t i = 0; i < outcomes.size(); ++i)
+    {
+        EXPECT_TRUE(outcomes[i].written);
+        EXPECT_TRUE(file.MarkBlockSaved(outcomes[i].block_id));
+        BlockPool::Instance().Release(outcomes[i].buffer);
+    }
+    EXPECT_TRUE(file.HasFinished());
+    file.Close();
+
+    ASSERT_TRUE(file.Open(content_path));
+    EXPECT_TRUE(file.HasFinished());
+    char edge[2] = {0};
+    ASSERT_TRUE(file.Read(kCount / 2 * kBlock - 1, edge, 2, 0));
+    EXPECT_EQ(4, edge[0]);
+    EXPECT_EQ(5, edge[1]);
+    file.Close();
+    BlockFile::RemoveFile(content_path);
+    file.Finish();
+}
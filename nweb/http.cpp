@@ -1,15 +1,19 @@
-﻿#include <curl\curl.h>
+﻿#include <vector>
+#include <curl\curl.h>
 #include <curl\curl_ext.h>
 #include "url.h"
+#include "rate_limiter.h"
+#include "http_stats.h"
+#include "http_pool.h"
 #include "http.h"
 
 
 namespace nweb
 {
 
-const char * kContentLength     = "content-length";
-const char * kLastModified      = "last-modified";
-const char * kContentRange      = "content-range";
+const char * kByteRangesType    = "multipart/byteranges";
+//longest line accepted between the parts of a multipart body
+const size_t kMaxPartLineSize   = 0x800;
 
 const char * strnchr(const char * str, size_t len, char chr) 
 {
@@ -21,67 +25,67 @@ const char * strnchr(const char * str, size_t len, char chr)
     return nullptr;
 }
 
-uint64_t strtoui64(const char * str)
+//digits at [p, end) with leading spaces, p is left after them
+bool parse_number(const char *& p, const char * end, uint64_t & number)
 {
-    char ** end = 0;
-    return _strtoui64(str, end, 10);
+    while(p < end && *p == ' ')
+        ++p;
+    const char * start = p;
+    number = 0;
+    while(p < end && *p >= '0' && *p <= '9')
+    {
+        number = number * 10 + (*p - '0');
+        ++p;
+    }
+    return p != start;
 }
 
-int parse_status_code(const char * line, size_t length)
+//"Key: value" with the value trimmed, false if the line isn't a header
+bool split_header(const char * line, size_t length, 
+                  StringPiece & key, StringPiece & value)
 {
-    const char * kPattern = "HTTP/1.1";
-
-    for(size_t i = 0; i < length; ++i)
-    {
-        if(kPattern[i] == 0)
-        {
-            if(length - i > 4)
-            {
-                char code[8] = {0};
-                strncpy_s(code, &line[i], 4);
-                return std::atoi(code);
-            }
-        }
+    auto colon = strnchr(line, length, ':');
+    if(!colon || colon == line)
+        return false;
 
-        if(line[i] != kPattern[i])
-            break;
-    }
-    return 0;
+    const char * begin = colon + 1;
+    const char * end = line + length;
+    while(begin < end && (*begin == ' ' || *begin == '\t'))
+        ++begin;
+    while(end > begin && (end[-1] == ' ' || end[-1] == '\t' || 
+                          end[-1] == '\r' || end[-1] == '\n'))
+        --end;
+    key = StringPiece(line, colon - line);
+    value = StringPiece(begin, end - begin);
+    return true;
 }
 
-typedef std::pair<std::string, std::string> Header;
-
-Header parse_header(const char * line, size_t length)
+int MultiSocketCallback(CURL * easy, curl_socket_t socket, int what,
+                        void * param, void * socket_param)
 {
-    Header header;
-    
-    if(!length)
-        return header;
-    auto colon = strnchr(line, length, ':');
-    if(!colon)
-        return header;
+    auto multi = reinterpret_cast<HttpMulti *>(param);
+    auto watcher = multi ? multi->GetWatcher() : nullptr;
+    if(!watcher)
+        return 0;
 
-    size_t key_len = colon - line;
-    const char * value = colon + 1;
-    size_t value_len = length - key_len - 1;
+    int watch = HttpSocketWatcher::kWatchNone;
+    if(what == CURL_POLL_IN)
+        watch = HttpSocketWatcher::kWatchIn;
+    else if(what == CURL_POLL_OUT)
+        watch = HttpSocketWatcher::kWatchOut;
+    else if(what == CURL_POLL_INOUT)
+        watch = HttpSocketWatcher::kWatchInOut;
+    watcher->WatchSocket(static_cast<intptr_t>(socket), watch);
+    return 0;
+}
 
-    //trim left whitespace in value
-    while(value_len)
-    {
-        if(*value == ' ') 
-        {
-            ++value;
-            --value_len;
-            continue;
-        }
-        break;
-    }
-    header.first.assign(line, key_len);
-    header.second.assign(value, value_len);
-    /* store key in low case */
-    std::string & key = header.first;
-    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
-    return header;
+int MultiTimerCallback(CURLM * curl_multi, long timeout_ms, void * param)
+{
+    auto multi = reinterpret_cast<HttpMulti *>(param);
+    auto watcher = multi ? multi->GetWatcher() : nullptr;
+    if(watcher)
+        watcher->WatchTimer(timeout_ms);
+    return 0;
 }
 
 HttpConnResult TranslateCurlCode(CURLcode code)
@@ -143,12 +147,58 @@ size_t HttpRange::size() const
     return size_;
 }
 
+//"key: value" appended to [list], the new node is returned through [tail]
+curl_slist * append_line(curl_slist * list, curl_slist *& tail,
+                         const StringPiece & key, const StringPiece & value)
+{
+    const size_t kMaxLineSize = 0x800;
+    char line[kMaxLineSize];
+    size_t line_length = key.size() + value.size() + 2;
+    if(line_length >= kMaxLineSize)
+        return list;
+
+    memcpy(line, key.data(), key.size());
+    line[key.size()] = ':';
+    line[key.size() + 1] = ' ';
+    memcpy(line + key.size() + 2, value.data(), value.size());
+    line[line_length] = 0;
+
+    curl_slist * node = curl_slist_append(0, line);
+    if(!node)
+        return list;
+    if(tail)
+        tail->next = node;
+    tail = node;
+    return list ? list : node;
+}
+
+//HttpHeaderSet
+HttpHeaderSet::HttpHeaderSet(const HttpHeaderList & headers)
+    : lines_(0), count_(0)
+{
+    curl_slist * tail = 0;
+    for(size_t i = 0; i < headers.Count(); ++i)
+        lines_ = append_line(lines_, tail, headers.KeyAt(i), headers.ValueAt(i));
+    for(auto node = lines_; node; node = node->next)
+        ++count_;
+}
+
+HttpHeaderSet::~HttpHeaderSet()
+{
+    curl_slist_free_all(lines_);
+}
+
+size_t HttpHeaderSet::Count() const
+{
+    return count_;
+}
+
 //HttpRequest
 void HttpRequest::SetRange(uint64_t first, uint64_t last)
 {
     char litery_range[64];
-    sprintf_s(litery_range, "bytes=%I64u-%I64u", first, last);
-    AddHeader("Range", litery_range);
+    sprintf_s(litery_range, "%I64u-%I64u", first, last);
+    range_ = litery_range;
 }
 
 void HttpRequest::SetRange(const HttpRange & range)
@@ -156,29 +206,93 @@ void HttpRequest::SetRange(const HttpRange & range)
     return SetRange(range.first(), range.last()); 
 }
 
+void HttpRequest::SetRanges(const HttpRanges & ranges)
+{
+    if(ranges.empty())
+        return;
+
+    range_.clear();
+    for(size_t i = 0; i < ranges.size(); ++i)
+    {
+        char litery_range[64];
+        sprintf_s(litery_range, i ? ",%I64u-%I64u" : "%I64u-%I64u", 
+                  ranges[i].first(), ranges[i].last());
+        range_ += litery_range;
+    }
+}
+
+void HttpRequest::ClearRange()
+{
+    range_.clear();
+}
+
+void HttpRequest::SetHeaderSet(const HttpHeaderSet * header_set)
+{
+    if(header_set_ == header_set)
+        return;
+    header_set_ = header_set;
+    lines_dirty_ = true;
+}
+
 void HttpRequest::AddHeader(const char * key, const char * value)
 {
-    headers_[key] = value;
+    headers_.Set(key, value);
+    lines_dirty_ = true;
 }
 
 void HttpRequest::RemoveHeader(const char * key)
 {
-    auto iter = headers_.find(key);
-    if(iter != headers_.end())
-        headers_.erase(iter);
+    headers_.Remove(key);
+    lines_dirty_ = true;
 }
 
 void HttpRequest::ClearHeaders()
 {
-    headers_.swap(HttpHeaders());
+    headers_.Clear();
+    lines_dirty_ = true;
 }
 
 HttpRequest::HttpRequest()
+    : header_set_(0), lines_(0), lines_tail_(0), lines_dirty_(false)
 {
 }
 
 HttpRequest::~HttpRequest()
 {
+    FreeHeaderLines();
+}
+
+curl_slist * HttpRequest::GetHeaderLines()
+{
+    if(lines_dirty_)
+    {
+        FreeHeaderLines();
+        for(size_t i = 0; i < headers_.Count(); ++i)
+            lines_ = append_line(lines_, lines_tail_, headers_.KeyAt(i), headers_.ValueAt(i));
+        lines_dirty_ = false;
+    }
+
+    curl_slist * shared = header_set_ ? header_set_->lines_ : 0;
+    if(!lines_)
+        return shared;
+    //the shared lines are only pointed to, never copied
+    lines_tail_->next = shared;
+    return lines_;
+}
+
+const char * HttpRequest::GetRangeSpec() const
+{
+    return range_.empty() ? 0 : range_.data();
+}
+
+void HttpRequest::FreeHeaderLines()
+{
+    //the shared set frees its own lines
+    if(lines_tail_)
+        lines_tail_->next = 0;
+    curl_slist_free_all(lines_);
+    lines_ = 0;
+    lines_tail_ = 0;
 }
 
 size_t HttpRequest::ReadChunk(void * blob, size_t size)
@@ -195,6 +309,7 @@ bool HttpRequest::GetContentLength(uint32_t & length)
 HttpResponse::HttpResponse()
     : status_code_(0)
 {
+    ClearHeaders();
 }
 
 HttpResponse::~HttpResponse()
@@ -206,6 +321,11 @@ size_t HttpResponse::WriteChunk(const void * blob, size_t size)
     return size;
 }
 
+bool HttpResponse::IsWriteReady() const
+{
+    return true;
+}
+
 int HttpResponse::GetStatusCode() const
 {
     return status_code_;
@@ -213,71 +333,305 @@ int HttpResponse::GetStatusCode() const
 
 bool HttpResponse::HasContentLength() const
 {
-    auto iter = headers_.find(kContentLength);
-    return iter != headers_.end();
+    return has_content_length_;
 }
 
 uint64_t HttpResponse::GetContentLength() const
 {
-    uint64_t length = 0;
-    auto iter = headers_.find(kContentLength);
-    if(iter != headers_.end())
-        length = strtoui64(iter->second.data());
-    return length;
+    return content_length_;
 }
 
 bool HttpResponse::HasLastModified() const
 {
-    auto iter = headers_.find(kLastModified);
-    return iter != headers_.end();
+    return has_last_modified_;
 }
 
 time_t HttpResponse::GetLastModified() const
 {
-    time_t date = -1;
-    auto iter = headers_.find(kLastModified);
-    if(iter != headers_.end())
-        date = curl_parse_date(iter->second.data());
-    return date;
+    return last_modified_;
+}
+
+std::string HttpResponse::GetETag() const
+{
+    StringPiece value;
+    if(!headers_.Find(HttpHeaderList::kETag, value))
+        return std::string();
+    return value.ToString();
 }
 
 bool HttpResponse::HasContentRange() const
 {
-    auto iter = headers_.find(kContentRange);
-    return iter != headers_.end();
+    return has_content_range_;
 }
 
 HttpRange HttpResponse::GetContentRange() const
 {
-    auto iter = headers_.find(kContentRange);
-    if(iter == headers_.end())
-        return HttpRange();
+    return content_range_;
+}
 
-    size_t space = iter->second.find(' ');
-    size_t hypen = iter->second.find('-');
-    if(space >= hypen)
-        return HttpRange();
+uint64_t HttpResponse::GetContentRangeTotal() const
+{
+    return content_range_total_;
+}
+
+std::string HttpResponse::GetMultipartBoundary() const
+{
+    StringPiece content_type;
+    if(!headers_.Find(HttpHeaderList::kContentType, content_type))
+        return std::string();
+
+    const std::string value = content_type.ToString();
+    std::string type = value;
+    std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+    if(type.compare(0, strlen(kByteRangesType), kByteRangesType))
+        return std::string();
+
+    size_t begin = type.find("boundary=");
+    if(begin == std::string::npos)
+        return std::string();
+    //the boundary is case sensitive, take it from the original value
+    begin += strlen("boundary=");
+    if(begin < value.size() && value[begin] == '"')
+    {
+        size_t end = value.find('"', ++begin);
+        if(end == std::string::npos)
+            return std::string();
+        return value.substr(begin, end - begin);
+    }
+    size_t end = value.find_first_of("; \t\r\n", begin);
+    if(end == std::string::npos)
+        end = value.size();
+    return value.substr(begin, end - begin);
+}
 
-    uint64_t first = strtoui64(&iter->second[space] + 1);
-    uint64_t last = strtoui64(&iter->second[hypen] + 1);
-    return HttpRange(first, static_cast<size_t>(last - first + 1));
+void HttpResponse::ClearHeaders()
+{
+    headers_.Clear();
+    has_content_length_ = false;
+    content_length_ = 0;
+    has_last_modified_ = false;
+    last_modified_ = -1;
+    has_content_range_ = false;
+    content_range_ = HttpRange();
+    content_range_total_ = -1;
 }
 
 void HttpResponse::GotHeader(const char * line, size_t length)
 {
-    int status_code = parse_status_code(line, length);
+    int status_code = ParseHttpStatusLine(line, length);
     if(status_code)
-    {
-        headers_.clear();
+    {//a new response begins, e.g. after a redirect
+        ClearHeaders();
         status_code_ = status_code;
+        return;
+    }
+
+    StringPiece key;
+    StringPiece value;
+    if(!split_header(line, length, key, value))
+        return;
+
+    //values in the list are terminated, safe for the C parsers
+    auto name = headers_.Add(key.data(), key.size(), value.data(), value.size());
+    value = headers_.ValueAt(headers_.Count() - 1);
+    switch(name)
+    {
+    case HttpHeaderList::kContentLength:
+        if(!has_content_length_)
+        {
+            const char * p = value.data();
+            parse_number(p, p + value.size(), content_length_);
+            has_content_length_ = true;
+        }
+        break;
+    case HttpHeaderList::kLastModified:
+        if(!has_last_modified_)
+        {
+            last_modified_ = curl_parse_date(value.data());
+            has_last_modified_ = true;
+        }
+        break;
+    case HttpHeaderList::kContentRange:
+        if(!has_content_range_)
+        {
+            //the total is kept apart, a 416 tells it without a range
+            bool has_range = false;
+            uint64_t first = 0;
+            uint64_t last = 0;
+            if(!ParseContentRange(value, has_range, first, last, content_range_total_))
+                content_range_total_ = -1;
+            else if(has_range)
+                content_range_ = HttpRange(first, static_cast<size_t>(last - first + 1));
+            has_content_range_ = true;
+        }
+        break;
+    default:
+        break;
     }
-    else
+}
+
+//HttpRangesResponse
+HttpRangesResponse::HttpRangesResponse()
+{
+    Reset();
+}
+
+HttpRangesResponse::~HttpRangesResponse()
+{
+}
+
+HttpRangesResponse::Form HttpRangesResponse::GetForm() const
+{
+    return form_;
+}
+
+uint64_t HttpRangesResponse::GetTotal() const
+{
+    return total_;
+}
+
+void HttpRangesResponse::Reset()
+{
+    form_ = kFormUnknown;
+    state_ = kStateBoundary;
+    boundary_.clear();
+    line_.clear();
+    position_ = 0;
+    remaining_ = 0;
+    total_ = -1;
+    has_part_range_ = false;
+    ClearHeaders();
+}
+
+size_t HttpRangesResponse::WriteChunk(const void * blob, size_t size)
+{
+    if(form_ == kFormUnknown && !Begin())
+        return 0;
+
+    auto data = reinterpret_cast<const char *>(blob);
+    if(form_ != kFormMultipart)
     {
-        auto header = parse_header(line, length);
-        if(!header.first.empty())
-            headers_.insert(header);
+        if(!WriteRange(position_, data, size))
+            return 0;
+        position_ += size;
+        return size;
     }
-    return;
+
+    size_t used = 0;
+    while(used < size)
+    {
+        if(state_ == kStatePartBody)
+        {
+            size_t take = static_cast<size_t>(
+                (std::min)(remaining_, static_cast<uint64_t>(size - used)));
+            if(!WriteRange(position_, data + used, take))
+                return 0;
+            position_ += take;
+            remaining_ -= take;
+            used += take;
+            if(!remaining_)
+                state_ = kStateBoundary;
+            continue;
+        }
+        if(state_ == kStateEpilogue)
+            return size;
+
+        //boundaries and part headers are handled by lines
+        const char * end = strnchr(data + used, size - used, '\n');
+        size_t length = end ? end - (data + used) : size - used;
+        if(line_.size() + length > kMaxPartLineSize)
+            return 0;
+        line_.append(data + used, length);
+        used += length;
+        if(!end)
+            break;
+        ++used;
+        if(!line_.empty() && line_.back() == '\r')
+            line_.pop_back();
+        if(!GotLine())
+            return 0;
+        line_.clear();
+    }
+    return size;
+}
+
+bool HttpRangesResponse::Begin()
+{
+    switch(GetStatusCode())
+    {
+    case HttpStatusCode::kPartialContent:
+        boundary_ = GetMultipartBoundary();
+        if(!boundary_.empty())
+        {
+            form_ = kFormMultipart;
+            return true;
+        }
+        //the ranges were collapsed into one
+        if(!HasContentRange())
+            return false;
+        form_ = kFormSingle;
+        position_ = GetContentRange().first();
+        total_ = GetContentRangeTotal();
+        return true;
+    case HttpStatusCode::kOK:
+        form_ = kFormWhole;
+        position_ = 0;
+        if(HasContentLength())
+            total_ = GetContentLength();
+        return true;
+    }
+    return false;
+}
+
+bool HttpRangesResponse::GotLine()
+{
+    if(state_ == kStateBoundary)
+    {//skip the preamble and the line break ending a part
+        if(line_.size() < boundary_.size() + 2)
+            return true;
+        if(line_.compare(0, 2, "--") || line_.compare(2, boundary_.size(), boundary_))
+            return true;
+        if(line_.size() == boundary_.size() + 4 && !line_.compare(line_.size() - 2, 2, "--"))
+            state_ = kStateEpilogue;
+        else
+            state_ = kStatePartHeaders;
+        has_part_range_ = false;
+        return true;
+    }
+
+    if(state_ != kStatePartHeaders)
+        return true;
+
+    if(line_.empty())
+    {//a part without its range can't be placed
+        if(!has_part_range_)
+            return false;
+        state_ = remaining_ ? kStatePartBody : kStateBoundary;
+        return true;
+    }
+
+    StringPiece key;
+    StringPiece value;
+    if(!split_header(line_.data(), line_.size(), key, value))
+        return true;
+    if(HttpHeaderList::Intern(key.data(), key.size()) != HttpHeaderList::kContentRange)
+        return true;
+
+    bool has_range = false;
+    uint64_t first = 0;
+    uint64_t last = 0;
+    uint64_t total = -1;
+    if(!ParseContentRange(value, has_range, first, last, total) || !has_range)
+        return false;
+    //every part belongs to the same resource
+    if(total != -1 && total_ != -1 && total != total_)
+        return false;
+    if(total != -1)
+        total_ = total;
+    position_ = first;
+    remaining_ = last - first + 1;
+    has_part_range_ = true;
+    return true;
 }
 
 //HttpConnection
@@ -324,16 +678,267 @@ size_t HttpConnection::WriteCallback(char * buffer,
     if(!handler->response_)
         return 0;
 
+    //curl keeps the chunk and hands it over again after curl_easy_pause
+    if(handler->async_ && !handler->IsWriteReady())
+    {
+        handler->Multi()->Pause(*handler);
+        return CURL_WRITEFUNC_PAUSE;
+    }
+
     size_t tranfered = handler->response_->WriteChunk(buffer, size * nitems);
     handler->io_stats_.in += tranfered;
+    handler->ChargeRate(tranfered);
     return tranfered;
 }
 
+/*HttpMulti*/
+HttpMulti::HttpMulti()
+    : curl_multi_(0), running_count_(0), watcher_(0),
+      pool_(&HttpConnectionPool::Global()), attached_(0)
+{
+}
+
+HttpMulti::~HttpMulti()
+{
+    fini();
+}
+
+bool HttpMulti::LazyInitialize()
+{
+    //a pooled handle is taken once the first transfer tells its origin
+    if(IsPooled())
+        return true;
+    return Open(std::string());
+}
+
+bool HttpMulti::Open(const std::string & origin)
+{
+    if(!curl_multi_)
+    {
+        curl_multi_ = IsPooled() ? pool_->AcquireMulti(origin) : curl_multi_init();
+        if(!curl_multi_)
+            return false;
+
+        if(watcher_)
+        {
+            curl_multi_setopt(curl_multi_, CURLMOPT_SOCKETFUNCTION, 
+                              MultiSocketCallback);
+            curl_multi_setopt(curl_multi_, CURLMOPT_SOCKETDATA, this);
+            curl_multi_setopt(curl_multi_, CURLMOPT_TIMERFUNCTION, 
+                              MultiTimerCallback);
+            curl_multi_setopt(curl_multi_, CURLMOPT_TIMERDATA, this);
+        }
+    }
+    return true;
+}
+
+void HttpMulti::fini()
+{
+    if(curl_multi_)
+    {
+        //a handle with transfers still attached can't be handed on
+        if(IsPooled() && !attached_)
+            pool_->ReleaseMulti(curl_multi_, origin_);
+        else
+            curl_multi_cleanup(curl_multi_);
+        curl_multi_ = 0;
+    }
+    running_count_ = 0;
+    attached_ = 0;
+}
+
+bool HttpMulti::SetPool(HttpConnectionPool * pool)
+{
+    if(curl_multi_)
+        return false;
+    pool_ = pool;
+    return true;
+}
+
+bool HttpMulti::Perform()
+{
+    if(!curl_multi_)
+        return true;
+
+    ResumePaused();
+
+    CURLMcode multi_code = CURLM_CALL_MULTI_PERFORM;
+    while(multi_code == CURLM_CALL_MULTI_PERFORM)
+        multi_code = curl_multi_perform(curl_multi_, &running_count_);
+
+    if(multi_code != CURLM_OK)
+        return false;
+
+    CollectDone();
+    return true;
+}
+
+void HttpMulti::Wait(uint32_t ms)
+{
+    //paused transfers don't wake curl up
+    ms = (std::min)(ms, ResumeDelay());
+    if(curl_multi_)
+        curl_multi_wait(curl_multi_, 0, 0, ms, 0);
+}
+
+int HttpMulti::RunningCount() const
+{
+    return running_count_;
+}
+
+bool HttpMulti::SetWatcher(HttpSocketWatcher * watcher)
+{
+    if(curl_multi_)
+        return false;
+    watcher_ = watcher;
+    return true;
+}
+
+HttpSocketWatcher * HttpMulti::GetWatcher() const
+{
+    return watcher_;
+}
+
+bool HttpMulti::SocketAction(intptr_t socket, int events)
+{
+    if(!curl_multi_)
+        return true;
+
+    CURLMcode multi_code = CURLM_CALL_MULTI_PERFORM;
+    while(multi_code == CURLM_CALL_MULTI_PERFORM)
+    {
+        multi_code = curl_multi_socket_action(
+            curl_multi_, static_cast<curl_socket_t>(socket), 
+            events, &running_count_);
+    }
+
+    if(multi_code != CURLM_OK)
+        return false;
+
+    CollectDone();
+    return true;
+}
+
+bool HttpMulti::Timeout()
+{
+    return SocketAction(CURL_SOCKET_TIMEOUT, 0);
+}
+
+void HttpMulti::ResumePaused()
+{
+    if(paused_.empty())
+        return;
+
+    //a resumed transfer may be paused again at once
+    std::vector<HttpConnection *> paused(paused_.begin(), paused_.end());
+    for(size_t i = 0; i < paused.size(); ++i)
+    {
+        HttpConnection * conn = paused[i];
+        if(!conn->IsWriteReady())
+            continue;
+        paused_.erase(conn);
+        conn->paused_ = false;
+        conn->SuspendLowSpeedLimit(false);
+        //the kept chunk is delivered from here, curl expires the
+        //transfer so socket driven owners get it serviced as well
+        CURLcode code = curl_easy_pause(conn->curl_easy_, CURLPAUSE_CONT);
+        if(code != CURLE_OK)
+        {//the response refused the chunk and curl won't report it,
+         //hold the transfer until its owner closes it
+            curl_easy_pause(conn->curl_easy_, CURLPAUSE_ALL);
+            conn->result_ = code;
+            failed_.insert(conn);
+        }
+    }
+    if(!failed_.empty())
+        CollectDone();
+}
+
+uint32_t HttpMulti::ResumeDelay() const
+{
+    uint32_t delay = static_cast<uint32_t>(-1);
+    for(auto iter = paused_.begin(); iter != paused_.end(); ++iter)
+        delay = (std::min)(delay, (*iter)->RateDelay());
+    return delay;
+}
+
+bool HttpMulti::Attach(HttpConnection & conn)
+{
+    if(!Open(conn.origin_))
+        return false;
+    if(curl_multi_add_handle(curl_multi_, conn.curl_easy_) != CURLM_OK)
+        return false;
+    ++attached_;
+    origin_ = conn.origin_;
+    return true;
+}
+
+void HttpMulti::Detach(HttpConnection & conn)
+{
+    if(curl_multi_ && attached_ &&
+       curl_multi_remove_handle(curl_multi_, conn.curl_easy_) == CURLM_OK)
+        --attached_;
+    if(conn.paused_)
+        conn.SuspendLowSpeedLimit(false);
+    paused_.erase(&conn);
+    failed_.erase(&conn);
+    conn.paused_ = false;
+}
+
+void HttpMulti::CollectDone()
+{
+    //transfers failed while being resumed
+    Connections failed;
+    failed.swap(failed_);
+    for(auto iter = failed.begin(); iter != failed.end(); ++iter)
+    {
+        HttpConnection * conn = *iter;
+        conn->RecordStats(conn->result_);
+        if(watcher_)
+            watcher_->TransferDone(*conn);
+    }
+
+    int dont_care = 0;
+    CURLMsg * info = 0;
+    while((info = curl_multi_info_read(curl_multi_, &dont_care)) != 0)
+    {
+        if(info->msg != CURLMSG_DONE)
+            continue;
+        char * param = 0;
+        curl_easy_getinfo(info->easy_handle, CURLINFO_PRIVATE, &param);
+        auto conn = reinterpret_cast<HttpConnection *>(param);
+        //a failed transfer held in the multi is reported once
+        if(!conn || conn->result_ != HttpConnection::kPendingResult)
+            continue;
+        conn->result_ = info->data.result;
+        conn->RecordStats(conn->result_);
+        if(watcher_)
+            watcher_->TransferDone(*conn);
+    }
+}
+
+void HttpMulti::Pause(HttpConnection & conn)
+{
+    conn.paused_ = true;
+    conn.SuspendLowSpeedLimit(true);
+    paused_.insert(&conn);
+}
+
+bool HttpMulti::IsPooled() const
+{
+    //the sockets of a parked handle were announced to another watcher
+    return pool_ && !watcher_;
+}
+
 /*HttpConnection*/
 HttpConnection::HttpConnection()
-    : curl_easy_(0), curl_multi_(0), 
-      request_(0), response_(0)
+    : curl_easy_(0), multi_(0), private_multi_(0),
+      result_(kPendingResult), context_(0), request_(0), response_(0),
+      rate_limiter_(0), stats_(0),
+      pool_(&HttpConnectionPool::Global()), async_(false), paused_(false),
+      low_speed_limit_(0)
 {
+    io_stats_.in = io_stats_.out = 0;
 }
 
 HttpConnection::~HttpConnection()
@@ -352,15 +957,16 @@ void HttpConnection::fini()
 {
     if(curl_easy_)
     {
-        curl_easy_clean_headers(curl_easy_);
+        if(curl_easy_in_multi(curl_easy_))
+            Multi()->Detach(*this);
         curl_easy_cleanup(curl_easy_);
         curl_easy_ = 0;
     }
 
-    if(curl_multi_)
+    if(private_multi_)
     {
-        curl_multi_cleanup(curl_multi_);
-        curl_multi_ = 0;
+        delete private_multi_;
+        private_multi_ = 0;
     }
 }
 
@@ -380,7 +986,9 @@ bool HttpConnection::LazyInitialize()
         curl_easy_setopt(curl_easy_, CURLOPT_READDATA, this);
         curl_easy_setopt(curl_easy_, CURLOPT_FILETIME, 1);
         curl_easy_setopt(curl_easy_, CURLOPT_ACCEPT_ENCODING, "");
-        curl_easy_setopt(curl_easy_, CURLOPT_PRIVATE, -1);
+        curl_easy_setopt(curl_easy_, CURLOPT_PRIVATE, this);
+        if(pool_)
+            curl_easy_setopt(curl_easy_, CURLOPT_SHARE, pool_->Share());
         Reset();
     }
     return true;
@@ -390,10 +998,10 @@ void HttpConnection::Reset()
 {
     if(curl_easy_)
     {
-        if(curl_multi_)
-            curl_multi_remove_handle(curl_multi_, curl_easy_);
+        if(curl_easy_in_multi(curl_easy_))
+            Multi()->Detach(*this);
 
-        curl_easy_setopt(curl_easy_, CURLOPT_PRIVATE, -1);
+        result_ = kPendingResult;
 
         SetRequestMethod(HttpRequestMethod::kGet);
         SetVerb(0);
@@ -415,6 +1023,14 @@ bool HttpConnection::SetUrl(const std::string & url)
         return false;
 
     curl_easy_setopt(curl_easy_, CURLOPT_URL, url.data());
+    std::string origin = URL(url).Origin();
+    //redirected or retried transfers mostly stay on their host
+    if(origin != origin_ || !host_limiter_)
+    {
+        host_limiter_ = RateLimiter::ForHost(origin);
+        host_stats_ = HttpStats::ForHost(origin);
+    }
+    origin_ = origin;
 
     return true;
 }
@@ -441,7 +1057,8 @@ void HttpConnection::SetLowSpeedLimit(uint32_t speed, uint32_t time)
     if(!curl_easy_)
         return;
 
-    curl_easy_setopt(curl_easy_, CURLOPT_LOW_SPEED_LIMIT, speed);
+    low_speed_limit_ = speed;
+    curl_easy_setopt(curl_easy_, CURLOPT_LOW_SPEED_LIMIT, paused_ ? 0 : speed);
     curl_easy_setopt(curl_easy_, CURLOPT_LOW_SPEED_TIME, time);
 }
 
@@ -514,6 +1131,86 @@ void HttpConnection::SetResponse(HttpResponse * response)
     response_ = response;
 }
 
+void HttpConnection::SetContext(void * context)
+{
+    context_ = context;
+}
+
+void * HttpConnection::GetContext() const
+{
+    return context_;
+}
+
+bool HttpConnection::SetMulti(HttpMulti * multi)
+{
+    if(curl_easy_ && curl_easy_in_multi(curl_easy_))
+        return false;
+    multi_ = multi;
+    return true;
+}
+
+void HttpConnection::SetRateLimiter(RateLimiter * limiter)
+{
+    rate_limiter_ = limiter;
+}
+
+bool HttpConnection::IsPaused() const
+{
+    return paused_;
+}
+
+void HttpConnection::SetStats(HttpStats * stats)
+{
+    stats_ = stats;
+}
+
+bool HttpConnection::SetPool(HttpConnectionPool * pool)
+{
+    if(curl_easy_)
+    {
+        if(curl_easy_in_multi(curl_easy_))
+            return false;
+        curl_easy_setopt(curl_easy_, CURLOPT_SHARE, pool ? pool->Share() : 0);
+    }
+    pool_ = pool;
+    return true;
+}
+
+bool HttpConnection::GetTiming(HttpTiming & timing) const
+{
+    if(!curl_easy_)
+        return false;
+
+    double name_lookup = 0;
+    double connect = 0;
+    double app_connect = 0;
+    double start_transfer = 0;
+    double total = 0;
+    long redirects = 0;
+    long connects = 0;
+    curl_easy_getinfo(curl_easy_, CURLINFO_NAMELOOKUP_TIME, &name_lookup);
+    curl_easy_getinfo(curl_easy_, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(curl_easy_, CURLINFO_APPCONNECT_TIME, &app_connect);
+    curl_easy_getinfo(curl_easy_, CURLINFO_STARTTRANSFER_TIME, &start_transfer);
+    curl_easy_getinfo(curl_easy_, CURLINFO_TOTAL_TIME, &total);
+    curl_easy_getinfo(curl_easy_, CURLINFO_REDIRECT_COUNT, &redirects);
+    curl_easy_getinfo(curl_easy_, CURLINFO_NUM_CONNECTS, &connects);
+
+    //curl reports seconds
+    timing.name_lookup = static_cast<uint64_t>(name_lookup * 1000000);
+    timing.connect = static_cast<uint64_t>(connect * 1000000);
+    timing.app_connect = static_cast<uint64_t>(app_connect * 1000000);
+    timing.start_transfer = static_cast<uint64_t>(start_transfer * 1000000);
+    timing.total = static_cast<uint64_t>(total * 1000000);
+    timing.redirects = static_cast<uint32_t>(redirects);
+    timing.in = io_stats_.in;
+    timing.out = io_stats_.out;
+    timing.succeeded = result_ == CURLE_OK;
+    //a transfer which failed before it had a connection didn't reuse one
+    timing.reused = connects == 0 && (timing.connect || timing.start_transfer);
+    return true;
+}
+
 HttpConnResult HttpConnection::Perform()
 {
     io_stats_.in = io_stats_.out = 0;
@@ -523,48 +1220,40 @@ HttpConnResult HttpConnection::Perform()
     if(curl_easy_in_multi(curl_easy_))
         return kConnFail;
     ConnSetup();
+    async_ = false;
     CURLcode code = curl_easy_perform(curl_easy_);
+    result_ = code;
+    RecordStats(code);
     return TranslateCurlCode(code);
 }
 
 HttpConnResult HttpConnection::AsyncPerform()
 {
-    io_stats_.in = io_stats_.out = 0;
-
     if(!curl_easy_)
         return kConnFail;
 
+    HttpMulti * multi = Multi();
+    if(!multi)
+        return kConnFail;
+
     if(!curl_easy_in_multi(curl_easy_))
     {
+        io_stats_.in = io_stats_.out = 0;
         ConnSetup();
-
-        curl_multi_ = curl_multi_ ? curl_multi_ : curl_multi_init();
-        if(!curl_multi_)
-            return kConnFail;
-        if(curl_multi_add_handle(curl_multi_, curl_easy_))
+        async_ = true;
+        result_ = kPendingResult;
+        if(!multi->Attach(*this))
             return kConnFail;
     }
 
-    int running_count_ = 0;
-    CURLMcode multi_code = CURLM_CALL_MULTI_PERFORM;
-
-    while(multi_code == CURLM_CALL_MULTI_PERFORM)
-        multi_code = curl_multi_perform(curl_multi_, &running_count_);
-
-    if(multi_code != CURLM_OK)
+    //a shared multi is driven by its owner
+    if(!multi_ && !multi->Perform())
         return kConnFail;
 
-    if(running_count_)
+    if(result_ == kPendingResult)
         return kConnAgain;
 
-    int dont_care = 0;
-    auto info = curl_multi_info_read(curl_multi_, &dont_care);
-    if(info)
-        curl_easy_setopt(curl_easy_, CURLOPT_PRIVATE, info->data.result);
-        
-    CURLcode code;
-    curl_easy_getinfo(curl_easy_, CURLINFO_PRIVATE, &code);
-    return TranslateCurlCode(code);
+    return TranslateCurlCode(static_cast<CURLcode>(result_));
 }
 
 size_t HttpConnection::InSize() const
@@ -579,35 +1268,94 @@ size_t HttpConnection::OutSize() const
 
 void HttpConnection::Wait(uint32_t ms)
 {
-    if(curl_easy_in_multi(curl_easy_))
-        curl_multi_wait(curl_multi_, 0, 0, ms, 0);
+    if(curl_easy_ && curl_easy_in_multi(curl_easy_))
+        Multi()->Wait(ms);
     return;
 }
 
+HttpMulti * HttpConnection::Multi()
+{
+    if(multi_)
+        return multi_;
+    if(!private_multi_)
+    {
+        private_multi_ = new HttpMulti();
+        private_multi_->SetPool(pool_);
+    }
+    return private_multi_;
+}
+
+bool HttpConnection::IsRateReady() const
+{
+    if(rate_limiter_ && !rate_limiter_->IsReady())
+        return false;
+    if(host_limiter_ && !host_limiter_->IsReady())
+        return false;
+    return RateLimiter::Global().IsReady();
+}
+
+bool HttpConnection::IsWriteReady() const
+{
+    if(response_ && !response_->IsWriteReady())
+        return false;
+    return IsRateReady();
+}
+
+uint32_t HttpConnection::RateDelay() const
+{
+    uint32_t delay = RateLimiter::Global().Delay();
+    if(rate_limiter_)
+        delay = (std::max)(delay, rate_limiter_->Delay());
+    if(host_limiter_)
+        delay = (std::max)(delay, host_limiter_->Delay());
+    return delay;
+}
+
+void HttpConnection::RecordStats(int result)
+{
+    HttpTiming timing = {0};
+    if(!GetTiming(timing))
+        return;
+    timing.succeeded = result == CURLE_OK;
+
+    HttpStats::Global().Record(timing);
+    if(host_stats_)
+        host_stats_->Record(timing);
+    if(stats_)
+        stats_->Record(timing);
+}
+
+void HttpConnection::SuspendLowSpeedLimit(bool suspend)
+{
+    //curl restarts the low speed period whenever the limit is 0, so a
+    //transfer held back by its limiters again and again is never dropped
+    long limit = suspend ? 0 : low_speed_limit_;
+    curl_easy_setopt(curl_easy_, CURLOPT_LOW_SPEED_LIMIT, limit);
+}
+
+void HttpConnection::ChargeRate(size_t size)
+{
+    if(rate_limiter_)
+        rate_limiter_->Consume(size);
+    if(host_limiter_)
+        host_limiter_->Consume(size);
+    RateLimiter::Global().Consume(size);
+}
+
 void HttpConnection::ConnSetup()
 {
     if(!curl_easy_)
         return;
 
-    curl_easy_clean_headers(curl_easy_);
+    //Applying Headers, the lines are owned by the request and its header set
+    curl_slist * lines = request_ ? request_->GetHeaderLines() : 0;
+    curl_easy_setopt(curl_easy_, CURLOPT_HTTPHEADER, lines);
+    //curl copies the range and formats the Range line itself
+    const char * range = request_ ? request_->GetRangeSpec() : 0;
+    curl_easy_setopt(curl_easy_, CURLOPT_RANGE, range);
 
     if(request_)
     {
-        //Applying Headers
-        for(auto iter = request_->headers_.begin(); 
-            iter != request_->headers_.end();
-            ++iter)
-        {
-            const size_t kMaxLineSize = 0x800;
-            char line[kMaxLineSize];
-            auto & key = iter->first;
-            auto & value = iter->second;
-            size_t line_length = key.length() + value.length() + 2;
-            if(line_length >= kMaxLineSize)
-                continue;
-            sprintf_s(line, "%s: %s", key.data(), value.data());
-            curl_easy_append_header(curl_easy_, line);
-        }
         //Set post size
         uint32_t length = 0;
         if(request_->GetContentLength(length))
@@ -1,12 +1,23 @@
 ﻿#ifndef NWEB_HTTP_HANDLER_H_
 #define NWEB_HTTP_HANDLER_H_
 
+#include <memory>
+#include <unordered_set>
+#include <vector>
 #include "nweb.h"
+#include "http_headers.h"
+
+struct curl_slist;
 
 namespace nweb
 {
 
 class URL;
+class HttpConnection;
+class RateLimiter;
+class HttpStats;
+class HttpConnectionPool;
+struct HttpTiming;
 
 enum HttpConnResult
 {
@@ -45,6 +56,7 @@ enum Value
     kUnauthorized = 401,
     kForbidden = 403,
     kNotFound = 404,
+    kRangeNotSatisfiable = 416,
     kNginxClientClosedRequest = 499,
     kInternalServerError = 500,
     kOptionNotSupported = 551,
@@ -60,7 +72,6 @@ const int kServerErrorFirst = kBadRequest;
 const int kServerErrorLast = kOptionNotSupported;
 }
 
-typedef std::map<std::string, std::string> HttpHeaders;
 
 class HttpRange
 {
@@ -86,6 +97,27 @@ private:
     size_t size_;
 };
 
+typedef std::vector<HttpRange> HttpRanges;
+
+//HttpHeaderSet is a group of request headers serialized once into the
+//lines curl sends. It never changes after construction, so one set may
+//be shared by any number of requests. Keep it alive while they use it.
+class HttpHeaderSet
+{
+    friend class HttpRequest;
+public:
+    explicit HttpHeaderSet(const HttpHeaderList & headers);
+    ~HttpHeaderSet();
+
+    size_t Count() const;
+private:
+    HttpHeaderSet(const HttpHeaderSet &);
+    HttpHeaderSet & operator=(const HttpHeaderSet &);
+private:
+    curl_slist * lines_;
+    size_t count_;
+};
+
 class HttpRequest
 {
     friend class HttpConnection;
@@ -93,8 +125,16 @@ public:
     HttpRequest();
     virtual ~HttpRequest();
 
+    //The range is handed to curl apart from the headers, changing it
+    //doesn't rebuild the header lines. Only GET and HEAD send it.
     void SetRange(uint64_t first, uint64_t last);
     void SetRange(const HttpRange & range);
+    //Several ranges in one request, see HttpRangesResponse.
+    void SetRanges(const HttpRanges & ranges);
+    void ClearRange();
+    //Headers shared with other requests, sent after the request's own.
+    //0 detaches the set.
+    void SetHeaderSet(const HttpHeaderSet * header_set);
     void AddHeader(const char * key, const char * value);
     void RemoveHeader(const char * key);
     void ClearHeaders();
@@ -102,8 +142,23 @@ protected:
     
     virtual size_t ReadChunk(void * blob, size_t size);
     virtual bool GetContentLength(uint32_t & length);
+private:
+    HttpRequest(const HttpRequest &);
+    HttpRequest & operator=(const HttpRequest &);
+    //The own headers chained in front of the shared set. The own lines
+    //are serialized again only after the headers changed.
+    curl_slist * GetHeaderLines();
+    //"first-last[,first-last...]", 0 without a range.
+    const char * GetRangeSpec() const;
+    void FreeHeaderLines();
 protected:
-    HttpHeaders headers_;
+    HttpHeaderList headers_;
+private:
+    const HttpHeaderSet * header_set_;
+    curl_slist * lines_;
+    curl_slist * lines_tail_;
+    bool lines_dirty_;
+    std::string range_;
 };
 
 class HttpResponse
@@ -118,19 +173,203 @@ public:
     uint64_t GetContentLength() const;
     bool HasLastModified() const;
     time_t GetLastModified() const;
+    //Entity tag with its quotes and W/ prefix, empty if absent.
+    std::string GetETag() const;
     bool HasContentRange() const;
     HttpRange GetContentRange() const;
+    //Total length of the file in Content-Range, -1 if unknown.
+    uint64_t GetContentRangeTotal() const;
+    //Boundary of a multipart/byteranges body, empty for other types.
+    std::string GetMultipartBoundary() const;
 protected:
     virtual size_t WriteChunk(const void * blob, size_t size);
+    //An asynchronous transfer is paused before handing over a chunk while
+    //this returns false, and resumed by its multi once it returns true.
+    virtual bool IsWriteReady() const;
+    //Forget the headers and the fields parsed from them.
+    void ClearHeaders();
 private:
     void GotHeader(const char * line, size_t length);
 protected:
     int status_code_;
-    HttpHeaders headers_;
+    HttpHeaderList headers_;
+private:
+    //parsed as the headers arrive, the first one of a name wins
+    bool has_content_length_;
+    uint64_t content_length_;
+    bool has_last_modified_;
+    time_t last_modified_;
+    bool has_content_range_;
+    HttpRange content_range_;
+    uint64_t content_range_total_;
+};
+
+//HttpRangesResponse receives the answer to a request with several ranges.
+//A multipart/byteranges body is parsed as it arrives without buffering
+//the parts. Servers may also collapse the ranges into a single 206 or
+//ignore them with a 200, the body is then passed on as one piece.
+class HttpRangesResponse : public HttpResponse
+{
+public:
+    enum Form
+    {
+        kFormUnknown,
+        kFormMultipart,
+        kFormSingle,
+        kFormWhole,
+    };
+
+public:
+    HttpRangesResponse();
+    virtual ~HttpRangesResponse();
+
+    //How the server answered, known once the body begins.
+    Form GetForm() const;
+    //Complete length from the last Content-Range, -1 if unknown.
+    uint64_t GetTotal() const;
+
+    void Reset();
+protected:
+    virtual size_t WriteChunk(const void * blob, size_t size);
+    //[size] bytes of the resource at [position].
+    //Return false to abort the transfer.
+    virtual bool WriteRange(uint64_t position, const void * blob, size_t size) = 0;
+private:
+    enum State
+    {
+        kStateBoundary,
+        kStatePartHeaders,
+        kStatePartBody,
+        kStateEpilogue,
+    };
+
+    bool Begin();
+
+    bool GotLine();
+private:
+    Form form_;
+    State state_;
+    std::string boundary_;
+    std::string line_;
+    uint64_t position_;
+    uint64_t remaining_;
+    uint64_t total_;
+    bool has_part_range_;
+};
+
+//HttpSocketWatcher turns a HttpMulti into socket driven mode.
+//Curl tells the watcher which sockets and which timeout it cares about,
+//the watcher reports readiness back through HttpMulti::SocketAction.
+class HttpSocketWatcher
+{
+public:
+    virtual ~HttpSocketWatcher() {}
+
+    enum
+    {
+        kWatchNone  = 0,
+        kWatchIn    = 1,
+        kWatchOut   = 2,
+        kWatchInOut = 3,
+    };
+    //[what] is kWatchNone when the socket is no longer used.
+    virtual void WatchSocket(intptr_t socket, int what) = 0;
+    //Call HttpMulti::Timeout after [ms], -1 cancels the timer.
+    virtual void WatchTimer(long ms) = 0;
+    //A transfer attached to the multi has completed.
+    virtual void TransferDone(HttpConnection & conn) = 0;
+    //Background work of an owner of the attached transfers has completed.
+    //Called from any thread, the multi's owner should advance them soon.
+    virtual void Wake() = 0;
+};
+
+//HttpMulti drives a group of connections through one curl multi handle.
+//All attached transfers are serviced by a single Perform and a single Wait.
+//Unless socket driven, the handle comes from a HttpConnectionPool when the
+//first transfer is attached and goes back to it by fini, so the kept
+//alive connections serve the next multi working with the same origin.
+class HttpMulti
+{
+    friend class HttpConnection;
+public:
+    HttpMulti();
+
+    ~HttpMulti();
+
+    bool LazyInitialize();
+
+    void fini();
+
+    //The global pool by default, 0 to own the connections.
+    //Must be set before any transfer attached.
+    bool SetPool(HttpConnectionPool * pool);
+
+    //Drive every attached transfer and mark the finished ones.
+    bool Perform();
+
+    //Block until any attached socket is ready or [ms] elapsed.
+    void Wait(uint32_t ms);
+
+    int RunningCount() const;
+
+    //Switch to socket driven mode, must be set before any transfer attached.
+    bool SetWatcher(HttpSocketWatcher * watcher);
+
+    HttpSocketWatcher * GetWatcher() const;
+
+    //Socket driven mode: [events] is a mask of kSocketIn/Out/Error.
+    bool SocketAction(intptr_t socket, int events);
+
+    //Socket driven mode: the timer set by WatchTimer has expired.
+    bool Timeout();
+
+    //Resume the paused transfers which may receive again. Perform does it
+    //by itself, socket driven owners call it each round.
+    void ResumePaused();
+
+    //Milliseconds until a paused transfer may be resumed, -1 if none paused.
+    uint32_t ResumeDelay() const;
+
+public:
+    static const int kSocketIn = 1;
+    static const int kSocketOut = 2;
+    static const int kSocketError = 4;
+
+private:
+    HttpMulti(const HttpMulti &);
+    HttpMulti & operator=(const HttpMulti &);
+
+    bool Attach(HttpConnection & conn);
+
+    void Detach(HttpConnection & conn);
+
+    void CollectDone();
+
+    void Pause(HttpConnection & conn);
+
+    bool IsPooled() const;
+
+    //Take the curl multi handle, from the pool by [origin] if pooled.
+    bool Open(const std::string & origin);
+
+private:
+    typedef std::unordered_set<HttpConnection *> Connections;
+
+    void * curl_multi_;
+    int running_count_;
+    HttpSocketWatcher * watcher_;
+    Connections paused_;
+    //failed while being resumed, reported by CollectDone
+    Connections failed_;
+    HttpConnectionPool * pool_;
+    //origin of the last attached transfer, the handle is parked under it
+    std::string origin_;
+    uint32_t attached_;
 };
 
 class HttpConnection
 {
+    friend class HttpMulti;
 public:
     struct IOStats
     {
@@ -157,6 +396,7 @@ public:
 
     //If speed rate lower than [speed] BPS during [time] secondes.
     //Timeout error will occure.
+    //Not checked while the transfer is paused by a rate limiter.
     void SetLowSpeedLimit(uint32_t speed,uint32_t time);
 
     //Method indicate the beheiver of this handler.
@@ -183,10 +423,43 @@ public:
 
     void SetResponse(HttpResponse * response);
 
+    //Opaque value of the owner, kept across Reset.
+    void SetContext(void * context);
+
+    void * GetContext() const;
+
+    //Run asynchronous transfers on a shared multi instead of a private one.
+    //The owner of [multi] is responsible for calling Perform and Wait.
+    //Pass 0 to go back to the private multi.
+    //Changing the multi during a transfer is not allowed.
+    bool SetMulti(HttpMulti * multi);
+
+    //Received bytes are charged to the global limiter, the limiter of the
+    //url's host and [limiter] if not 0. While any of them runs out the
+    //transfer is paused and resumed later by its multi, nothing sleeps.
+    //The limiter is kept across Reset and must outlive the transfer.
+    void SetRateLimiter(RateLimiter * limiter);
+
+    //Paused by a rate limiter or by a response not ready for data.
+    bool IsPaused() const;
+
+    //Finished transfers are recorded in the global stats, the stats of
+    //the url's host and [stats] if not 0. Kept across Reset.
+    void SetStats(HttpStats * stats);
+
+    //Timing of the last finished transfer.
+    bool GetTiming(HttpTiming & timing) const;
+
+    //Name lookups and TLS sessions are shared with the other connections
+    //of [pool], the global pool by default. 0 keeps them private.
+    //Kept across Reset, not allowed during a transfer.
+    bool SetPool(HttpConnectionPool * pool);
+
     HttpConnResult Perform();
 
     HttpConnResult AsyncPerform();
 
+    //Bytes received/sent by the current transfer.
     size_t InSize() const;
 
     size_t OutSize() const;
@@ -211,12 +484,46 @@ private:
 
     void ConnSetup();
 
+    HttpMulti * Multi();
+
+    //Every limiter of the chain may give bytes now.
+    bool IsRateReady() const;
+
+    //The limiters and the response may take the next chunk.
+    bool IsWriteReady() const;
+
+    //Milliseconds until IsRateReady.
+    uint32_t RateDelay() const;
+
+    void ChargeRate(size_t size);
+
+    //A paused transfer receives nothing, curl must not take it for stalled.
+    void SuspendLowSpeedLimit(bool suspend);
+
+    void RecordStats(int result);
+
 private:
+    static const int kPendingResult = -1;
+
     void * curl_easy_;
-    void * curl_multi_;
+    HttpMulti * multi_;
+    HttpMulti * private_multi_;
+    int result_;
+    void * context_;
     HttpRequest * request_;
     HttpResponse * response_;
     IOStats io_stats_;
+    RateLimiter * rate_limiter_;
+    std::shared_ptr<RateLimiter> host_limiter_;
+    HttpStats * stats_;
+    std::shared_ptr<HttpStats> host_stats_;
+    HttpConnectionPool * pool_;
+    std::string origin_;
+    //a blocking Perform can't be paused, it's only charged
+    bool async_;
+    bool paused_;
+    //set by SetLowSpeedLimit, lifted while paused
+    uint32_t low_speed_limit_;
 };
 
 }
@@ -1,11 +1,14 @@
 ﻿#include <assert.h>
 #include <curl/curl.h>
 #include "block_file.h"
+#include "url.h"
 #include "http_caching.h"
 
 namespace nweb
 {
 
+//longest wait(ms) for socket activity, curl shortens it for its own timers
+const uint32_t kMaxWaitInterval = 1000;
 
 class Cache : public HttpResponse
 {
@@ -24,7 +27,11 @@ public:
             file_.GetLastWriteTime(last_write);
 
             tm pt = { 0 };
+#ifdef _WIN32
             if (!gmtime_s(&pt, &last_write))
+#else
+            if (gmtime_r(&last_write, &pt))
+#endif
             {
                 char temp[256];
                 strftime(temp, sizeof(temp), "%a, %d %b %Y %H:%M:%S GMT", &pt);  
@@ -81,6 +88,62 @@ private:
 };
 
 
+static HttpHeaderList CommonHeaderList()
+{
+    HttpHeaderList headers;
+    headers.Set("Connection", "Keep-Alive");
+    headers.Set("Accept-Encoding", "gzip, deflate, identity");
+    return headers;
+}
+
+//headers every request carries, serialized once and shared by all of them
+static const HttpHeaderSet kCommonHeaders(CommonHeaderList());
+
+//conditional GET of [url] into [cache]
+static void Setup(HttpConnection & conn,
+                  HttpRequest & req,
+                  Cache & cache,
+                  const std::string & url)
+{
+    auto & lm = cache.TimeStamp();
+
+    req.SetHeaderSet(&kCommonHeaders);
+    if (!lm.empty()) 
+        req.AddHeader("If-Modified-Since", lm.data());
+
+    conn.Reset();
+    conn.SetUrl(url);
+    conn.SetLowSpeedLimit(128, 32);
+    conn.EnableRedirection(true);
+    conn.SetMaxRedirection(5);
+    conn.SetRequestMethod(HttpRequestMethod::kGet);
+    conn.SetRequest(&req);
+    conn.SetResponse(&cache);
+}
+
+//result of a completed transfer
+static Result Conclude(HttpConnResult cr, Cache & cache)
+{
+    if(cr != kConnOK)
+        return kResultFailed;
+
+    auto code = cache.GetStatusCode();
+
+    if(code == HttpStatusCode::kNotModified)
+    {
+        return kResultNotModified;
+    }
+    else if(code == HttpStatusCode::kOK)
+    {
+        cache.Update();
+        return kResultOK;
+    }
+    else
+    {
+        return kResultFailed;
+    }
+}
+
 HttpCaching::HttpCaching()
 {
 }
@@ -105,21 +168,8 @@ Result HttpCaching::Sync(const std::string & url,
 
     if (!cache.Open(path))
         return kResultOpenFileFailded;
-    auto & lm = cache.TimeStamp();
 
-    req.AddHeader("Connection", "Keep-Alive");        
-    req.AddHeader("Accept-Encoding", "gzip, deflate, identity");
-    if (!lm.empty()) 
-        req.AddHeader("If-Modified-Since", lm.data());
-
-    conn_.Reset();
-    conn_.SetUrl(url);
-    conn_.SetLowSpeedLimit(128, 32);
-    conn_.EnableRedirection(true);
-    conn_.SetMaxRedirection(5);
-    conn_.SetRequestMethod(HttpRequestMethod::kGet);
-    conn_.SetRequest(&req);
-    conn_.SetResponse(&cache);
+    Setup(conn_, req, cache, url);
     //do loop fetch
     while(true)
     {
@@ -135,29 +185,246 @@ Result HttpCaching::Sync(const std::string & url,
 
         if( cr == kConnAgain)
         {
-            conn_.Wait(5);
+            conn_.Wait(kMaxWaitInterval);
             continue;
         }
         
-        if(cr != kConnOK)
-            return kResultFailed;
+        return Conclude(cr, cache);
+    }
+}
+
+/*
+HttpCachingBatch
+*/
+class HttpCachingBatch::Slot
+{
+public:
+    HttpConnection conn;
+    HttpRequest req;
+    Cache cache;
+    std::string host;
+    size_t index;
+    bool busy;
+
+    Slot() : index(0), busy(false) {}
+
+    ~Slot()
+    {
+        conn.fini();
+    }
+};
+
+HttpCachingBatch::HttpCachingBatch()
+    : host_connections_(kDefaultHostConnections),
+      max_connections_(kDefaultMaxConnections)
+{
+}
 
-        auto code = cache.GetStatusCode();
+HttpCachingBatch::~HttpCachingBatch()
+{
+    Clear();
+    multi_.fini();
+}
+
+void HttpCachingBatch::SetHostConnections(uint32_t count)
+{
+    host_connections_ = (std::max)(1u, count);
+}
+
+void HttpCachingBatch::SetMaxConnections(uint32_t count)
+{
+    max_connections_ = (std::max)(1u, count);
+}
+
+size_t HttpCachingBatch::Add(const std::string & url, const std::string & path)
+{
+    Item item = {url, path, kResultAgain};
+    items_.push_back(item);
+    return items_.size() - 1;
+}
+
+void HttpCachingBatch::Clear()
+{
+    Abort();
+    for(size_t i = 0; i < slots_.size(); ++i)
+        delete slots_[i];
+    slots_.clear();
+    items_.clear();
+    hosts_.clear();
+}
 
-        if(code == HttpStatusCode::kNotModified)
+size_t HttpCachingBatch::Count() const
+{
+    return items_.size();
+}
+
+Result HttpCachingBatch::GetResult(size_t index) const
+{
+    if(index >= items_.size())
+        return kResultFailed;
+    return items_[index].result;
+}
+
+Result HttpCachingBatch::Run(HttpCachingBatchClient * client)
+{
+    if(!multi_.LazyInitialize())
+        return kResultFailed;
+
+    //group the files by server
+    hosts_.clear();
+    size_t todo = 0;
+    for(size_t i = 0; i < items_.size(); ++i)
+    {
+        if(items_[i].result != kResultAgain)
+            continue;
+        Host & host = hosts_[URL(items_[i].url).Origin()];
+        host.pending.push_back(i);
+        host.active = 0;
+        ++todo;
+    }
+
+    size_t count = (std::min)(static_cast<size_t>(max_connections_), todo);
+    while(slots_.size() < count)
+    {
+        auto slot = new Slot();
+        if(!slot->conn.init() || !slot->conn.SetMulti(&multi_))
         {
-            return kResultNotModified;
+            delete slot;
+            return kResultFailed;
         }
-        else if(code == HttpStatusCode::kOK)
+        slots_.push_back(slot);
+    }
+
+    bool aborted = false;
+    while(Schedule(client, aborted) && !aborted)
+    {
+        if(!multi_.Perform())
         {
-            cache.Update();
-            return kResultOK;
+            Abort();
+            return kResultFailed;
         }
-        else
+
+        for(size_t i = 0; i < slots_.size() && !aborted; ++i)
         {
+            Slot * slot = slots_[i];
+            if(!slot->busy)
+                continue;
+            auto cr = slot->conn.AsyncPerform();
+            if(cr == kConnAgain)
+                continue;
+
+            //the connection stays in the multi for the next file
+            Result result = Conclude(cr, slot->cache);
+            slot->conn.Reset();
+            slot->cache.Close();
+            slot->busy = false;
+            hosts_[slot->host].active--;
+            if(!Notify(client, slot->index, result))
+                aborted = true;
+        }
+
+        if(!aborted)
+            multi_.Wait(kMaxWaitInterval);
+    }
+
+    if(aborted)
+    {
+        Abort();
+        return kResultUserAbort;
+    }
+
+    for(size_t i = 0; i < items_.size(); ++i)
+    {
+        Result result = items_[i].result;
+        if(result != kResultOK && result != kResultNotModified)
             return kResultFailed;
+    }
+    return kResultOK;
+}
+
+size_t HttpCachingBatch::Schedule(HttpCachingBatchClient * client, bool & aborted)
+{
+    size_t busy = 0;
+    for(size_t i = 0; i < slots_.size(); ++i)
+    {
+        if(slots_[i]->busy)
+            ++busy;
+    }
+
+    //round robin over the servers until the slots or the files run out
+    bool progress = true;
+    while(progress && busy < slots_.size() && !aborted)
+    {
+        progress = false;
+        for(auto iter = hosts_.begin(); iter != hosts_.end(); ++iter)
+        {
+            Host & host = iter->second;
+            if(host.pending.empty() || host.active >= host_connections_)
+                continue;
+
+            Slot * slot = 0;
+            for(size_t i = 0; i < slots_.size() && !slot; ++i)
+            {
+                if(!slots_[i]->busy)
+                    slot = slots_[i];
+            }
+            if(!slot)
+                break;
+
+            size_t index = host.pending.front();
+            host.pending.pop_front();
+            progress = true;
+
+            Item & item = items_[index];
+            if(!slot->cache.Open(item.path))
+            {
+                if(!Notify(client, index, kResultOpenFileFailded))
+                    aborted = true;
+                break;
+            }
+            slot->req.ClearHeaders();
+            Setup(slot->conn, slot->req, slot->cache, item.url);
+            slot->host = iter->first;
+            slot->index = index;
+            if(slot->conn.AsyncPerform() == kConnFail)
+            {
+                slot->conn.Reset();
+                slot->cache.Close();
+                if(!Notify(client, index, kResultFailed))
+                    aborted = true;
+                break;
+            }
+            slot->busy = true;
+            host.active++;
+            ++busy;
+            if(busy >= slots_.size())
+                break;
         }
     }
+    return busy;
+}
+
+bool HttpCachingBatch::Notify(HttpCachingBatchClient * client, 
+                              size_t index, 
+                              Result result)
+{
+    items_[index].result = result;
+    if(!client)
+        return true;
+    return client->NotifyFileDone(*this, index, result);
+}
+
+void HttpCachingBatch::Abort()
+{
+    for(size_t i = 0; i < slots_.size(); ++i)
+    {
+        Slot * slot = slots_[i];
+        if(!slot->busy)
+            continue;
+        slot->conn.Reset();
+        slot->cache.Close();
+        slot->busy = false;
+    }
 }
 
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 ﻿#ifndef NWEB_HTTP_CACHING_H_
 #define NWEB_HTTP_CACHING_H_
 
+#include <vector>
+#include <deque>
+#include <unordered_map>
 #include "http.h"
 
 
@@ -21,6 +24,18 @@ public:
     virtual bool NotifyProgress(HttpCaching&, HttpCachingProgress&) = 0;
 };
 
+class HttpCachingBatch;
+
+class HttpCachingBatchClient
+{
+public:
+    //[index] is the one returned by HttpCachingBatch::Add.
+    //Return false to abort the batch.
+    virtual bool NotifyFileDone(HttpCachingBatch & batch, 
+                                size_t index, 
+                                Result result) = 0;
+};
+
 class HttpCaching
 {
 public:
@@ -35,6 +50,75 @@ private:
     HttpConnection conn_;
 };
 
+//HttpCachingBatch syncs a list of files the same way as HttpCaching::Sync.
+//All transfers share one multi handle, so keep-alive connections are
+//reused from file to file, and at most SetHostConnections transfers
+//run against one server at a time.
+class HttpCachingBatch
+{
+public:
+    static const uint32_t kDefaultHostConnections = 6;
+    static const uint32_t kDefaultMaxConnections = 32;
+
+public:
+    HttpCachingBatch();
+    ~HttpCachingBatch();
+
+    void SetHostConnections(uint32_t count);
+
+    void SetMaxConnections(uint32_t count);
+
+    //Return the index of the file in the batch.
+    size_t Add(const std::string & url, const std::string & path);
+
+    void Clear();
+
+    size_t Count() const;
+
+    //kResultAgain until the file has been synced.
+    Result GetResult(size_t index) const;
+
+    //Sync every file added, kResultOK when none of them failed.
+    //Files synced by a previous Run are skipped.
+    Result Run(HttpCachingBatchClient * client);
+
+private:
+    struct Item
+    {
+        std::string url;
+        std::string path;
+        Result result;
+    };
+
+    struct Host
+    {
+        std::deque<size_t> pending;
+        uint32_t active;
+    };
+
+    class Slot;
+
+    typedef std::unordered_map<std::string, Host> Hosts;
+
+    HttpCachingBatch(const HttpCachingBatch &);
+    HttpCachingBatch & operator=(const HttpCachingBatch &);
+
+    //Start pending files on idle slots, return the number of busy slots.
+    size_t Schedule(HttpCachingBatchClient * client, bool & aborted);
+
+    bool Notify(HttpCachingBatchClient * client, size_t index, Result result);
+
+    void Abort();
+
+private:
+    std::vector<Item> items_;
+    std::vector<Slot *> slots_;
+    Hosts hosts_;
+    HttpMulti multi_;
+    uint32_t host_connections_;
+    uint32_t max_connections_;
+};
+
 
 
 }
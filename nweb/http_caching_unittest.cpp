@@ -86,4 +86,48 @@ TEST_F(HttpCachingUnitTest, FirstTimeDownloadFile)
      ASSERT_EQ(http_caching_.Sync(url, path.c_str(), &cb), kResultNotModified);
  }
 
+class BatchCollector : public nweb::HttpCachingBatchClient
+{
+public:
+    BatchCollector() : done_(0) {}
+
+    bool NotifyFileDone(nweb::HttpCachingBatch & batch, 
+                        size_t index, 
+                        nweb::Result result)
+    {
+        ++done_;
+        return true;
+    }
+
+    size_t done_;
+};
+
+TEST(HttpCachingBatchTest, SyncManyFiles)
+{
+    using namespace nweb;
+
+    const char * url = "http://soft.pandoramanager.com/dev/VC-Compiler-KB2519277.exe";
+    const size_t count = 8;
+
+    HttpCachingBatch batch;
+    batch.SetHostConnections(2);
+    for(size_t i = 0; i < count; ++i)
+    {
+        char name[32];
+        sprintf_s(name, "batch_%d.exe", static_cast<int>(i));
+        std::string path = GetLocalPath(name);
+        RemoveLocalFile(path);
+        EXPECT_EQ(i, batch.Add(url, path));
+    }
+
+    BatchCollector collector;
+    ASSERT_EQ(kResultOK, batch.Run(&collector));
+    EXPECT_EQ(count, collector.done_);
+    for(size_t i = 0; i < count; ++i)
+        EXPECT_EQ(kResultOK, batch.GetResult(i));
+    //already synced files are skipped
+    ASSERT_EQ(kResultOK, batch.Run(&collector));
+    EXPECT_EQ(count, collector.done_);
 }
+
+}
\ No newline at end of file
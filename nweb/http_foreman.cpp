@@ -1,6 +1,8 @@
-﻿#include <curl/curl.h>
+﻿#include <functional>
+#include <curl/curl.h>
 #include "nweb.h"
 #include "http.h"
+#include "block_pool.h"
 #include "http_foreman.h"
 
 namespace nweb
@@ -8,67 +10,196 @@ namespace nweb
 
 //retry times of fetching http content when failed
 const uint32_t kMaxHttpRetryTimes = 256;
+//max time(ms) waiting for socket activity in one Fetch
+const uint32_t kWaitInterval = 5;
+//min remaining size(bytes) of a range worth splitting for an idle channel
+const uint32_t kMinStealSize = 0x80000;
+//split point alignment of a stolen range
+const uint32_t kStealAlignment = 0x4000;
+//holes smaller than this are gathered into one multi range request
+const uint32_t kMaxRangePartSize = 0x100000;
 
-template<typename T>
-static inline size_t countof(const T & arr)
+static uint32_t Tick()
 {
-    return sizeof(arr)/sizeof(arr[0]);
+    return GetTickCount() / 1000;
 }
 
-static uint32_t Tick()
+//HTTP日期格式, time不大于0时返回空串
+static std::string FormatHttpDate(int64_t time)
 {
-    return GetTickCount() / 1000;
+    std::string date;
+    if(time <= 0)
+        return date;
+
+    time_t value = static_cast<time_t>(time);
+    tm pt = { 0 };
+#ifdef _WIN32
+    if (!gmtime_s(&pt, &value))
+#else
+    if (gmtime_r(&value, &pt))
+#endif
+    {
+        char temp[64];
+        strftime(temp, sizeof(temp), "%a, %d %b %Y %H:%M:%S GMT", &pt);
+        date = temp;
+    }
+    return date;
 }
 
 class Block : public HttpResponse 
 {
+public:
+    //接收整个文件时块已写满
+    typedef std::function<void (uint32_t)> FilledHandler;
+
 private:
     void * data_;
     size_t size_;
     size_t capacity_;
+    size_t limit_;
+    uint64_t first_;
+    uint64_t total_;
+    bool expecting_;
+    bool whole_allowed_;
+    FilledHandler on_filled_;
+    MassFile * whole_;
+    uint64_t position_;
 
 public:
-    Block() : size_(0), data_(0), capacity_() {}
+    Block() 
+        : size_(0), data_(0), capacity_(), limit_(0), 
+          first_(0), total_(0), expecting_(false), whole_allowed_(false), 
+          whole_(0), position_(0) 
+    {
+    }
 
     virtual ~Block()
     {
-        if (data_) 
-        {
-            free(data_);
-            data_ = nullptr;
-        }
-        size_ = 0;
-        capacity_ = 0;
+        Release();
     }
         
     size_t WriteChunk(const void * blob, size_t size)
     {
-        
-        if(size > capacity_ - size_)
-            if(!Expend(size_ + size))
+        if(expecting_)
+        {//只接受请求区间的206应答, 镜像上的文件须与目标长度一致
+            if(GetStatusCode() != HttpStatusCode::kPartialContent)
                 return 0;
+            if(GetContentRange().first() != first_)
+                return 0;
+            uint64_t total = GetContentRangeTotal();
+            if(total != -1 && total != total_)
+                return 0;
+            expecting_ = false;
+        }
+
+        //目标文件尚未打开, 异步传输此前已被暂停
+        if(IsWaitingWhole())
+            return 0;
+        if(whole_)
+            return WriteWhole(blob, size);
+
+        //只接收到limit为止, 超出的部分中止传输
+        size_t take = (std::min)(size, limit_ - size_);
+        if(!take)
+            return 0;
 
         void * dst = reinterpret_cast<char *>(data_) + size_;
-        memcpy(dst, blob, size);
-        size_ += size;
-        return size;
+        memcpy(dst, blob, take);
+        size_ += take;
+        return take;
+    }
+
+    //应答为200时整个正文不经缓冲, 按文件位置依次写入SetWhole给出的文件
+    //每写满一块调用一次on_filled
+    void AllowWhole(const FilledHandler & on_filled)
+    {
+        whole_allowed_ = true;
+        on_filled_ = on_filled;
+    }
+
+    //服务器忽略了区间, 正文开始前等待SetWhole
+    bool IsWaitingWhole() const
+    {
+        return whole_allowed_ && !whole_ && 
+               GetStatusCode() == HttpStatusCode::kOK;
+    }
+
+    void SetWhole(MassFile * file)
+    {
+        whole_ = file;
+    }
+
+    //正在接收整个文件
+    bool IsWhole() const
+    {
+        return whole_ != 0;
+    }
+
+    //接收上限, 不超过缓冲大小
+    void SetLimit(size_t limit)
+    {
+        limit_ = (std::min)(limit, capacity_);
+    }
+
+    size_t limit() const
+    {
+        return limit_;
+    }
+
+    //校验应答的区间, total为文件总长度
+    void Expect(const HttpRange & range, uint64_t total)
+    {
+        first_ = range.first();
+        total_ = total;
+        expecting_ = true;
     }
 
-    bool Expend(size_t size)
+    //从BlockPool获取缓冲, 达到内存上限时返回false
+    bool Prepare()
     {
-        const size_t kStep = 0x400000;
-        size_t new_size = size / kStep * kStep + kStep;
-        data_ = realloc(data_, new_size);
+        if(data_)
+            return true;
+        data_ = BlockPool::Instance().Acquire();
         if(!data_)
             return false;
-        capacity_ = new_size;
+        capacity_ = BlockPool::kBufferSize;
         return true;
     }
 
+    //取走缓冲, 由调用者归还BlockPool
+    void * Detach()
+    {
+        void * data = data_;
+        data_ = nullptr;
+        size_ = 0;
+        capacity_ = 0;
+        limit_ = 0;
+        return data;
+    }
+
+    //缓冲归还BlockPool
+    void Release()
+    {
+        if (data_) 
+        {
+            BlockPool::Instance().Release(data_);
+            data_ = nullptr;
+        }
+        size_ = 0;
+        capacity_ = 0;
+        limit_ = 0;
+    }
+
     void Reset()
     {
         size_ = 0;
-        headers_.clear();
+        limit_ = 0;
+        expecting_ = false;
+        whole_allowed_ = false;
+        on_filled_ = FilledHandler();
+        whole_ = 0;
+        position_ = 0;
+        ClearHeaders();
     }
 
     size_t size() const
@@ -76,12 +207,246 @@ public:
         return size_;
     }
 
+private:
+    size_t WriteWhole(const void * blob, size_t size)
+    {
+        auto data = reinterpret_cast<const char *>(blob);
+        size_t rest = size;
+        while(rest)
+        {
+            uint64_t start = 0;
+            size_t block_size = 0;
+            uint32_t bid = whole_->FindBlock(position_);
+            if(!whole_->GetBlockInfo(bid, start, block_size))
+                return 0;
+            uint32_t offset = static_cast<uint32_t>(position_ - start);
+            size_t take = (std::min)(rest, block_size - offset);
+            if(!whole_->WriteBlock(bid, offset, data, take))
+                return 0;
+            data += take;
+            rest -= take;
+            position_ += take;
+            //按顺序写入, 写到块尾时块已写满
+            if(offset + take == block_size && on_filled_)
+                on_filled_(bid);
+        }
+        return size;
+    }
+
+protected:
+    bool IsWriteReady() const
+    {
+        return !IsWaitingWhole();
+    }
+
+public:
+
     const void * data() const
     {
         return data_;
     }
 };
 
+//流式写入: 应答数据到达时直接写入文件的对应位置
+class Stream : public HttpResponse
+{
+private:
+    MassFile * file_;
+    uint32_t block_id_;
+    uint64_t first_;
+    uint32_t begin_;
+    uint32_t offset_;
+    uint32_t end_;
+    bool checked_;
+
+public:
+    Stream() 
+        : file_(0), block_id_(MassFile::kInvalidBlockId), 
+          first_(0), begin_(0), offset_(0), end_(0), checked_(false) 
+    {
+    }
+
+    //写入块内[offset, offset + range.size()), range为对应的文件区间
+    void Bind(MassFile * file, uint32_t block_id, 
+              uint32_t offset, const HttpRange & range)
+    {
+        file_ = file;
+        block_id_ = block_id;
+        first_ = range.first();
+        begin_ = offset;
+        offset_ = offset;
+        end_ = offset + static_cast<uint32_t>(range.size());
+        checked_ = false;
+    }
+
+    size_t WriteChunk(const void * blob, size_t size)
+    {
+        if(!file_)
+            return 0;
+
+        if(!checked_)
+        {//只接受请求区间的206应答, 其余一律中止
+            if(GetStatusCode() != HttpStatusCode::kPartialContent)
+                return 0;
+            if(GetContentRange().first() != first_)
+                return 0;
+            uint64_t total = GetContentRangeTotal();
+            if(total != -1 && total != file_->GetFileSize())
+                return 0;
+            checked_ = true;
+        }
+
+        //写到end为止, 区间被截断后多余的数据中止传输
+        size_t take = (std::min)(size, static_cast<size_t>(end_ - offset_));
+        if(!take)
+            return 0;
+        if(!file_->WriteBlock(block_id_, offset_, blob, take))
+            return 0;
+        offset_ += static_cast<uint32_t>(take);
+        return take;
+    }
+
+    //缩短区间, 只能截断尚未接收的部分
+    bool Truncate(uint32_t end)
+    {
+        if(end <= offset_ || end >= end_)
+            return false;
+        end_ = end;
+        return true;
+    }
+
+    uint32_t begin() const
+    {
+        return begin_;
+    }
+
+    uint32_t offset() const
+    {
+        return offset_;
+    }
+
+    uint32_t end() const
+    {
+        return end_;
+    }
+
+    void Reset()
+    {
+        file_ = 0;
+        block_id_ = MassFile::kInvalidBlockId;
+        first_ = 0;
+        begin_ = offset_ = end_ = 0;
+        checked_ = false;
+        ClearHeaders();
+    }
+};
+
+//多区间请求中的一个区间, 位置为块内偏移
+struct RangePart
+{
+    uint32_t block_id;
+    uint64_t base;      //块在文件中的起点
+    uint32_t begin;
+    uint32_t offset;    //已接收到的位置
+    uint32_t end;
+};
+
+typedef std::vector<RangePart> RangeParts;
+
+static bool RangePartLess(const RangePart & lhs, const RangePart & rhs)
+{
+    return lhs.base + lhs.begin < rhs.base + rhs.begin;
+}
+
+//多区间流式写入: 各部分的数据到达时写入所在的块
+//服务器合并为单个206时只写入请求的区间, 跳过中间的数据
+class RangeSet : public HttpRangesResponse
+{
+private:
+    MassFile * file_;
+    RangeParts parts_;
+
+public:
+    RangeSet() 
+        : file_(0) 
+    {
+    }
+
+    void Bind(MassFile * file, const RangeParts & parts)
+    {
+        file_ = file;
+        parts_ = parts;
+    }
+
+    bool WriteRange(uint64_t position, const void * blob, size_t size)
+    {
+        if(!file_)
+            return false;
+        //服务器忽略了区间, 不接收整个文件
+        if(GetForm() == kFormWhole)
+            return false;
+        uint64_t total = GetTotal();
+        if(total != -1 && total != file_->GetFileSize())
+            return false;
+
+        bool wanted = false;
+        auto data = reinterpret_cast<const char *>(blob);
+        for(size_t i = 0; i < parts_.size(); ++i)
+        {
+            RangePart & part = parts_[i];
+            uint64_t current = part.base + part.offset;
+            uint64_t stop = part.base + part.end;
+            if(current >= stop || stop <= position)
+                continue;
+            wanted = true;
+            //只按顺序接收, 跳过的部分之后重新下载
+            if(current < position || current >= position + size)
+                continue;
+            size_t take = static_cast<size_t>((std::min)(stop, position + size) - current);
+            if(!file_->WriteBlock(part.block_id, part.offset, data + (current - position), take))
+                return false;
+            part.offset += static_cast<uint32_t>(take);
+        }
+        //之后的数据都已不需要, 中止传输
+        return wanted;
+    }
+
+    //块内的请求区间, 块不在请求中时返回false
+    bool Find(uint32_t block_id, uint32_t & begin, uint32_t & end) const
+    {
+        for(size_t i = 0; i < parts_.size(); ++i)
+        {
+            if(parts_[i].block_id != block_id)
+                continue;
+            begin = parts_[i].begin;
+            end = parts_[i].end;
+            return true;
+        }
+        return false;
+    }
+
+    bool IsComplete() const
+    {
+        for(size_t i = 0; i < parts_.size(); ++i)
+        {
+            if(parts_[i].offset != parts_[i].end)
+                return false;
+        }
+        return !parts_.empty();
+    }
+
+    const RangeParts & parts() const
+    {
+        return parts_;
+    }
+
+    void Reset()
+    {
+        HttpRangesResponse::Reset();
+        file_ = 0;
+        parts_.clear();
+    }
+};
 
 class HttpChannel
 {
@@ -98,17 +463,21 @@ private:
     HttpConnection conn_;
     HttpRequest  request_;
     Block block_;
+    Stream stream_;
+    RangeSet ranges_;
     bool has_open_;
+    bool if_range_;
+    bool multi_range_;
+    bool streaming_;
+    bool truncated_;
+    bool duplicate_;
+    uint32_t block_id_;
+    uint32_t begin_;
+    uint32_t mirror_;
+    size_t reported_in_;
+    HttpChannel * twin_;
 
-public:
-    HttpChannel() : has_open_(false) {}
-
-    ~HttpChannel() 
-    {
-        conn_.fini();
-    }
-        
-    bool Open(const char * url, bool nobody)
+    bool OpenWith(const char * url, bool nobody, HttpResponse * response)
     {
         if(has_open_)
             return false;
@@ -119,20 +488,310 @@ public:
         else 
             conn_.SetRequestMethod(HttpRequestMethod::kGet);
         conn_.SetRequest(&request_);
-        conn_.SetResponse(&block_);
+        conn_.SetResponse(response);
         conn_.SetLowSpeedLimit(8, 60);
         conn_.SetConnectTimeout(60000);
         conn_.EnableRedirection(true);
         conn_.SetMaxRedirection(5);
         has_open_ = true;
+        reported_in_ = 0;
+        //立即加入multi, 由multi的驱动者推进传输
+        return conn_.AsyncPerform() != kConnFail;
+    }
+
+public:
+    HttpChannel() 
+        : has_open_(false), if_range_(false), multi_range_(false), streaming_(false), truncated_(false),
+          duplicate_(false), block_id_(MassFile::kInvalidBlockId), 
+          begin_(0), mirror_(MirrorSet::kInvalidMirror), 
+          reported_in_(0), twin_(0) 
+    {
+    }
+
+    ~HttpChannel() 
+    {
+        conn_.fini();
+    }
+
+    bool Open(const char * url, bool nobody)
+    {
+        return OpenWith(url, nobody, &block_);
+    }
+
+    //下载整块到内存
+    bool OpenBlock(const char * url, uint32_t block_id, 
+                   const HttpRange & range, uint64_t total)
+    {
+        if(!block_.Prepare())
+            return false;
+        block_.SetLimit(range.size());
+        block_.Expect(range, total);
+        SetRange(range);
+        if(!OpenWith(url, false, &block_))
+            return false;
+        block_id_ = block_id;
+        return true;
+    }
+
+    //用区间GET探测文件, 收到的数据作为第0块保留,
+    //不支持区间请求的服务器返回200时传输暂停, SetWhole之后整个文件直接写入
+    bool OpenScout(const char * url, size_t size, const Block::FilledHandler & on_filled)
+    {
+        if(!block_.Prepare())
+            return false;
+        block_.SetLimit(size);
+        block_.AllowWhole(on_filled);
+        SetRange(HttpRange(0, size));
+        if(!OpenWith(url, false, &block_))
+            return false;
+        block_id_ = 0;
         return true;
     }
 
+    //下载块内[offset, offset + range.size())并直接写入文件
+    bool OpenStream(const char * url, MassFile & file, uint32_t block_id, 
+                    uint32_t offset, const HttpRange & range)
+    {
+        SetRange(range);
+        stream_.Bind(&file, block_id, offset, range);
+        if(!OpenWith(url, false, &stream_))
+            return false;
+        block_id_ = block_id;
+        streaming_ = true;
+        return true;
+    }
+
+    //在一个请求中下载多个块内的区间, 直接写入文件
+    //通道不属于任何单个块, 不参与分割和重复下载
+    bool OpenRanges(const char * url, MassFile & file, const RangeParts & parts)
+    {
+        HttpRanges ranges;
+        for(size_t i = 0; i < parts.size(); ++i)
+        {
+            const RangePart & part = parts[i];
+            ranges.push_back(HttpRange(part.base + part.begin, part.end - part.begin));
+        }
+        request_.SetRanges(ranges);
+        ranges_.Bind(&file, parts);
+        if(!OpenWith(url, false, &ranges_))
+            return false;
+        streaming_ = true;
+        multi_range_ = true;
+        return true;
+    }
+
+    //收尾阶段重复下载其他通道剩余的区间到内存, 先完成的一方被保留
+    bool OpenDuplicate(const char * url, uint32_t block_id, uint32_t offset,
+                       const HttpRange & range, uint64_t total)
+    {
+        if(!block_.Prepare())
+            return false;
+        block_.SetLimit(range.size());
+        block_.Expect(range, total);
+        SetRange(range);
+        if(!OpenWith(url, false, &block_))
+            return false;
+        block_id_ = block_id;
+        begin_ = offset;
+        duplicate_ = true;
+        return true;
+    }
+
+    //通道上的传输由共享的multi驱动, context用于识别通道的所属
+    //接收的数据计入任务的限速器, 传输耗时计入任务的统计
+    bool Attach(HttpMulti & multi, void * context, 
+                RateLimiter * limiter, HttpStats * stats)
+    {
+        conn_.SetContext(context);
+        conn_.SetRateLimiter(limiter);
+        conn_.SetStats(stats);
+        return conn_.SetMulti(&multi);
+    }
+
+    bool IsOpen() const
+    {
+        return has_open_;
+    }
+
     void Close()
     {
         conn_.Reset();
         block_.Reset();
+        stream_.Reset();
+        ranges_.Reset();
         has_open_ = false;
+        multi_range_ = false;
+        streaming_ = false;
+        truncated_ = false;
+        duplicate_ = false;
+        block_id_ = MassFile::kInvalidBlockId;
+        begin_ = 0;
+        mirror_ = MirrorSet::kInvalidMirror;
+        Unpair();
+    }
+
+    //与重复下载同一区间的通道配对
+    void Pair(HttpChannel * twin)
+    {
+        Unpair();
+        twin->Unpair();
+        twin_ = twin;
+        twin->twin_ = this;
+    }
+
+    void Unpair()
+    {
+        if(twin_)
+        {
+            twin_->twin_ = 0;
+            twin_ = 0;
+        }
+    }
+
+    HttpChannel * twin() const
+    {
+        return twin_;
+    }
+
+    bool IsDuplicate() const
+    {
+        return duplicate_;
+    }
+
+    //请求所用的镜像, Close时清除
+    void SetMirror(uint32_t mirror)
+    {
+        mirror_ = mirror;
+    }
+
+    uint32_t mirror() const
+    {
+        return mirror_;
+    }
+
+    //预留块缓冲, Close之后仍保留, 直到Release
+    bool Reserve()
+    {
+        return block_.Prepare();
+    }
+
+    void Release()
+    {
+        block_.Release();
+    }
+
+    //取走已接收的块缓冲, 通道之后重新获取缓冲
+    void * DetachBuffer()
+    {
+        return block_.Detach();
+    }
+
+    bool IsStreaming() const
+    {
+        return streaming_;
+    }
+
+    //探测请求正在或已经接收整个文件
+    bool IsWhole() const
+    {
+        return block_.IsWhole();
+    }
+
+    //探测请求收到200, 等待打开目标文件
+    bool IsWaitingWhole() const
+    {
+        return block_.IsWaitingWhole();
+    }
+
+    void SetWhole(MassFile * file)
+    {
+        block_.SetWhole(file);
+    }
+
+    uint32_t block_id() const
+    {
+        return block_id_;
+    }
+
+    bool IsMultiRange() const
+    {
+        return multi_range_;
+    }
+
+    //多区间请求涉及的块
+    void GetRangeBlocks(std::vector<uint32_t> & bids) const
+    {
+        auto & parts = ranges_.parts();
+        for(size_t i = 0; i < parts.size(); ++i)
+            bids.push_back(parts[i].block_id);
+    }
+
+    //服务器是否以multipart/byteranges应答, 应答尚未开始时视为支持
+    bool IsMultipartAnswered() const
+    {
+        auto form = ranges_.GetForm();
+        return form == RangeSet::kFormUnknown || form == RangeSet::kFormMultipart;
+    }
+
+    //通道在块内请求的区间[begin, end), 未请求该块时返回false
+    bool FindRange(uint32_t bid, uint32_t & begin, uint32_t & end) const
+    {
+        if(multi_range_)
+            return ranges_.Find(bid, begin, end);
+        if(block_id_ != bid)
+            return false;
+        begin = RangeBegin();
+        end = RangeEnd();
+        return true;
+    }
+
+    //请求区间在块内的位置[RangeBegin, RangeEnd), 已接收到RangeOffset
+    uint32_t RangeBegin() const
+    {
+        return streaming_ ? stream_.begin() : begin_;
+    }
+
+    uint32_t RangeOffset() const
+    {
+        if(streaming_)
+            return stream_.offset();
+        return begin_ + static_cast<uint32_t>(block_.size());
+    }
+
+    uint32_t RangeEnd() const
+    {
+        if(streaming_)
+            return stream_.end();
+        return begin_ + static_cast<uint32_t>(block_.limit());
+    }
+
+    //把请求区间截断到end, 后半部分交给其他通道
+    bool Truncate(uint32_t end)
+    {
+        if(!has_open_ || block_id_ == MassFile::kInvalidBlockId)
+            return false;
+        if(end <= RangeOffset() || end >= RangeEnd())
+            return false;
+        if(streaming_)
+            stream_.Truncate(end);
+        else
+            block_.SetLimit(end - begin_);
+        truncated_ = true;
+        return true;
+    }
+
+    bool IsTruncated() const
+    {
+        return truncated_;
+    }
+
+    bool IsRangeComplete() const
+    {
+        if(multi_range_)
+            return ranges_.IsComplete();
+        if(block_id_ == MassFile::kInvalidBlockId)
+            return false;
+        return RangeEnd() > RangeBegin() && RangeOffset() == RangeEnd();
     }
 
     Error Transfer(uint32_t & in)
@@ -146,12 +805,17 @@ public:
             return kIdle;
 
         auto result = conn_.AsyncPerform();
-        in = conn_.InSize();
+        in = conn_.InSize() - reported_in_;
+        reported_in_ = conn_.InSize();
         if(result == kConnOK)
             return kDone;
         else if(result != kConnAgain)
+        {
+            //区间已收满, 截断后多余的数据被中止
+            if(IsRangeComplete())
+                return kDone;
             return kFailed;
-        conn_.Wait(5);
+        }
         return kAgain;
     }
 
@@ -166,61 +830,193 @@ public:
             request_.SetRange(range.first(), range.last());
     };
 
-    void RemoveRange()
-    {
-        request_.RemoveHeader("Range");
-    };
+    void RemoveRange()
+    {
+        request_.ClearRange();
+    };
+
+    //之后的请求附带If-Range, validator为空时不再附带
+    void SetIfRange(const std::string & validator)
+    {
+        if_range_ = !validator.empty();
+        if(if_range_)
+            request_.AddHeader("If-Range", validator.data());
+        else
+            request_.RemoveHeader("If-Range");
+    }
+
+    //附带If-Range的区间请求得到200, 源文件已改变
+    bool IsObjectChanged() const
+    {
+        if(!has_open_ || !if_range_)
+            return false;
+        const HttpResponse * response = &block_;
+        if(multi_range_)
+            response = &ranges_;
+        else if(streaming_)
+            response = &stream_;
+        return response->GetStatusCode() == HttpStatusCode::kOK;
+    }
+
+    const char * EffectiveURL() const
+    {
+        return conn_.GetUrl();
+    }
+};
+
+/*
+HttpForeman
+*/
+HttpForeman::HttpForeman()
+    : stage_(kFetchStagePrepare),
+      retry_count_(0), 
+      expected_length_(-1),
+      multi_(&own_multi_),
+      streaming_(false),
+      progressive_(false),
+      prioritized_cursor_(MassFile::kInvalidBlockId),
+      channel_count_(kDefaultChannelCount),
+      input_stats_(0),
+      stolen_size_(0),
+      endgame_limit_(kDefaultEndgameLimit),
+      duplicated_size_(0),
+      saved_size_(0),
+      ranges_per_request_(kDefaultRangesPerRequest),
+      multipart_ok_(true),
+      store_(0),
+      reused_size_(0)
+{
+}
+
+HttpForeman::~HttpForeman()
+{
+    DestroyChannels();
+}
+
+void HttpForeman::SetPrimaryUrl( const char* url )
+{
+    url_ = url;
+}
+
+void HttpForeman::AddMirrorUrl(const char * url)
+{
+    if(url && *url)
+        mirror_urls_.push_back(url);
+}
+
+void HttpForeman::SetFilePath( const char* path )
+{
+    path_ = path;
+}
+
+void HttpForeman::SetFileSize( uint64_t filesize )
+{
+    expected_length_ = filesize;
+}
+
+void HttpForeman::SetChannelCount(uint32_t count)
+{
+    channel_count_ = (std::max)(1u, (std::min)(count, kMaxChannelCount));
+}
+
+void HttpForeman::SetStreaming(bool streaming)
+{
+    streaming_ = streaming;
+}
+
+void HttpForeman::SetBlockManifest(const BlockManifest & manifest)
+{
+    manifest_ = manifest;
+}
+
+void HttpForeman::SetEndgameLimit(uint64_t limit)
+{
+    endgame_limit_ = limit;
+}
+
+void HttpForeman::SetRateLimit(uint64_t rate)
+{
+    rate_limiter_.SetRate(rate);
+}
 
-    const char * EffectiveURL() const
-    {
-        return conn_.GetUrl();
-    }
-};
+void HttpForeman::SetProgressive(bool progressive)
+{
+    progressive_ = progressive;
+}
 
-/*
-HttpForeman
-*/
-HttpForeman::HttpForeman()
-    : stage_(kFetchStagePrepare),
-      retry_count_(0), 
-      expected_length_(-1)
+void HttpForeman::SetDurability(const MassFile::Durability & durability)
 {
-    memset(channels_, 0, sizeof(channels_));
+    mass_file_.SetDurability(durability);
 }
 
-HttpForeman::~HttpForeman()
+void HttpForeman::SetBlockStore(BlockStore * store)
 {
-    DestroyChannels();
+    store_ = store;
+    verifier_.SetStore(store);
 }
 
-void HttpForeman::SetPrimaryUrl( const char* url )
+bool HttpForeman::Read(uint64_t offset, void * data, size_t size, uint32_t timeout)
 {
-    url_ = url;
+    return mass_file_.Read(offset, data, size, timeout);
 }
 
-void HttpForeman::SetFilePath( const char* path )
+void HttpForeman::SetRangesPerRequest(uint32_t count)
 {
-    path_ = path;
+    ranges_per_request_ = (std::max)(1u, (std::min)(count, kMaxRangesPerRequest));
 }
 
-void HttpForeman::SetFileSize( uint64_t filesize )
+void HttpForeman::AttachMulti(HttpMulti * multi)
 {
-    expected_length_ = filesize;
+    HttpMulti * target = multi ? multi : &own_multi_;
+    if(target == multi_)
+        return;
+    DestroyChannels();
+    multi_ = target;
+    //外部驱动时校验和写入完成后唤醒驱动者, 自行驱动时由Fetch取回
+    std::function<void ()> notify;
+    HttpSocketWatcher * watcher = multi_->GetWatcher();
+    if(watcher)
+        notify = [watcher]() { watcher->Wake(); };
+    verifier_.SetNotify(notify);
+    writer_.SetNotify(notify);
 }
 
 Result HttpForeman::Fetch()
 {
     input_stats_ = 0;
+    bool self_driven = multi_ == &own_multi_;
+    //先驱动所有通道的传输, 完成的通道在本次Fetch中即可重新分配
+    if(self_driven && !multi_->Perform())
+    {
+        CloseChannels();
+        return kResultFailed;
+    }
+
+    Result result = kResultFailed;
     switch(stage_)
     {
     case kFetchStagePrepare:
-        return DoPrepare();
+        result = DoPrepare();
+        break;
     case kFetchStageScout:    
-        return DoScout();
+        result = DoScout();
+        break;
     case kFetchStageDownload:
-        return DoDownload();
+        result = DoDownload();
+        break;
     }
-    return kResultFailed;
+    //所有通道共用一次等待
+    if(result == kResultAgain)
+    {
+        if(self_driven)
+            multi_->Wait(kWaitInterval);
+    }
+    else if(result != kResultOK)
+    {
+        //失败时释放所有通道上的传输
+        CloseChannels();
+    }
+    return result;
 }
 
 
@@ -233,6 +1029,8 @@ uint64_t HttpForeman::FetchedSize() const
         return result;
     
     result += DownloadingSize();
+    //已下载完正在写入的块
+    result += writer_.InflightSize();
     return result;
 }
 
@@ -246,6 +1044,41 @@ uint32_t HttpForeman::InputStats() const
     return input_stats_;
 }
 
+void HttpForeman::GetTransferStats(HttpStats::Snapshot & snapshot) const
+{
+    stats_.GetSnapshot(snapshot);
+}
+
+uint64_t HttpForeman::StolenSize() const
+{
+    return stolen_size_;
+}
+
+uint64_t HttpForeman::EndgameDuplicatedSize() const
+{
+    return duplicated_size_;
+}
+
+uint64_t HttpForeman::EndgameSavedSize() const
+{
+    return saved_size_;
+}
+
+uint64_t HttpForeman::ReusedSize() const
+{
+    return reused_size_;
+}
+
+bool HttpForeman::IsTransferring() const
+{
+    for(size_t i = 0; i < channels_.size(); ++i)
+    {
+        if(channels_[i] && channels_[i]->IsOpen())
+            return true;
+    }
+    return false;
+}
+
 Result HttpForeman::DoPrepare()
 {
     if(url_.empty())
@@ -258,6 +1091,11 @@ Result HttpForeman::DoPrepare()
         return kResultFailed;
 
     retry_count_ = 0;
+    stolen_size_ = 0;
+    duplicated_size_ = 0;
+    saved_size_ = 0;
+    reused_size_ = 0;
+    multipart_ok_ = true;
     stage_ = kFetchStageScout;
     return kResultAgain;
 }
@@ -269,40 +1107,54 @@ Result HttpForeman::DoScout()
     if(!scout)
         return kResultFailed;
 
+    //接收整个文件时写满的块已在校验, 及时取回结果
+    if(!CollectVerified())
+        return kResultSaveBlockFailded;
+
     auto error = scout->Transfer(in);
     switch(error)
     {
     case HttpChannel::kIdle:
         {
-            scout->RemoveRange();
-            scout->Open(url_.data(), true);
+            Probe(scout);
             return kResultAgain;
         }
     case HttpChannel::kDone:
         {
             auto & block = scout->block();
-            if(block.GetStatusCode() != HttpStatusCode::kOK)
-                return kResultFailed;
-            if(expected_length_ != -1)
-                if(block.GetContentLength() != expected_length_)
-                    return kResultFileSizeMismatch;
-            if(!block.HasContentLength())
-                return kResultFileSizeUnknown;
-            expected_length_ = block.GetContentLength();
-            //open mass file
-            const char * filename = path_.data();
-            bool resumeable = false;
-            if(mass_file_.Open(filename))
-                if(mass_file_.GetFileSize() == expected_length_)
-                    resumeable = true;
-            if(!resumeable)
-                if(!mass_file_.Create(filename, expected_length_))
-                    return kResultOpenFileFailded;
-
-            pendding_blocks_ = mass_file_.FindInvalidBlocks();
+            bool whole = scout->IsWhole();
+            if(!whole)
+            {
+                Result result = OpenTarget(block, false);
+                if(result != kResultAgain)
+                    return result;
+                //416表示空文件, 没有数据
+                bool keep = block.GetStatusCode() != HttpStatusCode::kRangeNotSatisfiable;
+                if(keep && !KeepScoutData(scout))
+                    return kResultSaveBlockFailded;
+            }
             //更新URL
             url_ = scout->EffectiveURL();
+            mirrors_.Clear();
+            mirrors_.Add(url_.data());
+            for(size_t i = 0; i < mirror_urls_.size(); ++i)
+                mirrors_.Add(mirror_urls_[i].data());
+            //连接留在multi的连接缓存中, 供下载阶段复用
             scout->Close();
+            scout->Release();
+            if(whole)
+            {//整个文件已写入, 写满的块校验后生效, 其余的块重新排队
+                BlockQueue blocks = mass_file_.FindInvalidBlocks();
+                pendding_blocks_ = BlockQueue();
+                for(; !blocks.empty(); blocks.pop())
+                    Settle(blocks.front());
+            }
+            else
+            {
+                pendding_blocks_ = mass_file_.FindInvalidBlocks();
+                FillFromStore();
+            }
+            prioritized_cursor_ = MassFile::kInvalidBlockId;
             retry_count_ = 0;    
             stage_ = kFetchStageDownload;
             return kResultAgain;
@@ -312,25 +1164,160 @@ Result HttpForeman::DoScout()
             if(retry_count_++ > kMaxHttpRetryTimes)
                 return kResultFailed;
             scout->Close();
-            scout->Open(url_.data(), true);
+            Probe(scout);
             return kResultAgain;
         }
     case HttpChannel::kAgain:
+        if(scout->IsWaitingWhole())
+        {//服务器忽略了区间, 打开目标文件之后恢复传输
+            Result result = OpenTarget(scout->block(), true);
+            if(result != kResultAgain)
+            {
+                scout->Close();
+                return result;
+            }
+            scout->SetWhole(&mass_file_);
+        }
         return kResultAgain;
     }
     return kResultFailed;
 }
 
+void HttpForeman::Probe(HttpChannel * scout)
+{
+    //探测请求取得当前的校验器, 不附带If-Range
+    scout->SetIfRange(std::string());
+    //写满的块立即校验, 不在片段中累积
+    auto on_filled = [this](uint32_t bid)
+    {
+        Settle(bid);
+    };
+    if(scout->OpenScout(url_.data(), BlockPool::kBufferSize, on_filled))
+        return;
+    //缓冲不足时退回HEAD
+    scout->Close();
+    scout->RemoveRange();
+    scout->Open(url_.data(), true);
+}
+
+Result HttpForeman::OpenTarget(const HttpResponse & response, bool whole)
+{
+    uint64_t length = -1;
+    switch(response.GetStatusCode())
+    {
+    case HttpStatusCode::kOK:
+        //HEAD, 或服务器不支持区间请求
+        if(response.HasContentLength())
+            length = response.GetContentLength();
+        break;
+    case HttpStatusCode::kPartialContent:
+        if(response.GetContentRange().first() != 0)
+            return kResultFailed;
+        length = response.GetContentRangeTotal();
+        break;
+    case HttpStatusCode::kRangeNotSatisfiable:
+        //空文件
+        length = response.GetContentRangeTotal();
+        break;
+    default:
+        return kResultFailed;
+    }
+    if(expected_length_ != -1 && length != -1)
+        if(length != expected_length_)
+            return kResultFileSizeMismatch;
+    if(length == -1)
+        return kResultFileSizeUnknown;
+    expected_length_ = length;
+    //源文件的校验器, 弱ETag不能用于区间请求
+    std::string etag = response.GetETag();
+    if(!etag.compare(0, 2, "W/"))
+        etag.clear();
+    int64_t modified = response.HasLastModified() ? response.GetLastModified() : 0;
+    //open mass file, 重试整体下载时先关闭上次打开的文件
+    //校验线程可能仍在读上次接收的块
+    verifier_.Wait();
+    mass_file_.Close();
+    const char * filename = path_.data();
+    bool resumeable = false;
+    bool changed = false;
+    //整个文件都会重新收到, 不续传
+    if(!whole && mass_file_.Open(filename))
+        if(mass_file_.GetFileSize() == expected_length_)
+        {
+            resumeable = true;
+            changed = !IsSameOrigin(etag, modified);
+        }
+    //源文件已改变时, 没有清单无法判断哪些块仍然可用, 重新下载
+    if(changed && manifest_.IsEmpty())
+        resumeable = false;
+    if(!resumeable)
+    {
+        changed = false;
+        mass_file_.Close();
+        if(!mass_file_.Create(filename, expected_length_))
+            return kResultOpenFileFailded;
+    }
+    //有校验清单时, 块通过校验后才记入日志
+    mass_file_.DeferValidation(!manifest_.IsEmpty());
+    //已下载的块按新的清单重新校验, 只下载不一致的块
+    if(changed)
+        mass_file_.ReopenBlocks();
+    mass_file_.SetValidator(etag, modified);
+    if_range_ = etag.empty() ? FormatHttpDate(modified) : etag;
+    return kResultAgain;
+}
+
+bool HttpForeman::IsSameOrigin(const std::string & etag, int64_t last_modified) const
+{
+    std::string saved_etag;
+    int64_t saved_modified = 0;
+    mass_file_.GetValidator(saved_etag, saved_modified);
+    if(!saved_etag.empty() && !etag.empty())
+        return saved_etag == etag;
+    if(saved_modified > 0 && last_modified > 0)
+        return saved_modified == last_modified;
+    //保存过校验器而服务器不再提供时无法确认
+    return saved_etag.empty() && saved_modified <= 0;
+}
+
+bool HttpForeman::KeepScoutData(HttpChannel * scout)
+{
+    const Block & block = scout->block();
+    uint64_t offset = 0;
+    size_t size = 0;
+    if(!block.size() || mass_file_.IsBlockValid(0))
+        return true;
+    if(!mass_file_.GetBlockInfo(0, offset, size))
+        return true;
+
+    auto data = block.data();
+    if(block.size() < size)
+    {//文件头不足一块时只记录已收到的部分
+        return mass_file_.WriteBlock(0, 0, data, block.size());
+    }
+    if(!manifest_.IsEmpty())
+    {
+        verifier_.Verify(manifest_, 0, scout->DetachBuffer(), size);
+        return true;
+    }
+    return mass_file_.SaveBlock(0, data, size);
+}
+
 Result HttpForeman::DoDownload()
 {
+    if(!CollectVerified() || !CollectWritten())
+        return kResultSaveBlockFailded;
+
     if(HasFinished()) 
     {
         mass_file_.Finish();
-        mass_file_.Close();
+        //渐进模式下使用者可能仍在读取
+        if(!progressive_)
+            mass_file_.Close();
         return kResultOK;
     }
 
-    for(size_t i = 0; i < countof(channels_); ++i)
+    for(size_t i = 0; i < channels_.size(); ++i)
     {
         auto worker = channels_[i];
         if(!worker)
@@ -339,41 +1326,106 @@ Result HttpForeman::DoDownload()
         uint32_t in = 0;
         auto error = worker->Transfer(in);
         input_stats_ += in;
+        mirrors_.NoteInput(worker->mirror(), in);
         switch(error)
         {
         case HttpChannel::kIdle: 
             {
-                if(pendding_blocks_.empty())
-                    break;
-                uint32_t bid = pendding_blocks_.front();
-                pendding_blocks_.pop();
-                uint64_t offset = 0;
-                size_t size = 0;;
-                mass_file_.GetBlockInfo(bid, offset, size);
-                HttpRange range(offset, size);
-                worker->SetRange(range);
-                worker->Open(url_.data(), false);
+                Dispatch(worker);
                 break;
             }
         case HttpChannel::kDone: 
             {
+                if(worker->IsMultiRange())
+                {
+                    if(FinishRanges(worker))
+                        retry_count_ = 0;
+                    else if(retry_count_++ > kMaxHttpRetryTimes)
+                        return kResultFailed;
+                    Dispatch(worker);
+                    break;
+                }
+                if(worker->IsDuplicate())
+                {
+                    if(!FinishDuplicate(worker))
+                        return kResultSaveBlockFailded;
+                    Dispatch(worker);
+                    break;
+                }
+                //原请求先完成, 取消重复的下载
+                CancelDuplicate(worker);
+                if(worker->IsStreaming() || worker->IsTruncated())
+                {
+                    uint32_t bid = worker->block_id();
+                    if(!worker->IsStreaming())
+                    {//被分割的整块请求, 只写入截断位置之前的部分
+                        const Block & block = worker->block();
+                        if(!mass_file_.WriteBlock(bid, 0, block.data(), block.size()))
+                            return kResultSaveBlockFailded;
+                    }
+                    bool complete = worker->IsRangeComplete();
+                    if(complete)
+                        mirrors_.NoteSuccess(worker->mirror());
+                    else
+                        mirrors_.NoteFailure(worker->mirror());
+                    worker->Close();
+                    if(complete)
+                    {
+                        retry_count_ = 0;
+                    }
+                    else if(retry_count_++ > kMaxHttpRetryTimes)
+                    {//应答提前结束
+                        return kResultFailed;
+                    }
+                    Settle(bid);
+                    Dispatch(worker);
+                    break;
+                }
                 const Block & block = worker->block();
                 auto range = block.GetContentRange();
                 auto bid = mass_file_.GetBlockId(range.first(), range.size());
-                auto data = block.data();
                 auto size = block.size();
-                if(!mass_file_.SaveBlock(bid, data, size)) 
+                if(!manifest_.IsEmpty() && bid != MassFile::kInvalidBlockId)
+                {//缓冲交给校验线程, 通道换用新的缓冲继续下载
+                    verifier_.Verify(manifest_, bid, worker->DetachBuffer(), size);
+                }
+                else if(!StoreBlock(bid, worker->DetachBuffer(), size)) 
+                {
                     return kResultSaveBlockFailded;
+                }
+                mirrors_.NoteSuccess(worker->mirror());
                 worker->Close();
                 retry_count_ = 0;
+                //通道已空闲, 立即分配下一块
+                Dispatch(worker);
                 break;
             }
         case HttpChannel::kFailed:
             {
+                //已写入的数据可能属于旧版本, 交给下一次Fetch按校验器处理
+                if(worker->IsObjectChanged())
+                    return kResultObjectChanged;
                 if(retry_count_++ > kMaxHttpRetryTimes)
                     return kResultFailed;
+                if(worker->IsMultiRange())
+                {//各块从已写入处重新排队
+                    FinishRanges(worker);
+                    Dispatch(worker);
+                    break;
+                }
+                //失败过多的镜像被暂停, 重试时换用其他镜像
+                mirrors_.NoteFailure(worker->mirror());
+                if(worker->IsDuplicate())
+                {//重复的下载失败不再重试, 原请求仍在进行
+                    worker->Close();
+                    Dispatch(worker);
+                    break;
+                }
+                //流式下载时从块内断点处继续
+                uint32_t bid = worker->block_id();
                 worker->Close();
-                worker->Open(url_.data(), false);
+                if(!Assign(worker, bid))
+                    Dispatch(worker);
                 break;
             }
         case HttpChannel::kAgain:
@@ -384,6 +1436,481 @@ Result HttpForeman::DoDownload()
     return kResultAgain;
 }
 
+void HttpForeman::Dispatch(HttpChannel * worker)
+{
+    //缓冲模式下先取得块缓冲, 内存达到上限时通道保持空闲等待
+    if(!streaming_ && !pendding_blocks_.empty())
+        if(!worker->Reserve())
+            return;
+
+    if(progressive_)
+        PrioritizeBlocks();
+
+    while(!pendding_blocks_.empty())
+    {
+        uint32_t bid = pendding_blocks_.front();
+        pendding_blocks_.pop();
+        if(Assign(worker, bid))
+            return;
+    }
+    //没有可分配的块, 缓冲留给其他通道
+    worker->Release();
+    //分担其他通道剩余最多的区间, 缩短收尾时间
+    if(!Steal(worker))
+        Duplicate(worker);
+}
+
+bool HttpForeman::Assign(HttpChannel * worker, uint32_t bid)
+{
+    uint64_t offset = 0;
+    size_t size = 0;
+    if(!mass_file_.GetBlockInfo(bid, offset, size))
+        return false;
+
+    //只请求块内尚未写入且没有其他通道在下载的部分
+    uint32_t hole = 0;
+    size_t hole_size = 0;
+    if(verifier_.IsPending(bid) || writer_.IsPending(bid))
+        return false;
+    if(!mass_file_.GetBlockHole(bid, hole, hole_size))
+    {//续传时已写满的块
+        Settle(bid);
+        return false;
+    }
+    if(!ClipHole(worker, bid, hole, hole_size))
+        return false;
+
+    if(!streaming_ && hole_size == size)
+    {
+        const char * url = PickUrl(worker);
+        worker->OpenBlock(url, bid, HttpRange(offset, size), expected_length_);
+        return true;
+    }
+
+    //较小的空洞与其他块的空洞合并请求
+    if(ranges_per_request_ > 1 && multipart_ok_ && hole_size < kMaxRangePartSize)
+        if(AssignRanges(worker, bid, hole, hole_size))
+            return true;
+
+    //块已被分割时缓冲模式也直接写入文件
+    HttpRange range(offset + hole, hole_size);
+    worker->OpenStream(PickUrl(worker), mass_file_, bid, hole, range);
+    return true;
+}
+
+bool HttpForeman::AssignRanges(HttpChannel * worker, uint32_t bid,
+                               uint32_t hole, size_t hole_size)
+{
+    RangeParts parts;
+    RangePart first = {bid, 0, hole, hole, hole + static_cast<uint32_t>(hole_size)};
+    size_t size = 0;
+    if(!mass_file_.GetBlockInfo(bid, first.base, size))
+        return false;
+    parts.push_back(first);
+
+    while(parts.size() < ranges_per_request_ && !pendding_blocks_.empty())
+    {
+        //先查看队首, 不适合合并的块留给之后的请求
+        uint32_t next = pendding_blocks_.front();
+        RangePart part = {next, 0, 0, 0, 0};
+        uint32_t part_hole = 0;
+        size_t part_size = 0;
+        bool listed = false;
+        for(size_t i = 0; i < parts.size(); ++i)
+            listed = listed || parts[i].block_id == next;
+        if(listed || verifier_.IsPending(next) || writer_.IsPending(next) ||
+           !mass_file_.GetBlockInfo(next, part.base, size))
+        {
+            pendding_blocks_.pop();
+            continue;
+        }
+        if(!mass_file_.GetBlockHole(next, part_hole, part_size))
+        {
+            pendding_blocks_.pop();
+            Settle(next);
+            continue;
+        }
+        if(!ClipHole(worker, next, part_hole, part_size))
+        {
+            pendding_blocks_.pop();
+            continue;
+        }
+        if(part_size >= kMaxRangePartSize)
+            break;
+        pendding_blocks_.pop();
+        part.begin = part.offset = part_hole;
+        part.end = part_hole + static_cast<uint32_t>(part_size);
+        parts.push_back(part);
+    }
+    //只有一个区间时使用普通的区间请求
+    if(parts.size() < 2)
+        return false;
+
+    std::sort(parts.begin(), parts.end(), RangePartLess);
+    //请求未能发出时各块重新排队
+    if(!worker->OpenRanges(PickUrl(worker), mass_file_, parts))
+        FinishRanges(worker);
+    return true;
+}
+
+bool HttpForeman::FinishRanges(HttpChannel * worker)
+{
+    bool complete = worker->IsRangeComplete();
+    if(!worker->IsMultipartAnswered())
+    {//服务器合并了区间或忽略了区间, 之后每个请求只含一个区间
+        multipart_ok_ = false;
+    }
+    if(complete)
+        mirrors_.NoteSuccess(worker->mirror());
+    else
+        mirrors_.NoteFailure(worker->mirror());
+
+    std::vector<uint32_t> bids;
+    worker->GetRangeBlocks(bids);
+    worker->Close();
+    for(size_t i = 0; i < bids.size(); ++i)
+        Settle(bids[i]);
+    return complete;
+}
+
+bool HttpForeman::Steal(HttpChannel * worker)
+{
+    HttpChannel * victim = nullptr;
+    uint32_t most = 0;
+    for(size_t i = 0; i < channels_.size(); ++i)
+    {
+        auto channel = channels_[i];
+        if(!channel || channel == worker || !channel->IsOpen())
+            continue;
+        if(channel->block_id() == MassFile::kInvalidBlockId)
+            continue;
+        //已有重复下载的区间不再分割
+        if(channel->IsDuplicate() || channel->twin())
+            continue;
+        uint32_t remaining = channel->RangeEnd() - channel->RangeOffset();
+        if(remaining > most)
+        {
+            most = remaining;
+            victim = channel;
+        }
+    }
+    if(!victim || most < kMinStealSize)
+        return false;
+
+    uint32_t bid = victim->block_id();
+    uint64_t offset = 0;
+    size_t size = 0;
+    if(!mass_file_.GetBlockInfo(bid, offset, size))
+        return false;
+
+    //对半分割, 前半部分留给原通道
+    uint32_t end = victim->RangeEnd();
+    uint32_t mid = victim->RangeOffset() + ((most / 2) & ~(kStealAlignment - 1));
+    if(!victim->Truncate(mid))
+        return false;
+    HttpRange range(offset + mid, end - mid);
+    worker->OpenStream(PickUrl(worker), mass_file_, bid, mid, range);
+    stolen_size_ += end - mid;
+    return true;
+}
+
+bool HttpForeman::Duplicate(HttpChannel * worker)
+{
+    if(!endgame_limit_)
+        return false;
+
+    HttpChannel * victim = nullptr;
+    uint32_t most = 0;
+    for(size_t i = 0; i < channels_.size(); ++i)
+    {
+        auto channel = channels_[i];
+        if(!channel || channel == worker || !channel->IsOpen())
+            continue;
+        if(channel->block_id() == MassFile::kInvalidBlockId)
+            continue;
+        if(channel->IsDuplicate() || channel->twin())
+            continue;
+        uint32_t remaining = channel->RangeEnd() - channel->RangeOffset();
+        if(remaining > most)
+        {
+            most = remaining;
+            victim = channel;
+        }
+    }
+    if(!victim)
+        return false;
+    //重复下载的总量受限
+    if(duplicated_size_ + most > endgame_limit_)
+        return false;
+
+    uint32_t bid = victim->block_id();
+    uint64_t offset = 0;
+    size_t size = 0;
+    if(!mass_file_.GetBlockInfo(bid, offset, size))
+        return false;
+
+    uint32_t begin = victim->RangeOffset();
+    HttpRange range(offset + begin, most);
+    //重复的请求尽量发往其他镜像
+    const char * url = PickUrl(worker, victim->mirror());
+    if(!worker->OpenDuplicate(url, bid, begin, range, expected_length_))
+    {
+        worker->Close();
+        worker->Release();
+        return false;
+    }
+    worker->Pair(victim);
+    duplicated_size_ += most;
+    return true;
+}
+
+bool HttpForeman::FinishDuplicate(HttpChannel * worker)
+{
+    uint32_t bid = worker->block_id();
+    uint64_t offset = 0;
+    size_t size = 0;
+    if(!mass_file_.GetBlockInfo(bid, offset, size))
+        return false;
+
+    const Block & block = worker->block();
+    bool intact = worker->IsRangeComplete() &&
+        block.GetStatusCode() == HttpStatusCode::kPartialContent &&
+        block.GetContentRange().first() == offset + worker->RangeBegin();
+    HttpChannel * victim = worker->twin();
+    if(intact)
+    {
+        if(!mass_file_.WriteBlock(bid, worker->RangeBegin(), block.data(), block.size()))
+            return false;
+        if(victim)
+        {//原请求落后, 保存其已接收的部分后取消
+            const Block & rest = victim->block();
+            if(!victim->IsStreaming() && rest.size())
+                if(!mass_file_.WriteBlock(bid, victim->RangeBegin(), rest.data(), rest.size()))
+                    return false;
+            saved_size_ += victim->RangeEnd() - victim->RangeOffset();
+            victim->Close();
+        }
+    }
+    worker->Close();
+    Settle(bid);
+    if(intact && victim)
+        Dispatch(victim);
+    return true;
+}
+
+void HttpForeman::CancelDuplicate(HttpChannel * worker)
+{
+    auto twin = worker->twin();
+    if(!twin || !twin->IsDuplicate())
+        return;
+    twin->Close();
+    twin->Release();
+}
+
+const char * HttpForeman::PickUrl(HttpChannel * worker, uint32_t exclude)
+{
+    std::vector<uint32_t> active(mirrors_.Count(), 0);
+    for(size_t i = 0; i < channels_.size(); ++i)
+    {
+        auto channel = channels_[i];
+        if(channel && channel->IsOpen() && channel->mirror() < active.size())
+            active[channel->mirror()]++;
+    }
+
+    uint32_t mirror = mirrors_.Pick(active, exclude);
+    worker->SetMirror(mirror);
+    //校验器只对探测时的地址有效, 各镜像的ETag不一定相同
+    if(mirror == 0 || mirror == MirrorSet::kInvalidMirror)
+        worker->SetIfRange(if_range_);
+    else
+        worker->SetIfRange(std::string());
+    if(mirror == MirrorSet::kInvalidMirror)
+        return url_.data();
+    return mirrors_.GetUrl(mirror);
+}
+
+bool HttpForeman::ClipHole(const HttpChannel * worker, uint32_t bid,
+                           uint32_t hole, size_t & size) const
+{
+    uint32_t end = hole + static_cast<uint32_t>(size);
+    for(size_t i = 0; i < channels_.size(); ++i)
+    {
+        auto channel = channels_[i];
+        if(!channel || channel == worker || !channel->IsOpen())
+            continue;
+        uint32_t begin = 0;
+        uint32_t range_end = 0;
+        if(!channel->FindRange(bid, begin, range_end))
+            continue;
+        //空洞的起点已在下载中
+        if(begin <= hole && range_end > hole)
+            return false;
+        if(begin > hole)
+            end = (std::min)(end, begin);
+    }
+    size = end - hole;
+    return true;
+}
+
+void HttpForeman::Settle(uint32_t bid)
+{
+    if(mass_file_.IsBlockValid(bid) || verifier_.IsPending(bid))
+        return;
+
+    uint64_t offset = 0;
+    size_t size = 0;
+    if(mass_file_.IsBlockFilled(bid) && mass_file_.GetBlockInfo(bid, offset, size))
+    {//从文件读回校验
+        verifier_.VerifyFile(manifest_, mass_file_, bid, size);
+        return;
+    }
+    //块未写满且没有其他通道在下载其余部分时重新排队
+    if(!IsBlockBusy(bid))
+        RequeueBlock(bid);
+}
+
+bool HttpForeman::CollectVerified()
+{
+    BlockVerifier::Outcomes outcomes;
+    verifier_.Collect(outcomes);
+    bool saved = true;
+    for(size_t i = 0; i < outcomes.size(); ++i)
+    {
+        auto & outcome = outcomes[i];
+        uint32_t bid = outcome.block_id;
+        if(outcome.passed)
+        {
+            if(outcome.fetched)
+            {//已从仓库写入文件
+                saved = mass_file_.MarkBlockSaved(bid) && saved;
+                reused_size_ += outcome.size;
+            }
+            else if(outcome.buffer)
+            {//缓冲交给写入线程
+                saved = StoreBlock(bid, outcome.buffer, outcome.size) && saved;
+                outcome.buffer = 0;
+            }
+            else
+            {
+                saved = mass_file_.CommitBlock(bid) && saved;
+            }
+        }
+        else if(outcome.fetched)
+        {//仓库中没有, 从网络下载
+            RequeueBlock(bid);
+        }
+        else
+        {//校验失败, 丢弃后重新下载
+            if(!outcome.buffer)
+                mass_file_.DiscardBlock(bid);
+            retry_count_++;
+            RequeueBlock(bid);
+        }
+        BlockPool::Instance().Release(outcome.buffer);
+    }
+    if(retry_count_ > kMaxHttpRetryTimes)
+        return false;
+    return saved;
+}
+
+bool HttpForeman::StoreBlock(uint32_t bid, void * buffer, size_t size)
+{
+    if(writer_.Write(mass_file_, bid, buffer, size))
+        return true;
+
+    bool saved = mass_file_.SaveBlock(bid, buffer, size);
+    BlockPool::Instance().Release(buffer);
+    return saved;
+}
+
+void HttpForeman::FillFromStore()
+{
+    if(!store_ || !store_->IsOpen() || !BlockStore::IsUsable(manifest_))
+        return;
+
+    //查找和读取都在校验线程中进行, 仓库中没有的块在取回结果时重新排队
+    BlockQueue busy;
+    while(!pendding_blocks_.empty())
+    {
+        uint32_t bid = pendding_blocks_.front();
+        pendding_blocks_.pop();
+        uint64_t offset = 0;
+        size_t size = 0;
+        if(verifier_.IsPending(bid) || writer_.IsPending(bid) ||
+           !mass_file_.GetBlockInfo(bid, offset, size))
+        {
+            busy.push(bid);
+            continue;
+        }
+        verifier_.Fetch(manifest_, *store_, mass_file_, bid, size);
+    }
+    pendding_blocks_.swap(busy);
+}
+
+bool HttpForeman::CollectWritten()
+{
+    BlockWriter::Outcomes outcomes;
+    writer_.Collect(outcomes);
+    bool saved = true;
+    for(size_t i = 0; i < outcomes.size(); ++i)
+    {
+        auto & outcome = outcomes[i];
+        if(outcome.written)
+            saved = mass_file_.MarkBlockSaved(outcome.block_id) && saved;
+        else
+            saved = false;
+        BlockPool::Instance().Release(outcome.buffer);
+    }
+    return saved;
+}
+
+void HttpForeman::PrioritizeBlocks()
+{
+    if(pendding_blocks_.size() < 2)
+        return;
+
+    uint32_t count = mass_file_.GetBlockCount();
+    uint32_t cursor = mass_file_.FindBlock(mass_file_.GetReadCursor());
+    if(cursor == MassFile::kInvalidBlockId)
+        cursor = 0;
+    //读取位置所在的块未变时队列仍然有序
+    if(cursor == prioritized_cursor_)
+        return;
+    prioritized_cursor_ = cursor;
+
+    //读取位置之后的块由近及远, 已读过的部分排在最后
+    std::vector<std::pair<uint32_t, uint32_t>> order;
+    while(!pendding_blocks_.empty())
+    {
+        uint32_t bid = pendding_blocks_.front();
+        pendding_blocks_.pop();
+        uint32_t distance = bid >= cursor ? bid - cursor : count + bid;
+        order.push_back(std::make_pair(distance, bid));
+    }
+    std::sort(order.begin(), order.end());
+    for(size_t i = 0; i < order.size(); ++i)
+        pendding_blocks_.push(order[i].second);
+}
+
+void HttpForeman::RequeueBlock(uint32_t bid)
+{
+    pendding_blocks_.push(bid);
+    prioritized_cursor_ = MassFile::kInvalidBlockId;
+}
+
+bool HttpForeman::IsBlockBusy(uint32_t bid) const
+{
+    for(size_t i = 0; i < channels_.size(); ++i)
+    {
+        auto channel = channels_[i];
+        uint32_t begin = 0;
+        uint32_t end = 0;
+        if(channel && channel->IsOpen() && channel->FindRange(bid, begin, end))
+            return true;
+    }
+    return false;
+}
+
 bool HttpForeman::HasFinished() const
 {
     return mass_file_.HasFinished();
@@ -392,22 +1919,38 @@ bool HttpForeman::HasFinished() const
 void HttpForeman::Reset()
 {
     CloseChannels();
+    //校验线程可能仍在读文件
+    verifier_.Wait();
+    //已写完的块记入日志后再关闭文件
+    writer_.Wait();
+    CollectWritten();
     mass_file_.Close();
     retry_count_ = 0;
     url_.clear();
+    if_range_.clear();
+    mirror_urls_.clear();
+    mirrors_.Clear();
+    manifest_.Reset(BlockManifest::kAlgorithmNone);
+    stats_.Clear();
     path_.clear();
     expected_length_ = -1;
     stage_ = kFetchStagePrepare;
     pendding_blocks_.swap(BlockQueue());
+    prioritized_cursor_ = MassFile::kInvalidBlockId;
 }
 
 bool HttpForeman::CreateChannels()
 {
-    for(size_t i = 0; i < countof(channels_); ++i)
+    if(channels_.size() != channel_count_)
+        DestroyChannels();
+
+    while(channels_.size() < channel_count_)
     {
-        if(!channels_[i])
-            channels_[i] = new HttpChannel();
-        if(!channels_[i])
+        auto channel = new HttpChannel();
+        if(!channel)
+            return false;
+        channels_.push_back(channel);
+        if(!channel->Attach(*multi_, this, &rate_limiter_, &stats_))
             return false;
     }
     return true;
@@ -415,7 +1958,7 @@ bool HttpForeman::CreateChannels()
 
 void HttpForeman::DestroyChannels()
 {
-    for(size_t i = 0; i < countof(channels_); ++i)
+    for(size_t i = 0; i < channels_.size(); ++i)
     {
         if(channels_[i])
         {
@@ -423,25 +1966,30 @@ void HttpForeman::DestroyChannels()
             channels_[i] = nullptr;
         }
     }
+    channels_.clear();
 }
 
 void HttpForeman::CloseChannels()
 {
-    for(size_t i = 0; i < countof(channels_); ++i)
+    for(size_t i = 0; i < channels_.size(); ++i)
     {
         HttpChannel * channel = channels_[i];
         if(channel)
+        {
             channel->Close();
+            channel->Release();
+        }
     }
 }
 
 uint64_t HttpForeman::DownloadingSize() const
 {
     uint64_t result = 0;
-    for(size_t i = 0; i < countof(channels_); ++i)
+    for(size_t i = 0; i < channels_.size(); ++i)
     {
         auto channel = channels_[i];
-        if(channel)
+        //重复下载的数据不计入进度
+        if(channel && !channel->IsDuplicate())
             result += channel->block().size();
     }
     return result;
@@ -4,9 +4,17 @@
 #include <stdint.h>
 #include <string>
 #include <queue>
+#include <vector>
 #include <algorithm>
+#include "http.h"
 #include "mass_file.h"
 #include "speed_meter.h"
+#include "mirror_set.h"
+#include "block_verifier.h"
+#include "block_writer.h"
+#include "block_store.h"
+#include "rate_limiter.h"
+#include "http_stats.h"
 
 namespace nweb
 {
@@ -31,9 +39,44 @@ public:
     * 下载文件接口
     */
     void SetPrimaryUrl(const char* url);
+    //同一文件的其他下载源, 文件长度由主地址确定,
+    //各块分配给吞吐率最高的健康镜像
+    void AddMirrorUrl(const char * url);
     void SetFilePath(const char* path);
     void SetFileSize(uint64_t filesize);
+    //每块的校验值, 块通过校验后才记入日志, 失败的块重新下载
+    //校验在后台线程进行, 需在首次Fetch之前设置
+    void SetBlockManifest(const BlockManifest & manifest);
+    //并发下载的通道数 [1, kMaxChannelCount], 需在首次Fetch之前设置
+    void SetChannelCount(uint32_t count);
+    //流式写入: 数据到达即写入文件, 不在内存中缓存整块,
+    //写入进度记录在日志中, 断点续传可从块内继续, 需在首次Fetch之前设置
+    void SetStreaming(bool streaming);
+    //使用外部驱动的multi(如HttpDownloadScheduler), 需在首次Fetch之前设置
+    //此时Fetch不再自行perform和等待, 传0恢复自行驱动
+    void AttachMulti(HttpMulti * multi);
+    //收尾阶段重复下载落后通道剩余区间的总量上限(字节), 0表示关闭
+    void SetEndgameLimit(uint64_t limit);
+    //本任务的接收速率上限(字节/秒), 0表示不限制, 可在下载中随时修改
+    //同时受全局和各主机的限速约束, 见RateLimiter
+    void SetRateLimit(uint64_t rate);
+    //较小的空洞合并到一个多区间请求中, 每个请求最多count个区间 [1, kMaxRangesPerRequest]
+    //1表示每个请求只含一个区间, 服务器不支持multipart应答时自动退回
+    void SetRangesPerRequest(uint32_t count);
+    //渐进模式: 优先下载Read位置之后的块, 使用者可以边下载边读取
+    //下载完成后文件保持打开直到Reset, 需在首次Fetch之前设置
+    void SetProgressive(bool progressive);
+    //块数据和日志的落盘策略, 见MassFile::Durability, 需在首次Fetch之前设置
+    void SetDurability(const MassFile::Durability & durability);
+    //本地块仓库, 下载前先从仓库取得相同的块, 通过校验的块存入仓库
+    //只在有SHA-256清单时使用, 仓库由使用者打开并保证在任务结束前有效, 需在首次Fetch之前设置
+    void SetBlockStore(BlockStore * store);
+    //读取文件[offset, offset + size), 可在其他线程调用
+    //只等待所需的块下载完成, timeout(ms)为0时不等待, -1时一直等待
+    //文件尚未打开, 已关闭或超时时返回false
+    bool Read(uint64_t offset, void * data, size_t size, uint32_t timeout);
     //异步下载接口
+    //源文件在下载中改变时返回kResultObjectChanged, Reset后重新Fetch, 按日志中的校验器判断哪些块需要重新下载
     Result Fetch();
     //重置
     void Reset();
@@ -45,13 +88,78 @@ public:
 
     uint32_t InputStats() const;
 
+    /* 本任务各次传输的耗时分布, 可在其他线程调用 */
+    void GetTransferStats(HttpStats::Snapshot & snapshot) const;
+
+    /* 空闲通道从其他通道分走的容量 */
+    uint64_t StolenSize() const;
+    /* 收尾阶段重复下载的容量 */
+    uint64_t EndgameDuplicatedSize() const;
+    /* 重复下载先完成时, 原请求尚未接收的容量 */
+    uint64_t EndgameSavedSize() const;
+    /* 从本地块仓库取得的容量 */
+    uint64_t ReusedSize() const;
+
+    /* 是否有通道正在传输 */
+    bool IsTransferring() const;
+
 private:
     Result DoPrepare();
 
     Result DoScout();
+    //探测请求: GET文件的第0块, 取得文件长度的同时保留数据
+    //服务器不支持区间请求时探测请求接收整个文件, 不再分块下载
+    void Probe(HttpChannel * scout);
+    //按探测应答确定文件长度并打开目标文件, 成功时返回kResultAgain
+    //whole表示整个文件随探测请求下载, 此时总是新建目标文件
+    Result OpenTarget(const HttpResponse & response, bool whole);
+    //把探测时收到的数据写入第0块
+    bool KeepScoutData(HttpChannel * scout);
+    //源文件的校验器与日志中保存的是否一致, 双方都没有可比较的校验器时视为一致
+    bool IsSameOrigin(const std::string & etag, int64_t last_modified) const;
     
     Result DoDownload();
 
+    //为空闲通道分配下一个待下载的块
+    void Dispatch(HttpChannel * worker);
+    //为通道分配指定的块, 块已无需下载时返回false
+    bool Assign(HttpChannel * worker, uint32_t bid);
+    //从待下载队列中收集更多的小空洞, 与给定空洞合并为一个请求
+    bool AssignRanges(HttpChannel * worker, uint32_t bid, 
+                      uint32_t hole, size_t hole_size);
+    //多区间请求结束, 未收完的块重新排队, 区间未全部收到时返回false
+    bool FinishRanges(HttpChannel * worker);
+    //没有待下载的块时, 把其他通道剩余最多的区间后半部分分给空闲通道
+    bool Steal(HttpChannel * worker);
+    //没有可分割的区间时, 重复下载剩余最多的区间
+    bool Duplicate(HttpChannel * worker);
+    //重复的下载完成, 保留数据并取消原请求
+    bool FinishDuplicate(HttpChannel * worker);
+    //原请求完成, 取消重复的下载
+    void CancelDuplicate(HttpChannel * worker);
+    //把块内空洞裁剪到其他通道正在下载的区间之前, 起点已在下载中时返回false
+    bool ClipHole(const HttpChannel * worker, uint32_t bid,
+                  uint32_t hole, size_t & size) const;
+    //是否有通道正在下载该块
+    bool IsBlockBusy(uint32_t bid) const;
+    //块已写满时提交校验, 未写满且无通道在下载时重新排队
+    void Settle(uint32_t bid);
+    //处理校验结果, 写入失败或重试过多时返回false
+    bool CollectVerified();
+    //整块交给后台写入, 在途数据超出上限时同步写入, 接管buffer
+    bool StoreBlock(uint32_t bid, void * buffer, size_t size);
+    //已写完的块记入日志, 写入失败时返回false
+    bool CollectWritten();
+    //待下载的块已在本地块仓库中时直接取得, 其余的块留在队列中
+    void FillFromStore();
+    //渐进模式下按与读取位置的距离重排待下载的块
+    void PrioritizeBlocks();
+    //块重新排到队尾, 渐进模式下需要重排
+    void RequeueBlock(uint32_t bid);
+    //为通道选择镜像, 返回请求地址
+    const char * PickUrl(HttpChannel * worker, 
+                         uint32_t exclude = MirrorSet::kInvalidMirror);
+
     bool HasFinished() const;
 
     bool CreateChannels();
@@ -61,16 +169,49 @@ private:
     void CloseChannels();
 
     uint64_t DownloadingSize() const;
+public:
+    static const uint32_t kDefaultChannelCount = 4;
+    static const uint32_t kMaxChannelCount = 16;
+    static const uint64_t kDefaultEndgameLimit = 0x1000000;
+    static const uint32_t kDefaultRangesPerRequest = 8;
+    static const uint32_t kMaxRangesPerRequest = 32;
 private:
     uint32_t retry_count_;
     std::string url_;
+    //向url_请求区间时附带的If-Range, 源文件改变后服务器返回整个文件
+    std::string if_range_;
+    std::vector<std::string> mirror_urls_;
+    MirrorSet mirrors_;
     std::string path_;
     FetchStage stage_;
     uint64_t expected_length_;
     BlockQueue pendding_blocks_;
     MassFile mass_file_;
-    HttpChannel * channels_[1];
+    BlockManifest manifest_;
+    HttpMulti own_multi_;
+    HttpMulti * multi_;
+    bool streaming_;
+    bool progressive_;
+    //待下载的块已按此读取位置排序, kInvalidBlockId表示需要重排
+    uint32_t prioritized_cursor_;
+    std::vector<HttpChannel *> channels_;
+    uint32_t channel_count_;
     uint32_t input_stats_;
+    uint64_t stolen_size_;
+    uint64_t endgame_limit_;
+    uint64_t duplicated_size_;
+    uint64_t saved_size_;
+    RateLimiter rate_limiter_;
+    HttpStats stats_;
+    uint32_t ranges_per_request_;
+    //服务器以multipart应答多区间请求
+    bool multipart_ok_;
+    BlockStore * store_;
+    uint64_t reused_size_;
+    //须在mass_file_之后声明, 析构时先等待写入结束
+    BlockWriter writer_;
+    //须在mass_file_和manifest_之后声明, 析构时先等待校验结束
+    BlockVerifier verifier_;
 };
 
 }
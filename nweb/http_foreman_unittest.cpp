@@ -1,9 +1,26 @@
+#include <atomic>
+#include <thread>
 #include "nweb_test.h"
 #include "http_foreman.h"
+#include "block_pool.h"
 
 namespace
 {
 
+const char * kBigFileUrl = "http://192.168.4.15/apps/dungeon_siege_3.tar";
+
+//下载kBigFileUrl到本地文件name, 返回最后一次Fetch的结果
+nweb::Result FetchBigFile(nweb::HttpForeman & foreman, const char * name)
+{
+    auto local = GetLocalPath(name);
+    foreman.SetPrimaryUrl(kBigFileUrl);
+    foreman.SetFilePath(local.data());
+    auto fr = nweb::kResultAgain;
+    while(fr == nweb::kResultAgain) 
+        fr = foreman.Fetch();
+    return fr;
+}
+
 TEST(HttpForeman, BigFile)
 {
     using namespace nweb;
@@ -33,4 +50,102 @@ TEST(HttpForeman, BigFile)
     EXPECT_EQ(kResultOK, fr);
 }
 
-}
\ No newline at end of file
+TEST(HttpForeman, MultiChannel)
+{
+    using namespace nweb;
+
+    HttpForeman foreman;
+    foreman.SetChannelCount(HttpForeman::kMaxChannelCount);
+    EXPECT_EQ(kResultOK, FetchBigFile(foreman, "dungeon_siege_3_mc.tar"));
+    EXPECT_EQ(foreman.TotalSize(), foreman.FetchedSize());
+    //多个通道都参与了传输
+    HttpStats::Snapshot snapshot;
+    foreman.GetTransferStats(snapshot);
+    EXPECT_GE(snapshot.transfers, static_cast<uint64_t>(HttpForeman::kMaxChannelCount));
+}
+
+TEST(HttpForeman, StreamingWorkStealing)
+{
+    using namespace nweb;
+
+    HttpForeman foreman;
+    foreman.SetChannelCount(HttpForeman::kMaxChannelCount);
+    foreman.SetStreaming(true);
+    EXPECT_EQ(kResultOK, FetchBigFile(foreman, "dungeon_siege_3_ws.tar"));
+    //通道多于剩余块时, 空闲通道分担了慢通道的区间
+    EXPECT_GT(foreman.StolenSize(), 0u);
+}
+
+TEST(HttpForeman, Endgame)
+{
+    using namespace nweb;
+
+    HttpForeman foreman;
+    const uint64_t limit = 0x200000;
+    foreman.SetChannelCount(HttpForeman::kMaxChannelCount);
+    foreman.SetEndgameLimit(limit);
+    EXPECT_EQ(kResultOK, FetchBigFile(foreman, "dungeon_siege_3_eg.tar"));
+    //收尾阶段发生了重复下载, 总量不超过上限
+    EXPECT_GT(foreman.EndgameDuplicatedSize(), 0u);
+    EXPECT_LE(foreman.EndgameDuplicatedSize(), limit);
+    //重复的下载先完成, 省下了原请求剩余的部分
+    EXPECT_GT(foreman.EndgameSavedSize(), 0u);
+}
+
+TEST(HttpForeman, ProgressiveRead)
+{
+    using namespace nweb;
+
+    HttpForeman foreman;
+    auto local = GetLocalPath("dungeon_siege_3_pr.tar");
+    foreman.SetPrimaryUrl(kBigFileUrl);
+    foreman.SetFilePath(local.data());
+    foreman.SetProgressive(true);
+
+    //使用者从文件中部顺序读取, 下载优先满足读取位置
+    const size_t kChunk = 0x100000;
+    const uint64_t kReadSize = 0x2000000;
+    std::atomic<uint64_t> start(0);
+    std::atomic<bool> arrived(false);
+    std::atomic<bool> done(false);
+    uint64_t consumed = 0;
+    std::thread consumer([&]()
+    {
+        std::vector<char> buffer(kChunk);
+        while(!start && !done)
+            ::Sleep(10);
+        while(consumed < kReadSize && !done)
+        {
+            if(!foreman.Read(start + consumed, &buffer[0], kChunk, 100))
+                continue;
+            consumed += kChunk;
+        }
+        arrived = consumed == kReadSize;
+    });
+
+    auto fr = kResultAgain;
+    uint64_t fetched_on_arrival = 0;
+    while(fr == kResultAgain)
+    {
+        fr = foreman.Fetch();
+        //文件长度确定后从中部按块对齐的位置开始读取
+        uint64_t total = foreman.TotalSize();
+        if(!start && total >= 2 * kReadSize)
+            start = (total / 2) & ~static_cast<uint64_t>(BlockPool::kBufferSize - 1);
+        if(arrived && !fetched_on_arrival)
+            fetched_on_arrival = foreman.FetchedSize();
+    }
+    done = true;
+    consumer.join();
+    //下载结束后才读完时按全部到达计
+    if(!fetched_on_arrival)
+        fetched_on_arrival = foreman.FetchedSize();
+    EXPECT_EQ(kResultOK, fr);
+    EXPECT_EQ(kReadSize, consumed);
+    //读取位置的块先于按顺序排在它之前的块到达
+    EXPECT_GT(start.load(), 0u);
+    EXPECT_LT(fetched_on_arrival, start.load());
+    foreman.Reset();
+}
+
+}
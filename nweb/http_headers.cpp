@@ -0,0 +1,372 @@
+﻿#include <string.h>
+#include "http_headers.h"
+
+namespace nweb
+{
+
+namespace
+{
+
+struct KnownName
+{
+    const char * name;
+    size_t length;
+    HttpHeaderList::Name id;
+};
+
+#define NWEB_KNOWN_NAME(name, id) { name, sizeof(name) - 1, HttpHeaderList::id }
+
+const KnownName kKnownNames[] =
+{
+    NWEB_KNOWN_NAME("content-length", kContentLength),
+    NWEB_KNOWN_NAME("content-range", kContentRange),
+    NWEB_KNOWN_NAME("content-type", kContentType),
+    NWEB_KNOWN_NAME("last-modified", kLastModified),
+    NWEB_KNOWN_NAME("etag", kETag),
+    NWEB_KNOWN_NAME("range", kRange),
+    NWEB_KNOWN_NAME("if-range", kIfRange),
+    NWEB_KNOWN_NAME("connection", kConnection),
+    NWEB_KNOWN_NAME("accept-encoding", kAcceptEncoding),
+};
+
+#undef NWEB_KNOWN_NAME
+
+//ASCII only, header names are tokens
+inline char ToLower(char ch)
+{
+    return (ch >= 'A' && ch <= 'Z') ? static_cast<char>(ch - 'A' + 'a') : ch;
+}
+
+inline bool IsDigit(char ch)
+{
+    return ch >= '0' && ch <= '9';
+}
+
+//digits at [p, end) with leading spaces, p is left after them
+bool ParseNumber(const char *& p, const char * end, uint64_t & number)
+{
+    while(p < end && *p == ' ')
+        ++p;
+    const char * start = p;
+    number = 0;
+    while(p < end && IsDigit(*p))
+    {
+        number = number * 10 + (*p - '0');
+        ++p;
+    }
+    return p != start;
+}
+
+bool EqualsIgnoreCase(const char * lhs, const char * rhs, size_t length)
+{
+    for(size_t i = 0; i < length; ++i)
+    {
+        if(ToLower(lhs[i]) != ToLower(rhs[i]))
+            return false;
+    }
+    return true;
+}
+
+}
+
+//StringPiece
+StringPiece::StringPiece()
+    : data_(""), size_(0)
+{
+}
+
+StringPiece::StringPiece(const char * data, size_t size)
+    : data_(data), size_(size)
+{
+}
+
+StringPiece::StringPiece(const char * str)
+    : data_(str), size_(str ? strlen(str) : 0)
+{
+}
+
+const char * StringPiece::data() const
+{
+    return data_;
+}
+
+size_t StringPiece::size() const
+{
+    return size_;
+}
+
+bool StringPiece::empty() const
+{
+    return !size_;
+}
+
+std::string StringPiece::ToString() const
+{
+    return std::string(data_, size_);
+}
+
+bool StringPiece::EqualsIgnoreCase(const StringPiece & other) const
+{
+    return size_ == other.size_ && nweb::EqualsIgnoreCase(data_, other.data_, size_);
+}
+
+bool StringPiece::operator==(const StringPiece & other) const
+{
+    return size_ == other.size_ && !memcmp(data_, other.data_, size_);
+}
+
+bool StringPiece::operator!=(const StringPiece & other) const
+{
+    return !(*this == other);
+}
+
+int ParseHttpStatusLine(const char * line, size_t length)
+{
+    const char kPrefix[] = "HTTP/";
+    const size_t kPrefixSize = sizeof(kPrefix) - 1;
+    if(length < kPrefixSize || memcmp(line, kPrefix, kPrefixSize))
+        return 0;
+
+    //version is major[.minor], HTTP/2 and later may leave out the minor
+    size_t i = kPrefixSize;
+    size_t start = i;
+    while(i < length && IsDigit(line[i]))
+        ++i;
+    if(i == start)
+        return 0;
+    if(i < length && line[i] == '.')
+    {
+        start = ++i;
+        while(i < length && IsDigit(line[i]))
+            ++i;
+        if(i == start)
+            return 0;
+    }
+    if(i >= length || line[i] != ' ')
+        return 0;
+    ++i;
+
+    if(length - i < 3)
+        return 0;
+    int code = 0;
+    for(size_t n = 0; n < 3; ++n)
+    {
+        if(!IsDigit(line[i + n]))
+            return 0;
+        code = code * 10 + (line[i + n] - '0');
+    }
+    //the reason phrase is optional
+    if(length - i > 3)
+    {
+        char next = line[i + 3];
+        if(next != ' ' && next != '\r' && next != '\n')
+            return 0;
+    }
+    return code;
+}
+
+bool ParseContentRange(const StringPiece & value, bool & has_range,
+                       uint64_t & first, uint64_t & last, uint64_t & total)
+{
+    const char * p = value.data();
+    const char * end = p + value.size();
+    while(p < end && *p != ' ')
+        ++p;
+    if(p == end)
+        return false;
+
+    ++p;
+    has_range = p == end || *p != '*';
+    if(has_range)
+    {
+        if(!ParseNumber(p, end, first) || p == end || *p != '-')
+            return false;
+        ++p;
+        if(!ParseNumber(p, end, last) || last < first)
+            return false;
+    }
+    else
+    {
+        ++p;
+    }
+    if(p == end || *p != '/')
+        return false;
+    ++p;
+    if(p < end && *p == '*')
+    {
+        //an unsatisfied range always knows the total
+        if(!has_range)
+            return false;
+        total = -1;
+        return true;
+    }
+    return ParseNumber(p, end, total);
+}
+
+//HttpHeaderList
+HttpHeaderList::HttpHeaderList()
+    : count_(0), dead_size_(0)
+{
+}
+
+HttpHeaderList::Name HttpHeaderList::Intern(const char * key, size_t length)
+{
+    for(size_t i = 0; i < sizeof(kKnownNames) / sizeof(kKnownNames[0]); ++i)
+    {
+        auto & known = kKnownNames[i];
+        if(known.length == length && EqualsIgnoreCase(known.name, key, length))
+            return known.id;
+    }
+    return kOther;
+}
+
+void HttpHeaderList::Clear()
+{
+    count_ = 0;
+    overflow_.clear();
+    arena_.clear();
+    dead_size_ = 0;
+}
+
+size_t HttpHeaderList::Count() const
+{
+    return count_;
+}
+
+HttpHeaderList::Name HttpHeaderList::Add(const char * key, size_t key_length,
+                                         const char * value, size_t value_length)
+{
+    Entry entry;
+    entry.name = Intern(key, key_length);
+    entry.key_offset = Store(key, key_length);
+    entry.key_size = static_cast<uint32_t>(key_length);
+    entry.value_offset = Store(value, value_length);
+    entry.value_size = static_cast<uint32_t>(value_length);
+    if(count_ < kInlineCount)
+        inline_[count_] = entry;
+    else
+        overflow_.push_back(entry);
+    ++count_;
+    return static_cast<Name>(entry.name);
+}
+
+void HttpHeaderList::Set(const char * key, const char * value)
+{
+    Remove(key);
+    Add(key, strlen(key), value, strlen(value));
+}
+
+void HttpHeaderList::Remove(const char * key)
+{
+    StringPiece target(key);
+    Name name = Intern(target.data(), target.size());
+    for(size_t i = 0; i < count_;)
+    {
+        const Entry & entry = EntryAt(i);
+        bool match = name != kOther ? entry.name == name :
+                     entry.name == kOther && KeyAt(i).EqualsIgnoreCase(target);
+        if(match)
+        {
+            Erase(i);
+            continue;
+        }
+        ++i;
+    }
+    Compact();
+}
+
+bool HttpHeaderList::Find(Name name, StringPiece & value) const
+{
+    for(size_t i = 0; i < count_; ++i)
+    {
+        if(EntryAt(i).name == name)
+        {
+            value = ValueAt(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool HttpHeaderList::Find(const char * key, StringPiece & value) const
+{
+    StringPiece target(key);
+    Name name = Intern(target.data(), target.size());
+    if(name != kOther)
+        return Find(name, value);
+
+    for(size_t i = 0; i < count_; ++i)
+    {
+        if(EntryAt(i).name == kOther && KeyAt(i).EqualsIgnoreCase(target))
+        {
+            value = ValueAt(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+StringPiece HttpHeaderList::KeyAt(size_t index) const
+{
+    const Entry & entry = EntryAt(index);
+    return StringPiece(&arena_[entry.key_offset], entry.key_size);
+}
+
+StringPiece HttpHeaderList::ValueAt(size_t index) const
+{
+    const Entry & entry = EntryAt(index);
+    return StringPiece(&arena_[entry.value_offset], entry.value_size);
+}
+
+HttpHeaderList::Entry & HttpHeaderList::EntryAt(size_t index)
+{
+    return index < kInlineCount ? inline_[index] : overflow_[index - kInlineCount];
+}
+
+const HttpHeaderList::Entry & HttpHeaderList::EntryAt(size_t index) const
+{
+    return index < kInlineCount ? inline_[index] : overflow_[index - kInlineCount];
+}
+
+void HttpHeaderList::Erase(size_t index)
+{
+    const Entry & entry = EntryAt(index);
+    dead_size_ += entry.key_size + entry.value_size + 2;
+    for(size_t i = index + 1; i < count_; ++i)
+        EntryAt(i - 1) = EntryAt(i);
+    --count_;
+    if(count_ >= kInlineCount)
+        overflow_.pop_back();
+}
+
+void HttpHeaderList::Compact()
+{
+    if(!dead_size_ || dead_size_ * 2 < arena_.size())
+        return;
+
+    //entries are kept in the order they were stored, so every piece
+    //only moves towards the front
+    size_t used = 0;
+    for(size_t i = 0; i < count_; ++i)
+    {
+        Entry & entry = EntryAt(i);
+        memmove(&arena_[used], &arena_[entry.key_offset], entry.key_size + 1);
+        entry.key_offset = static_cast<uint32_t>(used);
+        used += entry.key_size + 1;
+        memmove(&arena_[used], &arena_[entry.value_offset], entry.value_size + 1);
+        entry.value_offset = static_cast<uint32_t>(used);
+        used += entry.value_size + 1;
+    }
+    arena_.resize(used);
+    dead_size_ = 0;
+}
+
+uint32_t HttpHeaderList::Store(const char * data, size_t size)
+{
+    uint32_t offset = static_cast<uint32_t>(arena_.size());
+    arena_.insert(arena_.end(), data, data + size);
+    arena_.push_back('\0');
+    return offset;
+}
+
+}
@@ -0,0 +1,136 @@
+﻿#ifndef NWEB_HTTP_HEADERS_H_
+#define NWEB_HTTP_HEADERS_H_
+
+#include <string>
+#include <vector>
+#include "nweb.h"
+
+namespace nweb
+{
+
+//StringPiece refers to characters owned by someone else, it stays valid
+//as long as the owner isn't changed.
+class StringPiece
+{
+public:
+    StringPiece();
+
+    StringPiece(const char * data, size_t size);
+
+    explicit StringPiece(const char * str);
+
+    const char * data() const;
+
+    size_t size() const;
+
+    bool empty() const;
+
+    std::string ToString() const;
+
+    bool EqualsIgnoreCase(const StringPiece & other) const;
+
+    bool operator==(const StringPiece & other) const;
+
+    bool operator!=(const StringPiece & other) const;
+private:
+    const char * data_;
+    size_t size_;
+};
+
+//Status code of an HTTP/1.0, HTTP/1.1, HTTP/2 or HTTP/3 status line,
+//0 if the line isn't one.
+int ParseHttpStatusLine(const char * line, size_t length);
+
+//Content-Range "bytes first-last/total", or "bytes */total" as sent with
+//a 416 which has no range, [has_range] tells which. [total] is -1 when
+//it's '*'.
+bool ParseContentRange(const StringPiece & value, bool & has_range,
+                       uint64_t & first, uint64_t & last, uint64_t & total);
+
+//HttpHeaderList keeps the headers of one message without a node per
+//header: names and values are copied into one arena and indexed by a
+//small inline table. Clear keeps the memory, so a list reused from
+//message to message stops allocating once it has grown.
+//Well-known names are interned when added and found by id, other names
+//are compared case-insensitively. Stored names and values are followed
+//by a '\0'.
+class HttpHeaderList
+{
+public:
+    enum Name
+    {
+        kOther,
+        kContentLength,
+        kContentRange,
+        kContentType,
+        kLastModified,
+        kETag,
+        kRange,
+        kIfRange,
+        kConnection,
+        kAcceptEncoding,
+        kNameCount,
+    };
+
+    static const uint32_t kInlineCount = 16;
+
+public:
+    HttpHeaderList();
+
+    //Id of a well-known name, kOther for the rest.
+    static Name Intern(const char * key, size_t length);
+
+    void Clear();
+
+    size_t Count() const;
+
+    //Append a header, a name may appear more than once.
+    //Return the id of the name.
+    Name Add(const char * key, size_t key_length,
+             const char * value, size_t value_length);
+    //Replace every header of the name with one value.
+    void Set(const char * key, const char * value);
+
+    void Remove(const char * key);
+
+    //The first header of the name.
+    bool Find(Name name, StringPiece & value) const;
+
+    bool Find(const char * key, StringPiece & value) const;
+
+    StringPiece KeyAt(size_t index) const;
+
+    StringPiece ValueAt(size_t index) const;
+
+private:
+    struct Entry
+    {
+        uint32_t name;
+        uint32_t key_offset;
+        uint32_t key_size;
+        uint32_t value_offset;
+        uint32_t value_size;
+    };
+
+    Entry & EntryAt(size_t index);
+
+    const Entry & EntryAt(size_t index) const;
+
+    void Erase(size_t index);
+
+    //Drop the space of removed headers once it outweighs the live ones.
+    void Compact();
+
+    uint32_t Store(const char * data, size_t size);
+
+private:
+    Entry inline_[kInlineCount];
+    std::vector<Entry> overflow_;
+    size_t count_;
+    std::vector<char> arena_;
+    size_t dead_size_;
+};
+
+}
+
+#endif
@@ -0,0 +1,132 @@
+﻿#include "nweb_test.h"
+#include "http_headers.h"
+
+TEST(HttpHeaders, ParseStatusLine)
+{
+    using namespace nweb;
+
+    const char * lines[] = 
+    {
+        "HTTP/1.1 206 Partial Content\r\n",
+        "HTTP/1.0 200 OK\r\n",
+        "HTTP/2 416\r\n",
+        "HTTP/2.0 304\r\n",
+        "HTTP/3 200",
+    };
+    const int codes[] = {206, 200, 416, 304, 200};
+    for(size_t i = 0; i < sizeof(codes) / sizeof(codes[0]); ++i)
+        EXPECT_EQ(codes[i], ParseHttpStatusLine(lines[i], strlen(lines[i]))) << lines[i];
+
+    const char * bad[] = 
+    {
+        "Content-Length: 12\r\n",
+        "HTTP/ 200 OK\r\n",
+        "HTTP/1. 200 OK\r\n",
+        "HTTP/1.1 20\r\n",
+        "HTTP/1.1 2000\r\n",
+        "\r\n",
+    };
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+        EXPECT_EQ(0, ParseHttpStatusLine(bad[i], strlen(bad[i]))) << bad[i];
+}
+
+TEST(HttpHeaders, ParseContentRange)
+{
+    using namespace nweb;
+
+    bool has_range = false;
+    uint64_t first = 0;
+    uint64_t last = 0;
+    uint64_t total = 0;
+    ASSERT_TRUE(ParseContentRange(StringPiece("bytes 100-199/1000"), has_range, first, last, total));
+    EXPECT_TRUE(has_range);
+    EXPECT_EQ(100, first);
+    EXPECT_EQ(199, last);
+    EXPECT_EQ(1000, total);
+
+    ASSERT_TRUE(ParseContentRange(StringPiece("bytes 0-9/*"), has_range, first, last, total));
+    EXPECT_TRUE(has_range);
+    EXPECT_EQ(static_cast<uint64_t>(-1), total);
+
+    //416 replies carry only the total
+    ASSERT_TRUE(ParseContentRange(StringPiece("bytes */0"), has_range, first, last, total));
+    EXPECT_FALSE(has_range);
+    EXPECT_EQ(0, total);
+    ASSERT_TRUE(ParseContentRange(StringPiece("bytes */1234"), has_range, first, last, total));
+    EXPECT_FALSE(has_range);
+    EXPECT_EQ(1234, total);
+
+    const char * bad[] = 
+    {
+        "bytes",
+        "bytes */*",
+        "bytes 10-5/100",
+        "bytes 0-9",
+        "bytes -9/100",
+        "bytes */",
+    };
+    for(size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); ++i)
+        EXPECT_FALSE(ParseContentRange(StringPiece(bad[i]), has_range, first, last, total)) << bad[i];
+}
+
+TEST(HttpHeaders, FindAndReplace)
+{
+    using namespace nweb;
+
+    HttpHeaderList headers;
+    EXPECT_EQ(HttpHeaderList::kContentRange, 
+              headers.Add("Content-Range", 13, "bytes 0-9/20", 12));
+    EXPECT_EQ(HttpHeaderList::kOther, headers.Add("X-Cache", 7, "HIT", 3));
+    headers.Add("x-cache", 7, "MISS", 4);
+
+    StringPiece value;
+    ASSERT_TRUE(headers.Find(HttpHeaderList::kContentRange, value));
+    EXPECT_EQ(StringPiece("bytes 0-9/20"), value);
+    //stored values are terminated
+    EXPECT_EQ('\0', value.data()[value.size()]);
+    ASSERT_TRUE(headers.Find("CONTENT-range", value));
+    ASSERT_TRUE(headers.Find("X-CACHE", value));
+    EXPECT_EQ(StringPiece("HIT"), value);
+    EXPECT_FALSE(headers.Find(HttpHeaderList::kETag, value));
+
+    headers.Set("X-Cache", "STALE");
+    EXPECT_EQ(2, headers.Count());
+    ASSERT_TRUE(headers.Find("x-cache", value));
+    EXPECT_EQ(StringPiece("STALE"), value);
+    headers.Remove("content-range");
+    EXPECT_EQ(1, headers.Count());
+    EXPECT_TRUE(headers.KeyAt(0).EqualsIgnoreCase(StringPiece("X-CACHE")));
+
+    headers.Clear();
+    EXPECT_EQ(0, headers.Count());
+}
+
+TEST(HttpHeaders, ManyHeaders)
+{
+    using namespace nweb;
+
+    //a request rewriting its range keeps a bounded arena
+    HttpHeaderList headers;
+    char name[32];
+    for(int i = 0; i < 40; ++i)
+    {
+        sprintf_s(name, "X-Header-%d", i);
+        headers.Set(name, name);
+    }
+    for(int i = 0; i < 1000; ++i)
+    {
+        sprintf_s(name, "bytes=%d-%d", i, i + 100);
+        headers.Set("Range", name);
+    }
+    EXPECT_EQ(41, headers.Count());
+    StringPiece value;
+    ASSERT_TRUE(headers.Find("x-header-39", value));
+    EXPECT_EQ(StringPiece("X-Header-39"), value);
+    ASSERT_TRUE(headers.Find(HttpHeaderList::kRange, value));
+    EXPECT_EQ(StringPiece("bytes=999-1099"), value);
+
+    headers.Remove("X-Header-0");
+    ASSERT_TRUE(headers.Find("X-Header-20", value));
+    EXPECT_EQ(StringPiece("X-Header-20"), value);
+    EXPECT_EQ(40, headers.Count());
+}
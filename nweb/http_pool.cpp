@@ -0,0 +1,286 @@
+#ifndef _WIN32
+#include <time.h>
+#endif
+#include <functional>
+#include <vector>
+#include <curl/curl.h>
+#include "http_pool.h"
+
+namespace nweb
+{
+
+namespace
+{
+
+uint64_t TickCount64()
+{
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+HttpConnectionPool g_global_pool;
+
+//[param] is the lock array of the pool
+void LockShare(CURL * curl_easy, curl_lock_data data, curl_lock_access access, void * param)
+{
+    if(static_cast<uint32_t>(data) < HttpConnectionPool::kLockCount)
+        reinterpret_cast<std::mutex *>(param)[data].lock();
+}
+
+void UnlockShare(CURL * curl_easy, curl_lock_data data, void * param)
+{
+    if(static_cast<uint32_t>(data) < HttpConnectionPool::kLockCount)
+        reinterpret_cast<std::mutex *>(param)[data].unlock();
+}
+
+//connections are closed outside the shard locks
+void CloseMultis(const std::vector<void *> & multis)
+{
+    for(size_t i = 0; i < multis.size(); ++i)
+        curl_multi_cleanup(multis[i]);
+}
+
+}
+
+HttpConnectionPool::HttpConnectionPool()
+    : share_(0),
+      max_host_connections_(0),
+      max_idle_per_host_(kDefaultMaxIdlePerHost),
+      idle_timeout_(kDefaultIdleTimeout),
+      next_reap_(0),
+      hits_(0), misses_(0), parked_(0), reaped_(0), evicted_(0)
+{
+}
+
+HttpConnectionPool::~HttpConnectionPool()
+{
+    Clear();
+    if(share_)
+        curl_share_cleanup(share_);
+}
+
+void HttpConnectionPool::SetMaxHostConnections(uint32_t count)
+{
+    max_host_connections_ = count;
+}
+
+uint32_t HttpConnectionPool::GetMaxHostConnections() const
+{
+    return max_host_connections_;
+}
+
+void HttpConnectionPool::SetMaxIdlePerHost(uint32_t count)
+{
+    max_idle_per_host_ = count;
+}
+
+void HttpConnectionPool::SetIdleTimeout(uint32_t ms)
+{
+    idle_timeout_ = ms;
+}
+
+void * HttpConnectionPool::Share()
+{
+    std::lock_guard<std::mutex> guard(share_lock_);
+    if(!share_)
+    {
+        share_ = curl_share_init();
+        if(!share_)
+            return 0;
+
+        curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, LockShare);
+        curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, UnlockShare);
+        curl_share_setopt(share_, CURLSHOPT_USERDATA, data_locks_);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        //fails quietly when curl is built without TLS
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+    return share_;
+}
+
+void * HttpConnectionPool::AcquireMulti(const std::string & origin)
+{
+    void * curl_multi = 0;
+    std::vector<void *> expired;
+    uint64_t now = TickCount64();
+    uint32_t timeout = idle_timeout_;
+    {
+        Shard & shard = ShardOf(origin);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto iter = shard.hosts.find(origin);
+        if(iter != shard.hosts.end())
+        {
+            Idles & idles = iter->second;
+            //the newest one has the best chance its connections are still open
+            while(!idles.empty() && !curl_multi)
+            {
+                Idle idle = idles.back();
+                idles.pop_back();
+                if(now - idle.since < timeout)
+                    curl_multi = idle.curl_multi;
+                else
+                    expired.push_back(idle.curl_multi);
+            }
+            if(idles.empty())
+                shard.hosts.erase(iter);
+        }
+    }
+    CloseMultis(expired);
+    reaped_ += expired.size();
+    ReapSometimes(now);
+
+    if(curl_multi)
+    {
+        ++hits_;
+    }
+    else
+    {
+        ++misses_;
+        curl_multi = curl_multi_init();
+        if(!curl_multi)
+            return 0;
+    }
+    Configure(curl_multi);
+    return curl_multi;
+}
+
+void HttpConnectionPool::ReleaseMulti(void * curl_multi, const std::string & origin)
+{
+    if(!curl_multi)
+        return;
+
+    std::vector<void *> expired;
+    std::vector<void *> evicted;
+    uint64_t now = TickCount64();
+    uint32_t timeout = idle_timeout_;
+    uint32_t max_idle = max_idle_per_host_;
+    {
+        Shard & shard = ShardOf(origin);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        Idles & idles = shard.hosts[origin];
+        while(!idles.empty() && now - idles.front().since >= timeout)
+        {
+            expired.push_back(idles.front().curl_multi);
+            idles.pop_front();
+        }
+        Idle idle = {curl_multi, now};
+        idles.push_back(idle);
+        while(idles.size() > max_idle)
+        {
+            evicted.push_back(idles.front().curl_multi);
+            idles.pop_front();
+        }
+        if(idles.empty())
+            shard.hosts.erase(origin);
+    }
+    CloseMultis(expired);
+    CloseMultis(evicted);
+    reaped_ += expired.size();
+    evicted_ += evicted.size();
+    //a multi evicted at once was never parked
+    if(evicted.empty() || evicted.back() != curl_multi)
+        ++parked_;
+    ReapSometimes(now);
+}
+
+uint32_t HttpConnectionPool::Reap()
+{
+    std::vector<void *> expired;
+    uint64_t now = TickCount64();
+    uint32_t timeout = idle_timeout_;
+    for(uint32_t i = 0; i < kShardCount; ++i)
+    {
+        Shard & shard = shards_[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        for(auto iter = shard.hosts.begin(); iter != shard.hosts.end();)
+        {
+            Idles & idles = iter->second;
+            while(!idles.empty() && now - idles.front().since >= timeout)
+            {
+                expired.push_back(idles.front().curl_multi);
+                idles.pop_front();
+            }
+            if(idles.empty())
+                iter = shard.hosts.erase(iter);
+            else
+                ++iter;
+        }
+    }
+    CloseMultis(expired);
+    reaped_ += expired.size();
+    return static_cast<uint32_t>(expired.size());
+}
+
+void HttpConnectionPool::Clear()
+{
+    std::vector<void *> idle;
+    for(uint32_t i = 0; i < kShardCount; ++i)
+    {
+        Shard & shard = shards_[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        for(auto iter = shard.hosts.begin(); iter != shard.hosts.end(); ++iter)
+        {
+            Idles & idles = iter->second;
+            for(size_t n = 0; n < idles.size(); ++n)
+                idle.push_back(idles[n].curl_multi);
+        }
+        shard.hosts.clear();
+    }
+    CloseMultis(idle);
+}
+
+size_t HttpConnectionPool::IdleCount()
+{
+    size_t count = 0;
+    for(uint32_t i = 0; i < kShardCount; ++i)
+    {
+        Shard & shard = shards_[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        for(auto iter = shard.hosts.begin(); iter != shard.hosts.end(); ++iter)
+            count += iter->second.size();
+    }
+    return count;
+}
+
+void HttpConnectionPool::GetCounters(Counters & counters) const
+{
+    counters.hits = hits_;
+    counters.misses = misses_;
+    counters.parked = parked_;
+    counters.reaped = reaped_;
+    counters.evicted = evicted_;
+}
+
+HttpConnectionPool & HttpConnectionPool::Global()
+{
+    return g_global_pool;
+}
+
+HttpConnectionPool::Shard & HttpConnectionPool::ShardOf(const std::string & origin)
+{
+    return shards_[std::hash<std::string>()(origin) % kShardCount];
+}
+
+void HttpConnectionPool::Configure(void * curl_multi)
+{
+    long max_host_connections = max_host_connections_;
+    curl_multi_setopt(curl_multi, CURLMOPT_MAX_HOST_CONNECTIONS, max_host_connections);
+}
+
+void HttpConnectionPool::ReapSometimes(uint64_t now)
+{
+    uint64_t next = next_reap_;
+    if(now < next)
+        return;
+    //only one of the threads getting here does the round
+    if(!next_reap_.compare_exchange_strong(next, now + idle_timeout_ / 2 + 1))
+        return;
+    Reap();
+}
+
+}
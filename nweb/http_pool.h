@@ -0,0 +1,136 @@
+#ifndef NWEB_HTTP_POOL_H_
+#define NWEB_HTTP_POOL_H_
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "nweb.h"
+
+namespace nweb
+{
+
+//HttpConnectionPool keeps what a finished transfer leaves behind for the
+//next one. Resolved names and TLS sessions are shared by every handle of
+//the pool through curl's share interface. Live connections stay in the
+//connection cache of the curl multi that opened them; curl 7.36 can't
+//share that cache, so an idle multi is parked under the origin it last
+//worked with and handed as a whole to the next HttpMulti of that origin.
+//All methods may be called from any thread.
+class HttpConnectionPool
+{
+public:
+    static const uint32_t kShardCount = 8;
+    //covers every curl_lock_data
+    static const uint32_t kLockCount = 8;
+    static const uint32_t kDefaultMaxIdlePerHost = 4;
+    //milliseconds, most servers drop kept alive connections within a minute
+    static const uint32_t kDefaultIdleTimeout = 30000;
+
+    struct Counters
+    {
+        //AcquireMulti found a parked multi of the origin
+        uint64_t hits;
+        //AcquireMulti created a new multi
+        uint64_t misses;
+        uint64_t parked;
+        //closed after the idle timeout
+        uint64_t reaped;
+        //closed to stay within the idle limit of a host
+        uint64_t evicted;
+    };
+
+public:
+    HttpConnectionPool();
+
+    ~HttpConnectionPool();
+
+    //Connections to one host a multi of the pool may open, 0 for unlimited.
+    //Applies to the multis handed out from now on.
+    void SetMaxHostConnections(uint32_t count);
+
+    uint32_t GetMaxHostConnections() const;
+
+    //Parked multis kept per origin, the oldest one is closed beyond that.
+    void SetMaxIdlePerHost(uint32_t count);
+
+    //Milliseconds a parked multi is kept.
+    void SetIdleTimeout(uint32_t ms);
+
+    //The curl share handle for CURLOPT_SHARE, 0 if it can't be created.
+    //It lives as long as the pool, so every easy handle attached to it
+    //must be cleaned up first.
+    void * Share();
+
+    //A parked multi which last worked with [origin], or a new one.
+    void * AcquireMulti(const std::string & origin);
+
+    //Park [curl_multi] with its idle connections. No easy handle may be
+    //attached to it any more.
+    void ReleaseMulti(void * curl_multi, const std::string & origin);
+
+    //Close the multis parked longer than the idle timeout.
+    //Return the number closed. Acquiring and releasing reap now and then
+    //by themselves, so hosts which aren't visited again don't keep theirs.
+    uint32_t Reap();
+
+    //Close every parked multi.
+    void Clear();
+
+    size_t IdleCount();
+
+    void GetCounters(Counters & counters) const;
+
+    //The pool HttpMulti and HttpConnection use unless told otherwise.
+    static HttpConnectionPool & Global();
+
+private:
+    struct Idle
+    {
+        void * curl_multi;
+        uint64_t since;
+    };
+    //newest at the back
+    typedef std::deque<Idle> Idles;
+    typedef std::unordered_map<std::string, Idles> Hosts;
+
+    //origins are spread over the shards, so threads parking multis of
+    //different hosts rarely wait for each other
+    struct Shard
+    {
+        std::mutex lock;
+        Hosts hosts;
+    };
+
+    HttpConnectionPool(const HttpConnectionPool &);
+    HttpConnectionPool & operator=(const HttpConnectionPool &);
+
+    Shard & ShardOf(const std::string & origin);
+
+    void Configure(void * curl_multi);
+
+    //Reap once per half idle timeout.
+    void ReapSometimes(uint64_t now);
+
+private:
+    std::mutex share_lock_;
+    void * share_;
+    //one lock per kind of shared data, a name lookup never waits for
+    //a TLS session being stored
+    std::mutex data_locks_[kLockCount];
+    Shard shards_[kShardCount];
+    std::atomic<uint32_t> max_host_connections_;
+    std::atomic<uint32_t> max_idle_per_host_;
+    std::atomic<uint32_t> idle_timeout_;
+    std::atomic<uint64_t> next_reap_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> parked_;
+    std::atomic<uint64_t> reaped_;
+    std::atomic<uint64_t> evicted_;
+};
+
+}
+
+#endif
@@ -0,0 +1,87 @@
+#include "nweb_test.h"
+#include "http_pool.h"
+
+TEST(HttpConnectionPool, ParkByOrigin)
+{
+    using namespace nweb;
+
+    HttpConnectionPool pool;
+    HttpConnectionPool::Counters counters;
+
+    void * first = pool.AcquireMulti("http://a.example.com");
+    ASSERT_TRUE(first != 0);
+    pool.ReleaseMulti(first, "http://a.example.com");
+    EXPECT_EQ(1, pool.IdleCount());
+
+    //another origin doesn't get it
+    void * second = pool.AcquireMulti("http://b.example.com");
+    ASSERT_TRUE(second != 0);
+    EXPECT_NE(first, second);
+    EXPECT_EQ(1, pool.IdleCount());
+
+    //the same origin does
+    void * again = pool.AcquireMulti("http://a.example.com");
+    EXPECT_EQ(first, again);
+    EXPECT_EQ(0, pool.IdleCount());
+
+    pool.GetCounters(counters);
+    EXPECT_EQ(1, counters.hits);
+    EXPECT_EQ(2, counters.misses);
+    EXPECT_EQ(1, counters.parked);
+
+    pool.ReleaseMulti(again, "http://a.example.com");
+    pool.ReleaseMulti(second, "http://b.example.com");
+    EXPECT_EQ(2, pool.IdleCount());
+    pool.Clear();
+    EXPECT_EQ(0, pool.IdleCount());
+}
+
+TEST(HttpConnectionPool, IdleLimits)
+{
+    using namespace nweb;
+
+    HttpConnectionPool pool;
+    HttpConnectionPool::Counters counters;
+    const char * origin = "http://a.example.com";
+
+    //the oldest ones are closed beyond the limit
+    pool.SetMaxIdlePerHost(2);
+    void * multis[3];
+    for(int i = 0; i < 3; ++i)
+        multis[i] = pool.AcquireMulti(origin);
+    for(int i = 0; i < 3; ++i)
+        pool.ReleaseMulti(multis[i], origin);
+    EXPECT_EQ(2, pool.IdleCount());
+    pool.GetCounters(counters);
+    EXPECT_EQ(1, counters.evicted);
+
+    //the newest one is handed out first
+    void * newest = pool.AcquireMulti(origin);
+    EXPECT_EQ(multis[2], newest);
+    pool.ReleaseMulti(newest, origin);
+
+    //expired ones are reaped
+    pool.SetIdleTimeout(0);
+    EXPECT_EQ(2, pool.Reap());
+    EXPECT_EQ(0, pool.IdleCount());
+    pool.GetCounters(counters);
+    EXPECT_EQ(2, counters.reaped);
+
+    //and never handed out
+    pool.ReleaseMulti(pool.AcquireMulti(origin), origin);
+    void * fresh = pool.AcquireMulti(origin);
+    ASSERT_TRUE(fresh != 0);
+    pool.GetCounters(counters);
+    EXPECT_EQ(1, counters.hits);
+    pool.ReleaseMulti(fresh, origin);
+}
+
+TEST(HttpConnectionPool, Share)
+{
+    using namespace nweb;
+
+    HttpConnectionPool pool;
+    void * share = pool.Share();
+    ASSERT_TRUE(share != 0);
+    EXPECT_EQ(share, pool.Share());
+}
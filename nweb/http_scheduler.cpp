@@ -0,0 +1,550 @@
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <time.h>
+#endif
+#include <vector>
+#include "http_scheduler.h"
+
+namespace nweb
+{
+
+namespace
+{
+
+//max events handled in one poll
+const int kMaxPollEvents = 256;
+//rounds a job may be advanced back to back without any transfer
+const uint32_t kMaxBusyRounds = 4;
+
+uint64_t TickCount64()
+{
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+}
+
+//SocketPoller keeps the socket set curl asked for.
+//epoll on linux, WSAPoll on windows.
+//Wake interrupts a Wait from another thread, through an eventfd on linux
+//and a loopback udp socket sending to itself on windows.
+class SocketPoller
+{
+public:
+    struct Event
+    {
+        intptr_t socket;
+        int events;
+    };
+    typedef std::vector<Event> Events;
+
+public:
+    SocketPoller();
+
+    ~SocketPoller();
+
+    bool init();
+
+    void fini();
+
+    void Watch(intptr_t socket, int what);
+
+    //Fill [events] with masks of HttpMulti::kSocketIn/Out/Error.
+    //Returns true if woken by Wake.
+    bool Wait(uint32_t ms, Events & events);
+
+    //Thread safe.
+    void Wake();
+
+private:
+    void Drain();
+
+private:
+#ifdef _WIN32
+    std::vector<WSAPOLLFD> fds_;
+    std::unordered_map<intptr_t, size_t> index_;
+    SOCKET wake_;
+#else
+    int epoll_;
+    std::unordered_set<intptr_t> sockets_;
+    int wake_;
+#endif
+};
+
+#ifdef _WIN32
+
+SocketPoller::SocketPoller()
+    : wake_(INVALID_SOCKET)
+{
+}
+
+SocketPoller::~SocketPoller()
+{
+    fini();
+}
+
+bool SocketPoller::init()
+{
+    if(wake_ != INVALID_SOCKET)
+        return true;
+
+    wake_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(wake_ == INVALID_SOCKET)
+        return false;
+
+    //bind to a free loopback port and send to it
+    sockaddr_in addr = {0};
+    int length = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    u_long nonblocking = 1;
+    if(bind(wake_, reinterpret_cast<sockaddr *>(&addr), length) ||
+       getsockname(wake_, reinterpret_cast<sockaddr *>(&addr), &length) ||
+       connect(wake_, reinterpret_cast<sockaddr *>(&addr), length) ||
+       ioctlsocket(wake_, FIONBIO, &nonblocking))
+    {
+        closesocket(wake_);
+        wake_ = INVALID_SOCKET;
+        return false;
+    }
+    Watch(static_cast<intptr_t>(wake_), HttpSocketWatcher::kWatchIn);
+    return true;
+}
+
+void SocketPoller::fini()
+{
+    fds_.clear();
+    index_.clear();
+    if(wake_ != INVALID_SOCKET)
+    {
+        closesocket(wake_);
+        wake_ = INVALID_SOCKET;
+    }
+}
+
+void SocketPoller::Watch(intptr_t socket, int what)
+{
+    auto iter = index_.find(socket);
+    if(what == HttpSocketWatcher::kWatchNone)
+    {
+        if(iter == index_.end())
+            return;
+        //move the last one into the hole
+        size_t hole = iter->second;
+        index_.erase(iter);
+        if(hole != fds_.size() - 1)
+        {
+            fds_[hole] = fds_.back();
+            index_[static_cast<intptr_t>(fds_[hole].fd)] = hole;
+        }
+        fds_.pop_back();
+        return;
+    }
+
+    short events = 0;
+    if(what & HttpSocketWatcher::kWatchIn)
+        events |= POLLRDNORM;
+    if(what & HttpSocketWatcher::kWatchOut)
+        events |= POLLWRNORM;
+
+    if(iter == index_.end())
+    {
+        WSAPOLLFD fd = {0};
+        fd.fd = static_cast<SOCKET>(socket);
+        fd.events = events;
+        index_[socket] = fds_.size();
+        fds_.push_back(fd);
+    }
+    else
+    {
+        fds_[iter->second].events = events;
+    }
+}
+
+bool SocketPoller::Wait(uint32_t ms, Events & events)
+{
+    events.clear();
+    if(fds_.empty())
+    {
+        if(ms)
+            Sleep(ms);
+        return false;
+    }
+
+    bool woken = false;
+    int count = WSAPoll(&fds_[0], static_cast<ULONG>(fds_.size()), ms);
+    for(size_t i = 0; count > 0 && i < fds_.size(); ++i)
+    {
+        short revents = fds_[i].revents;
+        if(!revents)
+            continue;
+        --count;
+        if(fds_[i].fd == wake_)
+        {
+            Drain();
+            woken = true;
+            continue;
+        }
+        Event event = {static_cast<intptr_t>(fds_[i].fd), 0};
+        if(revents & (POLLRDNORM | POLLHUP))
+            event.events |= HttpMulti::kSocketIn;
+        if(revents & POLLWRNORM)
+            event.events |= HttpMulti::kSocketOut;
+        if(revents & (POLLERR | POLLNVAL))
+            event.events |= HttpMulti::kSocketError;
+        events.push_back(event);
+    }
+    return woken;
+}
+
+void SocketPoller::Wake()
+{
+    char signal = 0;
+    if(wake_ != INVALID_SOCKET)
+        send(wake_, &signal, 1, 0);
+}
+
+void SocketPoller::Drain()
+{
+    char signals[64];
+    while(recv(wake_, signals, sizeof(signals), 0) > 0)
+        ;
+}
+
+#else
+
+SocketPoller::SocketPoller()
+    : epoll_(-1), wake_(-1)
+{
+}
+
+SocketPoller::~SocketPoller()
+{
+    fini();
+}
+
+bool SocketPoller::init()
+{
+    if(epoll_ < 0)
+        epoll_ = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_ < 0)
+        return false;
+
+    if(wake_ < 0)
+    {
+        wake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(wake_ < 0)
+            return false;
+        epoll_event event = {0};
+        event.data.fd = wake_;
+        event.events = EPOLLIN;
+        if(epoll_ctl(epoll_, EPOLL_CTL_ADD, wake_, &event))
+        {
+            close(wake_);
+            wake_ = -1;
+            return false;
+        }
+    }
+    return true;
+}
+
+void SocketPoller::fini()
+{
+    if(epoll_ >= 0)
+    {
+        close(epoll_);
+        epoll_ = -1;
+    }
+    if(wake_ >= 0)
+    {
+        close(wake_);
+        wake_ = -1;
+    }
+    sockets_.clear();
+}
+
+void SocketPoller::Watch(intptr_t socket, int what)
+{
+    int fd = static_cast<int>(socket);
+    bool known = sockets_.count(socket) != 0;
+    if(what == HttpSocketWatcher::kWatchNone)
+    {
+        if(!known)
+            return;
+        //curl may have closed it already, ignore the error
+        epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, 0);
+        sockets_.erase(socket);
+        return;
+    }
+
+    epoll_event event = {0};
+    event.data.fd = fd;
+    if(what & HttpSocketWatcher::kWatchIn)
+        event.events |= EPOLLIN;
+    if(what & HttpSocketWatcher::kWatchOut)
+        event.events |= EPOLLOUT;
+
+    if(known)
+    {
+        epoll_ctl(epoll_, EPOLL_CTL_MOD, fd, &event);
+    }
+    else if(!epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event))
+    {
+        sockets_.insert(socket);
+    }
+}
+
+bool SocketPoller::Wait(uint32_t ms, Events & events)
+{
+    events.clear();
+    bool woken = false;
+    epoll_event ready[kMaxPollEvents];
+    int count = epoll_wait(epoll_, ready, kMaxPollEvents, ms);
+    for(int i = 0; i < count; ++i)
+    {
+        if(ready[i].data.fd == wake_)
+        {
+            Drain();
+            woken = true;
+            continue;
+        }
+        Event event = {ready[i].data.fd, 0};
+        if(ready[i].events & (EPOLLIN | EPOLLHUP))
+            event.events |= HttpMulti::kSocketIn;
+        if(ready[i].events & EPOLLOUT)
+            event.events |= HttpMulti::kSocketOut;
+        if(ready[i].events & EPOLLERR)
+            event.events |= HttpMulti::kSocketError;
+        events.push_back(event);
+    }
+    return woken;
+}
+
+void SocketPoller::Wake()
+{
+    uint64_t signal = 1;
+    if(wake_ >= 0)
+        write(wake_, &signal, sizeof(signal));
+}
+
+void SocketPoller::Drain()
+{
+    uint64_t signals = 0;
+    read(wake_, &signals, sizeof(signals));
+}
+
+#endif
+
+/*
+HttpDownloadScheduler
+*/
+HttpDownloadScheduler::HttpDownloadScheduler()
+    : poller_(0), timer_armed_(false), timer_deadline_(0)
+{
+}
+
+HttpDownloadScheduler::~HttpDownloadScheduler()
+{
+    fini();
+}
+
+bool HttpDownloadScheduler::init()
+{
+    if(!poller_)
+        poller_ = new SocketPoller();
+    if(!poller_ || !poller_->init())
+        return false;
+
+    BlockPool::Instance().RemoveListener(this);
+    BlockPool::Instance().AddListener(this);
+    multi_.SetWatcher(this);
+    return multi_.LazyInitialize();
+}
+
+void HttpDownloadScheduler::fini()
+{
+    while(!jobs_.empty())
+        Remove(jobs_.begin()->first);
+    dirty_jobs_.clear();
+    idle_jobs_.clear();
+
+    multi_.fini();
+    timer_armed_ = false;
+    BlockPool::Instance().RemoveListener(this);
+
+    if(poller_)
+    {
+        delete poller_;
+        poller_ = 0;
+    }
+}
+
+bool HttpDownloadScheduler::Add(HttpForeman * foreman,
+                                HttpDownloadClient * client)
+{
+    if(!foreman)
+        return false;
+    if(jobs_.count(foreman))
+        return false;
+    if(!init())
+        return false;
+
+    Job job = {foreman, client, 0};
+    foreman->AttachMulti(&multi_);
+    jobs_[foreman] = job;
+    dirty_jobs_.insert(foreman);
+    return true;
+}
+
+void HttpDownloadScheduler::Remove(HttpForeman * foreman)
+{
+    auto iter = jobs_.find(foreman);
+    if(iter == jobs_.end())
+        return;
+
+    jobs_.erase(iter);
+    dirty_jobs_.erase(foreman);
+    idle_jobs_.erase(foreman);
+    foreman->Reset();
+    foreman->AttachMulti(0);
+}
+
+void HttpDownloadScheduler::RunOnce(uint32_t ms)
+{
+    if(!poller_)
+        return;
+
+    SocketPoller::Events events;
+    bool woken = poller_->Wait(NextTimeout(ms), events);
+    for(size_t i = 0; i < events.size(); ++i)
+        multi_.SocketAction(events[i].socket, events[i].events);
+
+    multi_.ResumePaused();
+
+    if(timer_armed_ && TickCount64() >= timer_deadline_)
+    {
+        timer_armed_ = false;
+        multi_.Timeout();
+    }
+
+    //jobs made dirty while advancing are handled in the next round
+    JobSet dirty;
+    dirty.swap(dirty_jobs_);
+    //the waker doesn't know the job, try every idle one
+    if(woken)
+    {
+        dirty.insert(idle_jobs_.begin(), idle_jobs_.end());
+        idle_jobs_.clear();
+    }
+    for(auto iter = dirty.begin(); iter != dirty.end(); ++iter)
+    {
+        if(jobs_.count(*iter))
+            Advance(*iter);
+    }
+}
+
+size_t HttpDownloadScheduler::JobCount() const
+{
+    return jobs_.size();
+}
+
+void HttpDownloadScheduler::Wake()
+{
+    if(poller_)
+        poller_->Wake();
+}
+
+void HttpDownloadScheduler::WatchSocket(intptr_t socket, int what)
+{
+    if(poller_)
+        poller_->Watch(socket, what);
+}
+
+void HttpDownloadScheduler::WatchTimer(long ms)
+{
+    if(ms < 0)
+    {
+        timer_armed_ = false;
+        return;
+    }
+    timer_armed_ = true;
+    timer_deadline_ = TickCount64() + ms;
+}
+
+void HttpDownloadScheduler::TransferDone(HttpConnection & conn)
+{
+    auto foreman = reinterpret_cast<HttpForeman *>(conn.GetContext());
+    if(foreman && jobs_.count(foreman))
+        dirty_jobs_.insert(foreman);
+}
+
+void HttpDownloadScheduler::BufferAvailable()
+{
+    Wake();
+}
+
+void HttpDownloadScheduler::Advance(HttpForeman * foreman)
+{
+    Result result = foreman->Fetch();
+    if(result != kResultAgain)
+    {
+        Finish(foreman, result);
+        return;
+    }
+
+    Job & job = jobs_[foreman];
+    if(foreman->IsTransferring())
+    {
+        job.idle_rounds = 0;
+        return;
+    }
+    //nothing in flight would wake it up, e.g. after a stage change.
+    //a job which keeps idle is waiting for its background work or a block
+    //buffer, both of which Wake the scheduler when done.
+    if(++job.idle_rounds <= kMaxBusyRounds)
+    {
+        dirty_jobs_.insert(foreman);
+        return;
+    }
+    idle_jobs_.insert(foreman);
+}
+
+void HttpDownloadScheduler::Finish(HttpForeman * foreman, Result result)
+{
+    auto iter = jobs_.find(foreman);
+    if(iter == jobs_.end())
+        return;
+
+    HttpDownloadClient * client = iter->second.client;
+    jobs_.erase(iter);
+    dirty_jobs_.erase(foreman);
+    idle_jobs_.erase(foreman);
+    foreman->AttachMulti(0);
+    if(client)
+        client->NotifyFinished(*this, *foreman, result);
+}
+
+uint32_t HttpDownloadScheduler::NextTimeout(uint32_t ms) const
+{
+    if(!dirty_jobs_.empty())
+        return 0;
+
+    uint64_t now = TickCount64();
+    uint64_t timeout = ms;
+    if(timer_armed_)
+        timeout = timer_deadline_ > now ? (std::min)(timeout, timer_deadline_ - now) : 0;
+    //transfers paused by rate limiters have no socket to watch
+    timeout = (std::min)(timeout, static_cast<uint64_t>(multi_.ResumeDelay()));
+    return static_cast<uint32_t>(timeout);
+}
+
+}
@@ -0,0 +1,104 @@
+#ifndef NWEB_HTTP_SCHEDULER_H_
+#define NWEB_HTTP_SCHEDULER_H_
+
+#include <unordered_map>
+#include <unordered_set>
+#include "http.h"
+#include "http_foreman.h"
+#include "block_pool.h"
+
+namespace nweb
+{
+
+class HttpDownloadScheduler;
+class SocketPoller;
+
+class HttpDownloadClient
+{
+public:
+    virtual ~HttpDownloadClient() {}
+
+    //The job has left the scheduler, [result] is the final Fetch result.
+    virtual void NotifyFinished(HttpDownloadScheduler & scheduler,
+                                HttpForeman & foreman,
+                                Result result) = 0;
+};
+
+//HttpDownloadScheduler runs many HttpForeman on one thread.
+//All of their channels share one multi handle in socket driven mode,
+//a foreman is only advanced when one of its transfers completes,
+//or when its background work completes or a block buffer is released.
+class HttpDownloadScheduler : private HttpSocketWatcher,
+                              private BlockPool::Listener
+{
+private:
+    struct Job
+    {
+        HttpForeman * foreman;
+        HttpDownloadClient * client;
+        uint32_t idle_rounds;
+    };
+    typedef std::unordered_map<HttpForeman *, Job> Jobs;
+    typedef std::unordered_set<HttpForeman *> JobSet;
+
+public:
+    HttpDownloadScheduler();
+
+    ~HttpDownloadScheduler();
+
+    bool init();
+
+    //Every remaining job is reset without notification.
+    void fini();
+
+    //The foreman must be configured but not fetched yet.
+    //The scheduler does not own the foreman, keep it alive until
+    //NotifyFinished or Remove.
+    bool Add(HttpForeman * foreman, HttpDownloadClient * client);
+
+    //Cancel a job without notification, the foreman is reset.
+    void Remove(HttpForeman * foreman);
+
+    //Wait at most [ms] for socket readiness or timers and advance
+    //the jobs which have something to do.
+    void RunOnce(uint32_t ms);
+
+    size_t JobCount() const;
+
+    //Make a RunOnce waiting on another thread return at once.
+    //Safe to call from any thread between init and fini.
+    void Wake();
+
+private:
+    HttpDownloadScheduler(const HttpDownloadScheduler &);
+    HttpDownloadScheduler & operator=(const HttpDownloadScheduler &);
+
+    void WatchSocket(intptr_t socket, int what);
+
+    void WatchTimer(long ms);
+
+    void TransferDone(HttpConnection & conn);
+
+    void BufferAvailable();
+
+    void Advance(HttpForeman * foreman);
+
+    void Finish(HttpForeman * foreman, Result result);
+
+    uint32_t NextTimeout(uint32_t ms) const;
+
+private:
+    HttpMulti multi_;
+    SocketPoller * poller_;
+    Jobs jobs_;
+    JobSet dirty_jobs_;
+    //jobs with nothing in flight but not done (e.g. waiting for a block
+    //buffer or a background write), advanced again by the next Wake
+    JobSet idle_jobs_;
+    bool timer_armed_;
+    uint64_t timer_deadline_;
+};
+
+}
+
+#endif
@@ -0,0 +1,54 @@
+#include "nweb_test.h"
+#include "http_scheduler.h"
+
+namespace
+{
+
+class Collector : public nweb::HttpDownloadClient
+{
+public:
+    Collector() : finished_(0), succeeded_(0) {}
+
+    void NotifyFinished(nweb::HttpDownloadScheduler & scheduler,
+                        nweb::HttpForeman & foreman,
+                        nweb::Result result)
+    {
+        ++finished_;
+        if(result == nweb::kResultOK)
+            ++succeeded_;
+    }
+
+    int finished_;
+    int succeeded_;
+};
+
+TEST(HttpDownloadScheduler, ManyJobs)
+{
+    using namespace nweb;
+
+    const char * url = "http://soft.pandoramanager.com/dev/VC-Compiler-KB2519277.exe";
+    const int kJobCount = 8;
+
+    Collector collector;
+    HttpDownloadScheduler scheduler;
+    HttpForeman foremen[kJobCount];
+    ASSERT_TRUE(scheduler.init());
+    for(int i = 0; i < kJobCount; ++i)
+    {
+        char name[32];
+        sprintf_s(name, "scheduler_%d.exe", i);
+        auto local = GetLocalPath(name);
+        foremen[i].SetPrimaryUrl(url);
+        foremen[i].SetFilePath(local.data());
+        ASSERT_TRUE(scheduler.Add(&foremen[i], &collector));
+    }
+
+    while(scheduler.JobCount())
+        scheduler.RunOnce(1000);
+
+    EXPECT_EQ(kJobCount, collector.finished_);
+    EXPECT_EQ(kJobCount, collector.succeeded_);
+    scheduler.fini();
+}
+
+}
@@ -0,0 +1,269 @@
+#include <chrono>
+#include "http_service.h"
+
+namespace nweb
+{
+
+namespace
+{
+
+//longest sleep(ms) of the service thread when nothing happens
+const uint32_t kMaxIdleWait = 1000;
+
+uint64_t NowMs()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+/*
+HttpDownloadTask
+*/
+HttpDownloadTask::HttpDownloadTask(HttpDownloadService * service,
+                                   HttpForeman * foreman,
+                                   HttpDownloadObserver * observer)
+    : service_(service), foreman_(foreman), observer_(observer),
+      result_(kResultAgain), reported_size_(0), reported_time_(0)
+{
+}
+
+HttpForeman & HttpDownloadTask::foreman() const
+{
+    return *foreman_;
+}
+
+Result HttpDownloadTask::Wait(uint32_t ms)
+{
+    std::unique_lock<std::mutex> guard(lock_);
+    if(ms == -1)
+    {
+        while(result_ == kResultAgain)
+            finished_.wait(guard);
+        return result_;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    while(result_ == kResultAgain)
+    {
+        if(finished_.wait_until(guard, deadline) == std::cv_status::timeout)
+            break;
+    }
+    return result_;
+}
+
+bool HttpDownloadTask::IsFinished() const
+{
+    return GetResult() != kResultAgain;
+}
+
+Result HttpDownloadTask::GetResult() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return result_;
+}
+
+void HttpDownloadTask::Cancel()
+{
+    if(!IsFinished())
+        service_->Cancel(this);
+}
+
+void HttpDownloadTask::Finish(Result result)
+{
+    //the observer sees the result before any waiter returns
+    if(observer_)
+        observer_->NotifyFinished(*this, result);
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        result_ = result;
+    }
+    finished_.notify_all();
+}
+
+/*
+HttpDownloadService
+*/
+HttpDownloadService::HttpDownloadService()
+    : task_count_(0), running_(false), 
+      progress_interval_(kDefaultProgressInterval)
+{
+}
+
+HttpDownloadService::~HttpDownloadService()
+{
+    Stop();
+}
+
+bool HttpDownloadService::Start()
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    if(running_)
+        return true;
+    if(!scheduler_.init())
+        return false;
+
+    running_ = true;
+    thread_ = std::thread(&HttpDownloadService::Run, this);
+    return true;
+}
+
+void HttpDownloadService::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        if(!running_)
+            return;
+        running_ = false;
+    }
+    scheduler_.Wake();
+    thread_.join();
+}
+
+void HttpDownloadService::SetProgressInterval(uint32_t ms)
+{
+    progress_interval_ = ms;
+}
+
+HttpDownloadHandle HttpDownloadService::Submit(HttpForeman * foreman,
+                                               HttpDownloadObserver * observer)
+{
+    if(!foreman)
+        return HttpDownloadHandle();
+
+    std::lock_guard<std::mutex> guard(lock_);
+    if(!running_)
+        return HttpDownloadHandle();
+    HttpDownloadHandle task(new HttpDownloadTask(this, foreman, observer));
+    submitted_.push_back(task);
+    task_count_++;
+    scheduler_.Wake();
+    return task;
+}
+
+size_t HttpDownloadService::TaskCount() const
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    return task_count_;
+}
+
+void HttpDownloadService::Run()
+{
+    while(true)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            if(!running_)
+                break;
+        }
+        TakeRequests();
+        scheduler_.RunOnce(kMaxIdleWait);
+        ReportProgress();
+    }
+
+    //tasks which never reached the scheduler are aborted as well
+    TakeRequests();
+    while(!tasks_.empty())
+    {
+        HttpDownloadHandle task = tasks_.begin()->second;
+        tasks_.erase(tasks_.begin());
+        scheduler_.Remove(task->foreman_);
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            task_count_--;
+        }
+        task->Finish(kResultUserAbort);
+    }
+    scheduler_.fini();
+}
+
+void HttpDownloadService::TakeRequests()
+{
+    TaskList submitted;
+    TaskList cancelled;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        submitted.swap(submitted_);
+        cancelled.swap(cancelled_);
+    }
+
+    for(size_t i = 0; i < submitted.size(); ++i)
+    {
+        HttpDownloadHandle & task = submitted[i];
+        if(!scheduler_.Add(task->foreman_, this))
+        {
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                task_count_--;
+            }
+            task->Finish(kResultFailed);
+            continue;
+        }
+        tasks_[task->foreman_] = task;
+    }
+
+    for(size_t i = 0; i < cancelled.size(); ++i)
+    {
+        auto iter = tasks_.find(cancelled[i]->foreman_);
+        //finished in the meantime
+        if(iter == tasks_.end() || iter->second != cancelled[i])
+            continue;
+        tasks_.erase(iter);
+        scheduler_.Remove(cancelled[i]->foreman_);
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            task_count_--;
+        }
+        cancelled[i]->Finish(kResultUserAbort);
+    }
+}
+
+void HttpDownloadService::ReportProgress()
+{
+    uint64_t now = NowMs();
+    for(auto iter = tasks_.begin(); iter != tasks_.end(); ++iter)
+    {
+        HttpDownloadTask & task = *iter->second;
+        if(!task.observer_)
+            continue;
+        if(now - task.reported_time_ < progress_interval_)
+            continue;
+        uint64_t fetched = task.foreman_->FetchedSize();
+        if(fetched == task.reported_size_)
+            continue;
+        task.reported_size_ = fetched;
+        task.reported_time_ = now;
+        task.observer_->NotifyProgress(task, fetched, task.foreman_->TotalSize());
+    }
+}
+
+void HttpDownloadService::Cancel(HttpDownloadTask * task)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    //Stop aborts it anyway
+    if(!running_)
+        return;
+    //a task still waiting in submitted_ is added and removed at once
+    cancelled_.push_back(task->shared_from_this());
+    scheduler_.Wake();
+}
+
+void HttpDownloadService::NotifyFinished(HttpDownloadScheduler & scheduler,
+                                         HttpForeman & foreman,
+                                         Result result)
+{
+    auto iter = tasks_.find(&foreman);
+    if(iter == tasks_.end())
+        return;
+
+    HttpDownloadHandle task = iter->second;
+    tasks_.erase(iter);
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        task_count_--;
+    }
+    task->Finish(result);
+}
+
+}
@@ -0,0 +1,143 @@
+#ifndef NWEB_HTTP_SERVICE_H_
+#define NWEB_HTTP_SERVICE_H_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "http_scheduler.h"
+
+namespace nweb
+{
+
+class HttpDownloadTask;
+class HttpDownloadService;
+
+typedef std::shared_ptr<HttpDownloadTask> HttpDownloadHandle;
+
+//Callbacks run on the service thread, keep them short.
+class HttpDownloadObserver
+{
+public:
+    virtual ~HttpDownloadObserver() {}
+
+    //Bytes arrived, at most once per progress interval.
+    virtual void NotifyProgress(HttpDownloadTask & task,
+                                uint64_t fetched_size,
+                                uint64_t total_size) = 0;
+    //The task is over, called once before waiters are released.
+    virtual void NotifyFinished(HttpDownloadTask & task, Result result) = 0;
+};
+
+//HttpDownloadTask is the handle of a download running on a service.
+class HttpDownloadTask : public std::enable_shared_from_this<HttpDownloadTask>
+{
+    friend class HttpDownloadService;
+public:
+    HttpForeman & foreman() const;
+
+    //Block until the task is over or [ms] elapsed, -1 waits forever.
+    //Return the final result, kResultAgain on timeout.
+    Result Wait(uint32_t ms);
+
+    bool IsFinished() const;
+
+    //kResultAgain while running.
+    Result GetResult() const;
+
+    //Ask the service to stop the download, it finishes with
+    //kResultUserAbort unless it's already over.
+    void Cancel();
+
+private:
+    HttpDownloadTask(HttpDownloadService * service,
+                     HttpForeman * foreman,
+                     HttpDownloadObserver * observer);
+
+    HttpDownloadTask(const HttpDownloadTask &);
+    HttpDownloadTask & operator=(const HttpDownloadTask &);
+
+    void Finish(Result result);
+
+private:
+    HttpDownloadService * service_;
+    HttpForeman * foreman_;
+    HttpDownloadObserver * observer_;
+    mutable std::mutex lock_;
+    std::condition_variable finished_;
+    Result result_;
+    //service thread only
+    uint64_t reported_size_;
+    uint64_t reported_time_;
+};
+
+//HttpDownloadService runs downloads on a thread of its own.
+//The thread sleeps in the socket poller of an HttpDownloadScheduler and
+//only wakes up for socket readiness, curl timers, or a task submitted or
+//cancelled by another thread. No caller needs a Fetch loop.
+class HttpDownloadService : private HttpDownloadClient
+{
+    friend class HttpDownloadTask;
+public:
+    static const uint32_t kDefaultProgressInterval = 200;
+
+public:
+    HttpDownloadService();
+
+    ~HttpDownloadService();
+
+    bool Start();
+
+    //Unfinished tasks end with kResultUserAbort.
+    void Stop();
+
+    //Min time(ms) between two progress notifications of a task.
+    //Set it before Start.
+    void SetProgressInterval(uint32_t ms);
+
+    //Start downloading with a configured foreman which hasn't fetched yet.
+    //Keep the foreman alive until the task is finished, the service
+    //does not own it. [observer] may be 0. Return 0 when not started.
+    HttpDownloadHandle Submit(HttpForeman * foreman,
+                              HttpDownloadObserver * observer);
+
+    //Tasks submitted and not finished yet.
+    size_t TaskCount() const;
+
+private:
+    typedef std::unordered_map<HttpForeman *, HttpDownloadHandle> Tasks;
+    typedef std::vector<HttpDownloadHandle> TaskList;
+
+    HttpDownloadService(const HttpDownloadService &);
+    HttpDownloadService & operator=(const HttpDownloadService &);
+
+    void Run();
+
+    //Move submitted and cancelled tasks into the scheduler.
+    void TakeRequests();
+
+    void ReportProgress();
+
+    void Cancel(HttpDownloadTask * task);
+
+    void NotifyFinished(HttpDownloadScheduler & scheduler,
+                        HttpForeman & foreman,
+                        Result result);
+
+private:
+    HttpDownloadScheduler scheduler_;
+    std::thread thread_;
+    mutable std::mutex lock_;
+    TaskList submitted_;
+    TaskList cancelled_;
+    size_t task_count_;
+    bool running_;
+    //service thread only
+    Tasks tasks_;
+    uint32_t progress_interval_;
+};
+
+}
+
+#endif
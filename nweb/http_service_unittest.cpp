@@ -0,0 +1,88 @@
+#include <atomic>
+#include "nweb_test.h"
+#include "http_service.h"
+
+namespace
+{
+
+class Observer : public nweb::HttpDownloadObserver
+{
+public:
+    Observer() : progress_(0), finished_(0), succeeded_(0) {}
+
+    void NotifyProgress(nweb::HttpDownloadTask & task,
+                        uint64_t fetched_size,
+                        uint64_t total_size)
+    {
+        ++progress_;
+    }
+
+    void NotifyFinished(nweb::HttpDownloadTask & task, nweb::Result result)
+    {
+        ++finished_;
+        if(result == nweb::kResultOK)
+            ++succeeded_;
+    }
+
+    std::atomic<int> progress_;
+    std::atomic<int> finished_;
+    std::atomic<int> succeeded_;
+};
+
+TEST(HttpDownloadService, WaitTasks)
+{
+    using namespace nweb;
+
+    const char * url = "http://soft.pandoramanager.com/dev/VC-Compiler-KB2519277.exe";
+    const int kTaskCount = 4;
+
+    Observer observer;
+    HttpDownloadService service;
+    HttpForeman foremen[kTaskCount];
+    HttpDownloadHandle tasks[kTaskCount];
+    ASSERT_TRUE(service.Start());
+    for(int i = 0; i < kTaskCount; ++i)
+    {
+        char name[32];
+        sprintf_s(name, "service_%d.exe", i);
+        auto local = GetLocalPath(name);
+        foremen[i].SetPrimaryUrl(url);
+        foremen[i].SetFilePath(local.data());
+        tasks[i] = service.Submit(&foremen[i], &observer);
+        ASSERT_TRUE(tasks[i] != nullptr);
+    }
+
+    for(int i = 0; i < kTaskCount; ++i)
+        EXPECT_EQ(kResultOK, tasks[i]->Wait(-1));
+
+    EXPECT_EQ(0, service.TaskCount());
+    EXPECT_EQ(kTaskCount, observer.finished_);
+    EXPECT_EQ(kTaskCount, observer.succeeded_);
+    EXPECT_LT(0, observer.progress_);
+    service.Stop();
+}
+
+TEST(HttpDownloadService, CancelTask)
+{
+    using namespace nweb;
+
+    const char * url = "http://soft.pandoramanager.com/dev/VC-Compiler-KB2519277.exe";
+
+    Observer observer;
+    HttpDownloadService service;
+    HttpForeman foreman;
+    ASSERT_TRUE(service.Start());
+
+    auto local = GetLocalPath("service_cancel.exe");
+    foreman.SetPrimaryUrl(url);
+    foreman.SetFilePath(local.data());
+    auto task = service.Submit(&foreman, &observer);
+    ASSERT_TRUE(task != nullptr);
+    EXPECT_EQ(kResultAgain, task->Wait(0));
+    task->Cancel();
+    EXPECT_EQ(kResultUserAbort, task->Wait(-1));
+    EXPECT_EQ(1, observer.finished_);
+    service.Stop();
+}
+
+}
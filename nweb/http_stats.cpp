@@ -0,0 +1,260 @@
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include "http_stats.h"
+
+namespace nweb
+{
+
+namespace
+{
+
+const uint32_t kHostShardCount = 8;
+const size_t kMaxHostsPerShard = HttpStats::kMaxHosts / kHostShardCount;
+
+struct HostEntry
+{
+    std::shared_ptr<HttpStats> stats;
+    //ForHost sequence of the last lookup
+    uint64_t used;
+};
+
+struct HostShard
+{
+    HostShard() : sequence(0) {}
+
+    std::mutex lock;
+    std::unordered_map<std::string, HostEntry> hosts;
+    uint64_t sequence;
+};
+
+HttpStats g_global_stats;
+HostShard g_host_shards[kHostShardCount];
+
+HostShard & ShardOf(const std::string & origin)
+{
+    return g_host_shards[std::hash<std::string>()(origin) % kHostShardCount];
+}
+
+//Drop the least recently used host only the shard holds.
+//The caller holds the shard lock.
+void EvictHost(HostShard & shard)
+{
+    auto oldest = shard.hosts.end();
+    for(auto iter = shard.hosts.begin(); iter != shard.hosts.end(); ++iter)
+    {
+        if(iter->second.stats.use_count() > 1)
+            continue;
+        if(oldest == shard.hosts.end() || iter->second.used < oldest->second.used)
+            oldest = iter;
+    }
+    if(oldest != shard.hosts.end())
+        shard.hosts.erase(oldest);
+}
+
+//index of the highest bit set, value must not be 0
+uint32_t HighestBit(uint64_t value)
+{
+    uint32_t bit = 0;
+    while(value >>= 1)
+        ++bit;
+    return bit;
+}
+
+}
+
+/*
+LatencyHistogram
+*/
+LatencyHistogram::LatencyHistogram()
+{
+    Clear();
+}
+
+void LatencyHistogram::Record(uint64_t value)
+{
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    buckets_[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while(value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        ;
+}
+
+void LatencyHistogram::GetSnapshot(Snapshot & snapshot) const
+{
+    snapshot.count = count_.load(std::memory_order_relaxed);
+    snapshot.sum = sum_.load(std::memory_order_relaxed);
+    snapshot.max = max_.load(std::memory_order_relaxed);
+    for(uint32_t i = 0; i < kBucketCount; ++i)
+        snapshot.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Clear()
+{
+    count_ = 0;
+    sum_ = 0;
+    max_ = 0;
+    for(uint32_t i = 0; i < kBucketCount; ++i)
+        buckets_[i] = 0;
+}
+
+uint32_t LatencyHistogram::BucketOf(uint64_t value)
+{
+    //values below kSubBuckets have a bucket each
+    if(value < kSubBuckets)
+        return static_cast<uint32_t>(value);
+
+    //2 bits under the highest one choose the sub bucket
+    uint32_t bit = HighestBit(value);
+    uint32_t sub = static_cast<uint32_t>(value >> (bit - 2)) & (kSubBuckets - 1);
+    uint32_t bucket = kSubBuckets + (bit - 2) * kSubBuckets + sub;
+    return (std::min)(bucket, kBucketCount - 1);
+}
+
+uint64_t LatencyHistogram::BucketLowerBound(uint32_t bucket)
+{
+    if(bucket < kSubBuckets)
+        return bucket;
+
+    uint32_t bit = (bucket - kSubBuckets) / kSubBuckets + 2;
+    uint64_t sub = (bucket - kSubBuckets) % kSubBuckets;
+    return (kSubBuckets + sub) << (bit - 2);
+}
+
+uint64_t LatencyHistogram::Snapshot::Percentile(double percent) const
+{
+    //buckets are read one by one while recording goes on,
+    //count against their own total
+    uint64_t total = 0;
+    for(uint32_t i = 0; i < kBucketCount; ++i)
+        total += buckets[i];
+    if(!total)
+        return 0;
+
+    uint64_t rank = static_cast<uint64_t>(total * (std::min)(percent, 100.0) / 100.0);
+    uint64_t seen = 0;
+    for(uint32_t i = 0; i < kBucketCount; ++i)
+    {
+        seen += buckets[i];
+        if(seen > rank)
+            return BucketLowerBound(i);
+    }
+    return max;
+}
+
+uint64_t LatencyHistogram::Snapshot::Mean() const
+{
+    return count ? sum / count : 0;
+}
+
+/*
+HttpStats
+*/
+HttpStats::HttpStats()
+{
+    Clear();
+}
+
+void HttpStats::Record(const HttpTiming & timing)
+{
+    transfers_.fetch_add(1, std::memory_order_relaxed);
+    if(!timing.succeeded)
+        failures_.fetch_add(1, std::memory_order_relaxed);
+    redirects_.fetch_add(timing.redirects, std::memory_order_relaxed);
+    in_bytes_.fetch_add(timing.in, std::memory_order_relaxed);
+    out_bytes_.fetch_add(timing.out, std::memory_order_relaxed);
+
+    //a kept alive connection skips dns, connect and tls, the few
+    //microseconds curl reports for them would drag the samples down
+    uint64_t ready = (std::max)(timing.connect, timing.app_connect);
+    if(timing.reused)
+    {
+        reused_.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if(timing.connect)
+    {
+        name_lookup_.Record(timing.name_lookup);
+        connect_.Record(timing.connect - (std::min)(timing.name_lookup, timing.connect));
+        if(timing.app_connect)
+            tls_.Record(timing.app_connect - (std::min)(timing.connect, timing.app_connect));
+    }
+
+    if(timing.start_transfer)
+        first_byte_.Record(timing.start_transfer - (std::min)(ready, timing.start_transfer));
+    total_.Record(timing.total);
+
+    //throughput of the body, after the first byte
+    if(timing.in && timing.total > timing.start_transfer)
+        throughput_.Record(timing.in * 1000000 / (timing.total - timing.start_transfer));
+}
+
+void HttpStats::GetSnapshot(Snapshot & snapshot) const
+{
+    snapshot.transfers = transfers_.load(std::memory_order_relaxed);
+    snapshot.failures = failures_.load(std::memory_order_relaxed);
+    snapshot.reused = reused_.load(std::memory_order_relaxed);
+    snapshot.redirects = redirects_.load(std::memory_order_relaxed);
+    snapshot.in_bytes = in_bytes_.load(std::memory_order_relaxed);
+    snapshot.out_bytes = out_bytes_.load(std::memory_order_relaxed);
+    name_lookup_.GetSnapshot(snapshot.name_lookup);
+    connect_.GetSnapshot(snapshot.connect);
+    tls_.GetSnapshot(snapshot.tls);
+    first_byte_.GetSnapshot(snapshot.first_byte);
+    total_.GetSnapshot(snapshot.total);
+    throughput_.GetSnapshot(snapshot.throughput);
+}
+
+void HttpStats::Clear()
+{
+    transfers_ = 0;
+    failures_ = 0;
+    reused_ = 0;
+    redirects_ = 0;
+    in_bytes_ = 0;
+    out_bytes_ = 0;
+    name_lookup_.Clear();
+    connect_.Clear();
+    tls_.Clear();
+    first_byte_.Clear();
+    total_.Clear();
+    throughput_.Clear();
+}
+
+HttpStats & HttpStats::Global()
+{
+    return g_global_stats;
+}
+
+std::shared_ptr<HttpStats> HttpStats::ForHost(const std::string & origin)
+{
+    HostShard & shard = ShardOf(origin);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto iter = shard.hosts.find(origin);
+    if(iter == shard.hosts.end())
+    {
+        if(shard.hosts.size() >= kMaxHostsPerShard)
+            EvictHost(shard);
+        HostEntry entry = {std::make_shared<HttpStats>(), 0};
+        iter = shard.hosts.insert(std::make_pair(origin, entry)).first;
+    }
+    iter->second.used = ++shard.sequence;
+    return iter->second.stats;
+}
+
+void HttpStats::GetHostSnapshots(HostSnapshots & snapshots)
+{
+    snapshots.clear();
+    for(uint32_t i = 0; i < kHostShardCount; ++i)
+    {
+        HostShard & shard = g_host_shards[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        for(auto iter = shard.hosts.begin(); iter != shard.hosts.end(); ++iter)
+        {
+            snapshots.push_back(std::make_pair(iter->first, Snapshot()));
+            iter->second.stats->GetSnapshot(snapshots.back().second);
+        }
+    }
+}
+
+}
@@ -0,0 +1,147 @@
+#ifndef NWEB_HTTP_STATS_H_
+#define NWEB_HTTP_STATS_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "nweb.h"
+
+namespace nweb
+{
+
+//Timing of one transfer as reported by curl, in microseconds since the
+//transfer started. A reused connection skipped dns, connect and tls,
+//curl still reports a few microseconds for them.
+struct HttpTiming
+{
+    uint64_t name_lookup;
+    uint64_t connect;
+    uint64_t app_connect;
+    uint64_t start_transfer;
+    uint64_t total;
+    uint32_t redirects;
+    uint64_t in;
+    uint64_t out;
+    bool succeeded;
+    //went over a kept alive connection, curl opened no new one
+    bool reused;
+};
+
+//LatencyHistogram counts values in log-linear buckets: every power of two
+//is split into kSubBuckets equal parts, so the relative error stays
+//under 25% from microseconds to hours. Record and GetSnapshot are lock
+//free and may run on different threads.
+class LatencyHistogram
+{
+public:
+    static const uint32_t kSubBuckets = 4;
+    static const uint32_t kBucketCount = 160;
+
+    struct Snapshot
+    {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[kBucketCount];
+
+        //Lower bound of the bucket holding the [percent]th value, 0 when empty.
+        uint64_t Percentile(double percent) const;
+
+        uint64_t Mean() const;
+    };
+
+public:
+    LatencyHistogram();
+
+    void Record(uint64_t value);
+
+    void GetSnapshot(Snapshot & snapshot) const;
+
+    void Clear();
+
+    static uint32_t BucketOf(uint64_t value);
+
+    static uint64_t BucketLowerBound(uint32_t bucket);
+
+private:
+    LatencyHistogram(const LatencyHistogram &);
+    LatencyHistogram & operator=(const LatencyHistogram &);
+
+private:
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+    std::atomic<uint64_t> buckets_[kBucketCount];
+};
+
+//HttpStats aggregates the timing of many transfers.
+//There is one per host, one for the process, and one per HttpForeman.
+class HttpStats
+{
+public:
+    //Host stats kept at most, see ForHost.
+    static const uint32_t kMaxHosts = 256;
+
+    struct Snapshot
+    {
+        uint64_t transfers;
+        uint64_t failures;
+        //transfers on a kept alive connection, they skip dns and connect
+        uint64_t reused;
+        uint64_t redirects;
+        uint64_t in_bytes;
+        uint64_t out_bytes;
+        LatencyHistogram::Snapshot name_lookup;
+        LatencyHistogram::Snapshot connect;
+        LatencyHistogram::Snapshot tls;
+        //request sent to first byte received
+        LatencyHistogram::Snapshot first_byte;
+        LatencyHistogram::Snapshot total;
+        //bytes per second of transfers with a body
+        LatencyHistogram::Snapshot throughput;
+    };
+    typedef std::vector<std::pair<std::string, Snapshot> > HostSnapshots;
+
+public:
+    HttpStats();
+
+    void Record(const HttpTiming & timing);
+
+    //Safe to call from any thread while transfers are recorded.
+    void GetSnapshot(Snapshot & snapshot) const;
+
+    void Clear();
+
+    static HttpStats & Global();
+
+    //Stats of every connection to [origin] (see URL::Origin).
+    //Beyond kMaxHosts the host looked up least recently whose stats no
+    //connection holds is dropped. Hosts are spread over several locks.
+    static std::shared_ptr<HttpStats> ForHost(const std::string & origin);
+
+    static void GetHostSnapshots(HostSnapshots & snapshots);
+
+private:
+    HttpStats(const HttpStats &);
+    HttpStats & operator=(const HttpStats &);
+
+private:
+    std::atomic<uint64_t> transfers_;
+    std::atomic<uint64_t> failures_;
+    std::atomic<uint64_t> reused_;
+    std::atomic<uint64_t> redirects_;
+    std::atomic<uint64_t> in_bytes_;
+    std::atomic<uint64_t> out_bytes_;
+    LatencyHistogram name_lookup_;
+    LatencyHistogram connect_;
+    LatencyHistogram tls_;
+    LatencyHistogram first_byte_;
+    LatencyHistogram total_;
+    LatencyHistogram throughput_;
+};
+
+}
+
+#endif
@@ -0,0 +1,100 @@
+#include "nweb_test.h"
+#include "http_stats.h"
+
+TEST(LatencyHistogram, Buckets)
+{
+    using namespace nweb;
+
+    //small values are exact
+    for(uint64_t value = 0; value < LatencyHistogram::kSubBuckets; ++value)
+        EXPECT_EQ(value, LatencyHistogram::BucketLowerBound(LatencyHistogram::BucketOf(value)));
+
+    //a bucket holds values within 25% above its lower bound
+    const uint64_t values[] = {5, 7, 100, 1000, 123456, 60000000};
+    for(size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+    {
+        uint64_t lower = LatencyHistogram::BucketLowerBound(LatencyHistogram::BucketOf(values[i]));
+        EXPECT_LE(lower, values[i]);
+        EXPECT_GT(lower + lower / 4 + 1, values[i]);
+    }
+
+    //buckets are ordered
+    for(uint32_t i = 1; i < LatencyHistogram::kBucketCount; ++i)
+        EXPECT_LT(LatencyHistogram::BucketLowerBound(i - 1), LatencyHistogram::BucketLowerBound(i));
+}
+
+TEST(LatencyHistogram, Percentile)
+{
+    using namespace nweb;
+
+    LatencyHistogram histogram;
+    for(uint64_t i = 1; i <= 1000; ++i)
+        histogram.Record(i * 1000);
+
+    LatencyHistogram::Snapshot snapshot;
+    histogram.GetSnapshot(snapshot);
+    EXPECT_EQ(1000, snapshot.count);
+    EXPECT_EQ(1000000, snapshot.max);
+    EXPECT_EQ(500500, snapshot.Mean());
+    uint64_t median = snapshot.Percentile(50);
+    EXPECT_LE(median, 501000);
+    EXPECT_GT(median, 400000);
+    EXPECT_LE(snapshot.Percentile(99), 990000);
+    EXPECT_GT(snapshot.Percentile(99), 790000);
+}
+
+TEST(HttpStats, Record)
+{
+    using namespace nweb;
+
+    HttpStats stats;
+    //new connection with tls
+    HttpTiming fresh = {2000, 5000, 9000, 30000, 130000, 1, 100000, 200, true, false};
+    //kept alive connection, curl still reports a few microseconds
+    HttpTiming reused = {10, 40, 60, 10000, 20000, 0, 0, 200, false, true};
+    stats.Record(fresh);
+    stats.Record(reused);
+
+    HttpStats::Snapshot snapshot;
+    stats.GetSnapshot(snapshot);
+    EXPECT_EQ(2, snapshot.transfers);
+    EXPECT_EQ(1, snapshot.failures);
+    EXPECT_EQ(1, snapshot.reused);
+    EXPECT_EQ(1, snapshot.redirects);
+    EXPECT_EQ(100000, snapshot.in_bytes);
+    EXPECT_EQ(1, snapshot.name_lookup.count);
+    EXPECT_EQ(1, snapshot.connect.count);
+    EXPECT_EQ(1, snapshot.tls.count);
+    EXPECT_EQ(3000, snapshot.connect.max);
+    EXPECT_EQ(4000, snapshot.tls.max);
+    EXPECT_EQ(21000, snapshot.first_byte.max);
+    EXPECT_EQ(2, snapshot.total.count);
+    //100000 bytes in 0.1s
+    EXPECT_EQ(1000000, snapshot.throughput.max);
+}
+
+TEST(HttpStats, HostStatsBounded)
+{
+    using namespace nweb;
+
+    std::shared_ptr<HttpStats> held = HttpStats::ForHost("http://stats-test-held");
+    HttpTiming timing = {0, 0, 0, 0, 1000, 0, 0, 0, true, true};
+    held->Record(timing);
+
+    char origin[64] = {0};
+    for(uint32_t i = 0; i < HttpStats::kMaxHosts * 4; ++i)
+    {
+        sprintf_s(origin, "http://stats-test-%u", i);
+        HttpStats::ForHost(origin);
+    }
+    HttpStats::HostSnapshots snapshots;
+    HttpStats::GetHostSnapshots(snapshots);
+    size_t limit = HttpStats::kMaxHosts;
+    EXPECT_GE(limit, snapshots.size());
+
+    //stats a connection holds are never dropped
+    EXPECT_EQ(held, HttpStats::ForHost("http://stats-test-held"));
+    HttpStats::Snapshot snapshot;
+    held->GetSnapshot(snapshot);
+    EXPECT_EQ(1, snapshot.reused);
+}
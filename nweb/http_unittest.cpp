@@ -33,6 +33,20 @@ protected:
         const std::string& buffer() {return buffer_;}
     };
 
+    class RangesResponse : public nweb::HttpRangesResponse
+    {
+    private:
+        std::map<uint64_t, std::string> pieces_;
+    public:
+        virtual bool WriteRange(uint64_t position, const void * blob, size_t size)
+        {
+            pieces_[position].append(reinterpret_cast<const char*>(blob), size);
+            return true;
+        }
+
+        const std::map<uint64_t, std::string> & pieces() {return pieces_;}
+    };
+
     nweb::HttpConnection m_http_handler;
 };
 
@@ -110,4 +124,75 @@ TEST_F(HttpConnectionTestCase, AsyncDownloadingUrlFile)
     ASSERT_EQ(kConnOK, result) << "UrlFile error:" << result;
 }
 
+TEST_F(HttpConnectionTestCase, MultiRangeRequest)
+{
+    using namespace nweb;
+
+    const char * url = "http://192.168.4.15/apps/dungeon_siege_3.tar";
+
+    HttpRequest request;
+    HttpRanges ranges;
+    ranges.push_back(HttpRange(0, 100));
+    ranges.push_back(HttpRange(0x10000, 200));
+    ranges.push_back(HttpRange(0x20000, 300));
+    request.SetRanges(ranges);
+
+    RangesResponse response;
+    m_http_handler.SetUrl(url);
+    m_http_handler.SetRequestMethod(nweb::HttpRequestMethod::kGet);
+    m_http_handler.SetRequest(&request);
+    m_http_handler.SetResponse(&response);
+    HttpConnResult result = m_http_handler.Perform();
+
+    ASSERT_EQ(kConnOK, result) << "MultiRange error:" << result;
+    ASSERT_EQ(HttpRangesResponse::kFormMultipart, response.GetForm());
+    auto & pieces = response.pieces();
+    ASSERT_EQ(3, pieces.size());
+    for(size_t i = 0; i < ranges.size(); ++i)
+    {
+        auto iter = pieces.find(ranges[i].first());
+        ASSERT_TRUE(iter != pieces.end());
+        EXPECT_EQ(ranges[i].size(), iter->second.size());
+    }
+}
+
+TEST_F(HttpConnectionTestCase, SharedHeaderSetRange)
+{
+    using namespace nweb;
+
+    const char * url = "http://192.168.4.15/apps/dungeon_siege_3.tar";
+
+    HttpHeaderList common;
+    common.Set("Connection", "Keep-Alive");
+    common.Set("Accept-Encoding", "identity");
+    HttpHeaderSet header_set(common);
+    ASSERT_EQ(2, header_set.Count());
+
+    HttpRequest request;
+    request.SetHeaderSet(&header_set);
+    m_http_handler.SetUrl(url);
+    m_http_handler.SetRequestMethod(nweb::HttpRequestMethod::kGet);
+    m_http_handler.SetRequest(&request);
+
+    //only the range changes from request to request
+    for(uint64_t i = 0; i < 3; ++i)
+    {
+        TaskResponse response;
+        request.SetRange(HttpRange(i * 0x10000, 100));
+        m_http_handler.SetResponse(&response);
+        HttpConnResult result = m_http_handler.Perform();
+
+        ASSERT_EQ(kConnOK, result) << "Range error:" << result;
+        ASSERT_EQ(HttpStatusCode::kPartialContent, response.GetStatusCode());
+        EXPECT_EQ(100, response.buffer().size());
+    }
+
+    TaskResponse response;
+    request.ClearRange();
+    m_http_handler.SetRequestMethod(nweb::HttpRequestMethod::kHead);
+    m_http_handler.SetResponse(&response);
+    ASSERT_EQ(kConnOK, m_http_handler.Perform());
+    ASSERT_EQ(HttpStatusCode::kOK, response.GetStatusCode());
+}
+
 }
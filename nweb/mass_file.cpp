@@ -1,5 +1,8 @@
-﻿#include <windows.h>
+﻿#ifdef _WIN32
+#include <windows.h>
+#endif
 #include <assert.h>
+#include <string.h>
 #include <string>
 
 #include "mass_file.h"
@@ -14,9 +17,15 @@ const char * MassFile::kJournalExt = ".ns";
 
 MassFile::MassFile()
     : written_block_count_(0),
-      total_block_count_(0)
+      total_block_count_(0),
+      file_size_(0),
+      uncommitted_size_(0),
+      defer_validation_(false),
+      read_cursor_(0),
+      finished_(false)
 {
-    ;
+    durability_.block_count = 1;
+    durability_.interval = 0;
 }
 
 MassFile::~MassFile()
@@ -32,8 +41,9 @@ bool MassFile::Create(const char * file, uint64_t file_size)
     journal_path_ = file;
     journal_path_ += kJournalExt;
 
-    if(!file_.Open(file, true))
+    if(!file_.Open(file, true, !IsGroupCommit()))
         return false;
+    last_commit_ = std::chrono::steady_clock::now();
 
     if( !CreateJournal(journal_path_.data()) )
     {
@@ -88,8 +98,9 @@ bool MassFile::Open(const char * file)
     if(!BlockFile::IsFileExist(file))
         return false;
 
-    if( !file_.Open(file, false) ) 
+    if( !file_.Open(file, false, !IsGroupCommit()) ) 
         return false;//打开目标文件失败 
+    last_commit_ = std::chrono::steady_clock::now();
 
     if( !OpenJournal(journal_path_.data()) )
     { //日志文件打开失败 
@@ -122,15 +133,33 @@ bool MassFile::Open(const char * file)
 
 void MassFile::Close()
 {   
+    CommitProgress();//保存未提交的写入进度
     CloseJournal();//关闭日志
-    file_.Close();//关闭目标文件
+    {
+        std::lock_guard<std::mutex> guard(read_lock_);
+        file_.Close();//关闭目标文件
+        finished_ = false;
+        read_cursor_ = 0;
+    }
+    block_ready_.notify_all();
 }
 
 bool MassFile::Finish()
 {
+    //删除日志前确保数据落盘
+    CommitProgress();
+    {
+        std::lock_guard<std::mutex> guard(read_lock_);
+        finished_ = HasFinished();
+    }
     return RemoveJournal();
 }
 
+void MassFile::SetDurability(const Durability & durability)
+{
+    durability_ = durability;
+}
+
 uint32_t MassFile::GetBlockCount() const
 {
     return total_block_count_;
@@ -141,12 +170,23 @@ bool MassFile::IsBlockValid(uint32_t block_id) const
     uint32_t count  = GetBlockCount();
     if(count > block_id && journal_.IsValid())
     {
-        return journal_.GetBlockStatus(block_id);
+        return (journal_.GetBlockStatus(block_id) && 
+                !journal_.NeedsReverify(block_id)) || 
+               pending_blocks_.count(block_id) != 0;
     }
     return false;
 }
 
 bool MassFile::SaveBlock(uint32_t block_id, const void * blob, size_t size)
+{
+    if(!WriteBlockData(block_id, blob, size))
+        return false;
+    //更新日志, 数据落盘后才标记为有效
+    UpdateJournal(block_id);
+    return true;
+}
+
+bool MassFile::WriteBlockData(uint32_t block_id, const void * blob, size_t size)
 {
     uint64_t block_start = 0;
     size_t block_size = 0;
@@ -154,38 +194,261 @@ bool MassFile::SaveBlock(uint32_t block_id, const void * blob, size_t size)
     if(GetBlockInfo(block_id, block_start, block_size))
     {//获取blockInfo成功
         if(block_size == size)
+            bret = file_.Write(blob, static_cast<uint32_t>(size), block_start);
+    }
+    return bret;
+}
+
+bool MassFile::MarkBlockSaved(uint32_t block_id)
+{
+    if(block_id >= GetBlockCount())
+        return false;
+    if(IsBlockValid(block_id))
+        return true;
+
+    //绕过BlockFile的写入(如io_uring)会改变写入时间, 恢复为日志中的记录
+    int64_t last_modify = journal_.GetLastModify();
+    if(last_modify > 0)
+        file_.SetLastWriteTime(static_cast<time_t>(last_modify));
+    UpdateJournal(block_id);
+    return true;
+}
+
+intptr_t MassFile::GetNativeHandle() const
+{
+    return file_.GetNativeHandle();
+}
+
+bool MassFile::CloneBlockData(uint32_t block_id, const BlockFile & source)
+{
+    uint64_t block_start = 0;
+    size_t block_size = 0;
+    if(!GetBlockInfo(block_id, block_start, block_size))
+        return false;
+
+    uint64_t source_size = 0;
+    if(!source.GetSize64(source_size) || source_size != block_size)
+        return false;
+
+    return file_.CloneFrom(source, 0, block_start, block_size);
+}
+
+bool MassFile::WriteBlock(uint32_t block_id, uint32_t offset,
+                          const void * blob, size_t size)
+{
+    uint64_t block_start = 0;
+    size_t block_size = 0;
+    if(!GetBlockInfo(block_id, block_start, block_size))
+        return false;
+
+    if(offset > block_size || size > block_size - offset)
+        return false;
+
+    //块已完成(如重复下载的数据), 直接丢弃
+    if(IsBlockValid(block_id))
+        return true;
+
+    if(!file_.Write(blob, size, block_start + offset))
+        return false;
+
+    MergeFragment(block_id, offset, size);
+
+    uint32_t hole_offset = 0;
+    size_t hole_size = 0;
+    if(!GetBlockHole(block_id, hole_offset, hole_size) && !defer_validation_)
+    {//块已写满
+        UpdateJournal(block_id);
+        return true;
+    }
+
+    //等待校验时只记录写满的片段
+    uncommitted_size_ += size;
+    if(IsGroupCommit())
+    {//批量提交时进度随块一并落盘
+        if(IsCommitDue())
+            CommitProgress();
+    }
+    else if(uncommitted_size_ >= kCommitStep || 
+            !GetBlockHole(block_id, hole_offset, hole_size))
+    {
+        CommitProgress();
+    }
+    return true;
+}
+
+bool MassFile::GetBlockHole(uint32_t block_id, 
+                            uint32_t & offset, size_t & size) const
+{
+    uint64_t block_start = 0;
+    size_t block_size = 0;
+    if(!GetBlockInfo(block_id, block_start, block_size))
+        return false;
+
+    if(IsBlockValid(block_id))
+        return false;
+    //待重新校验的块数据完整
+    if(journal_.NeedsReverify(block_id))
+        return false;
+
+    //从块头开始, 跳过已写入的片段
+    uint32_t cursor = 0;
+    uint32_t next = static_cast<uint32_t>(block_size);
+    bool moved = true;
+    while(moved)
+    {
+        moved = false;
+        next = static_cast<uint32_t>(block_size);
+        for(size_t i = 0; i < fragments_.size(); ++i)
         {
-            bret = file_.Write(blob, size, block_start);
-            file_.Flush();
-            //设置content文件修改时间
-            file_.SetLastWriteTime();
-            //更新日志
-            UpdateJournal(block_id);
+            auto & fragment = fragments_[i];
+            if(fragment.block_id != block_id)
+                continue;
+            uint32_t end = fragment.offset + fragment.size;
+            if(fragment.offset <= cursor && end > cursor)
+            {
+                cursor = end;
+                moved = true;
+            }
+            else if(fragment.offset > cursor)
+            {
+                next = (std::min)(next, fragment.offset);
+            }
         }
     }
-    return bret;
+
+    if(cursor >= block_size)
+        return false;
+
+    offset = cursor;
+    size = next - cursor;
+    return true;
+}
+
+void MassFile::CommitProgress()
+{
+    if(!uncommitted_size_ && pending_blocks_.empty())
+        return;
+
+    if(!file_.IsValid() || !journal_.IsValid())
+        return;
+
+    GroupCommit();
+}
+
+void MassFile::DeferValidation(bool defer)
+{
+    defer_validation_ = defer;
+}
+
+bool MassFile::IsBlockFilled(uint32_t block_id) const
+{
+    uint64_t block_start = 0;
+    size_t block_size = 0;
+    if(!GetBlockInfo(block_id, block_start, block_size))
+        return false;
+    if(IsBlockValid(block_id))
+        return false;
+
+    uint32_t hole_offset = 0;
+    size_t hole_size = 0;
+    return !GetBlockHole(block_id, hole_offset, hole_size);
+}
+
+bool MassFile::CommitBlock(uint32_t block_id)
+{
+    if(IsBlockValid(block_id))
+        return true;
+    if(!IsBlockFilled(block_id))
+        return false;
+
+    if(journal_.NeedsReverify(block_id))
+    {//数据早已落盘, 清除待校验标记即可
+        {
+            std::lock_guard<std::mutex> guard(read_lock_);
+            journal_.UpdateBlockStatus(block_id, true);
+        }
+        block_ready_.notify_all();
+        written_block_count_++;
+        CommitJournal();
+        return true;
+    }
+    UpdateJournal(block_id);
+    return true;
+}
+
+void MassFile::DiscardBlock(uint32_t block_id)
+{
+    if(!file_.IsValid() || !journal_.IsValid())
+        return;
+    if(IsBlockValid(block_id))
+        return;
+
+    if(journal_.NeedsReverify(block_id))
+    {//重新校验失败, 有效位一并清除
+        std::lock_guard<std::mutex> guard(read_lock_);
+        journal_.UpdateBlockStatus(block_id, false);
+    }
+    RemoveFragments(block_id);
+    GroupCommit();
+}
+
+uint32_t MassFile::ReopenBlocks()
+{
+    if(!file_.IsValid() || !journal_.IsValid())
+        return 0;
+
+    //待提交的块先落盘, 之后只需处理日志中的位图
+    GroupCommit();
+    uint32_t reopened = 0;
+    {//有效位保留, 校验结束前中断也不会丢失已下载的块
+        std::lock_guard<std::mutex> guard(read_lock_);
+        reopened = journal_.BeginReverify();
+    }
+    written_block_count_ -= reopened;
+    CommitJournal();
+    return reopened;
+}
+
+void MassFile::SetValidator(const std::string & etag, int64_t last_modified)
+{
+    if(!journal_.IsValid())
+        return;
+
+    journal_.UpdateValidator(etag, last_modified);
+    CommitJournal();
+}
+
+void MassFile::GetValidator(std::string & etag, int64_t & last_modified) const
+{
+    etag = journal_.GetETag();
+    last_modified = journal_.GetOriginModified();
+}
+
+bool MassFile::ReadBlock(uint32_t block_id, void * blob, size_t size) const
+{
+    uint64_t block_start = 0;
+    size_t block_size = 0;
+    if(!GetBlockInfo(block_id, block_start, block_size))
+        return false;
+    if(size != block_size)
+        return false;
+    return file_.Read(blob, static_cast<uint32_t>(size), block_start);
 }
 
 bool MassFile::GetBlockInfo(uint32_t block_id, 
                             uint64_t & start, size_t & size)const
 {
     bool bret = false;
-    uint64_t file_size = 0;
-    if(journal_.IsValid())
+    uint32_t count = GetBlockCount();
+    if(count > 0 && block_id < count)
     {
-        file_size = journal_.GetFileSize();
-
-        uint32_t count = GetBlockCount();
-        if(count > 0 && block_id < count)
+        bret = true;
+        uint64_t block_id64 = block_id;
+        start = block_id64 * kMaxBlockSize;
+        size = kMaxBlockSize;
+        if(count - 1 == block_id && file_size_ % kMaxBlockSize)
         {
-            bret = true;
-            uint64_t block_id64 = block_id;
-            start = block_id64 * kMaxBlockSize;
-            size = kMaxBlockSize;
-            if(count - 1 == block_id && file_size % kMaxBlockSize)
-            {
-                size = file_size % kMaxBlockSize;
-            }
+            size = static_cast<size_t>(file_size_ % kMaxBlockSize);
         }
     }
     //assert(bret);
@@ -199,7 +462,7 @@ uint32_t MassFile::GetBlockId(uint64_t  start, size_t  size) const
     if(block_count > 0)
     {
         uint64_t every_start = 0;
-        uint32_t every_size = 0;
+        size_t every_size = 0;
         for(uint32_t i = 0; i < block_count; ++i)
         {
             if(GetBlockInfo(i, every_start, every_size))
@@ -210,17 +473,80 @@ uint32_t MassFile::GetBlockId(uint64_t  start, size_t  size) const
     return kInvalidBlockId;
 }
 
+uint32_t MassFile::FindBlock(uint64_t offset) const
+{
+    uint64_t block_id = offset / kMaxBlockSize;
+    if(block_id >= GetBlockCount())
+        return kInvalidBlockId;
+    return static_cast<uint32_t>(block_id);
+}
+
+bool MassFile::Read(uint64_t offset, void * blob, size_t size, uint32_t timeout)
+{
+    if(static_cast<uint64_t>(size) > UINT32_MAX)
+        return false;
+
+    read_cursor_ = offset;
+    auto deadline = std::chrono::steady_clock::now() + 
+                    std::chrono::milliseconds(timeout);
+    std::unique_lock<std::mutex> guard(read_lock_);
+    while(!IsRangeReady(offset, size))
+    {
+        if(!file_.IsValid() || finished_ || !timeout)
+            return false;
+        if(timeout == -1)
+            block_ready_.wait(guard);
+        else if(block_ready_.wait_until(guard, deadline) == std::cv_status::timeout)
+            if(!IsRangeReady(offset, size))
+                return false;
+    }
+    //有效块不会再被写入, 读磁盘时不必持有锁
+    guard.unlock();
+    return file_.Read(blob, static_cast<uint32_t>(size), offset);
+}
+
+uint64_t MassFile::GetReadCursor() const
+{
+    return read_cursor_;
+}
+
+bool MassFile::IsRangeReady(uint64_t offset, size_t size) const
+{
+    if(!file_.IsValid())
+        return false;
+
+    uint64_t file_size = 0;
+    if(!file_.GetSize64(file_size))
+        return false;
+    if(offset > file_size || size > file_size - offset)
+        return false;
+    if(finished_ || !size)
+        return true;
+
+    uint64_t first = offset / kMaxBlockSize;
+    uint64_t last = (offset + size - 1) / kMaxBlockSize;
+    for(uint64_t block_id = first; block_id <= last; ++block_id)
+    {
+        if(!IsBlockValid(static_cast<uint32_t>(block_id)))
+            return false;
+    }
+    return true;
+}
+
 uint64_t MassFile::GetWrittenSize() const
 {
-    if(0 == written_block_count_)
-        return 0;
+    //待重新校验的块数据完整, 同样计入
+    uint32_t full_count = written_block_count_ + journal_.GetReverifyCount();
+    if(0 == full_count)
+        return GetFragmentSize();
 
-    uint64_t written_size = 0; 
+    uint64_t written_size = GetFragmentSize(); 
     uint32_t block_count = GetBlockCount();
     if(block_count > 0)
     {
-        written_size = (written_block_count_ - 1) * kMaxBlockSize;
-        if( IsBlockValid(block_count - 1) )
+        written_size += static_cast<uint64_t>(full_count - 1) * kMaxBlockSize;
+        if( IsBlockValid(block_count - 1) || 
+            journal_.NeedsReverify(block_count - 1) )
         {
             uint64_t start = 0;
             size_t size = 0;
@@ -256,20 +582,17 @@ bool MassFile::HasFinished() const
 void MassFile::UpdateDownloadedCount()
 {
     UpdateBlockCount();
+    //有效块数记录在日志中, 不再扫描位图, 待重新校验的块不计入
     written_block_count_ = 0;
-    uint32_t count = GetBlockCount();
-    for(uint32_t i  = 0; i < count; ++i)
-    {
-        if(IsBlockValid(i))
-        {
-            written_block_count_ ++;
-        }
-    }
+    if(journal_.GetBlockCount() == GetBlockCount())
+        written_block_count_ = journal_.GetValidCount() - journal_.GetReverifyCount();
+    LoadFragments();
 }
 
 void MassFile::UpdateBlockCount()
 {
     total_block_count_ = 0;
+    file_size_ = 0;
     uint64_t file_size = 0;
     if(file_.GetSize64(file_size) )
     {
@@ -278,7 +601,10 @@ void MassFile::UpdateBlockCount()
             count64++;
 
         if(count64 <= kMaxBlockCount)
+        {
+            file_size_ = file_size;
             total_block_count_ = static_cast<uint32_t>(count64);
+        }
     }    
 }
 
@@ -317,9 +643,16 @@ bool MassFile::OpenJournal(const char * file)
 
 void MassFile::CloseJournal()
 {
-    journal_.Close();
+    {
+        std::lock_guard<std::mutex> guard(read_lock_);
+        journal_.Close();
+        pending_blocks_.clear();
+        total_block_count_ = 0;
+        file_size_ = 0;
+    }
     written_block_count_ = 0;
-    total_block_count_ = 0;
+    fragments_.clear();
+    uncommitted_size_ = 0;
 }
 
 bool MassFile::ResetJournal()
@@ -327,12 +660,16 @@ bool MassFile::ResetJournal()
     bool bret = false;
     if(file_.IsValid() && journal_.IsValid())
     {
-        journal_.Reset();
+        fragments_.clear();
+        uncommitted_size_ = 0;
         uint64_t file_size = 0;
-        //写入目标文件大小
-        bret = file_.GetSize64(file_size);
-        if(bret)
-            journal_.UpdateFileSize(file_size);
+        //按目标文件大小重建日志, 位图长度随之变化
+        if(file_.GetSize64(file_size))
+        {
+            std::lock_guard<std::mutex> guard(read_lock_);
+            pending_blocks_.clear();
+            bret = journal_.Reset(file_size);
+        }
         //重置后 未进行下载 写入CRC32和 last_modify无意义
     }
     return bret;
@@ -372,22 +709,159 @@ void MassFile::UpdateJournal(uint32_t block_id)
         assert(0);
         return;
     }
-    journal_.UpdateBlockStatus(block_id, true);
+    {//数据可能尚未落盘, 先记为待提交, 进程内的读取不受影响
+        std::lock_guard<std::mutex> guard(read_lock_);
+        //待重新校验的块被新数据覆盖, 落盘前不再视为有效
+        if(journal_.NeedsReverify(block_id))
+            journal_.UpdateBlockStatus(block_id, false);
+        pending_blocks_.insert(block_id);
+    }
+    block_ready_.notify_all();
+    RemoveFragments(block_id);
+    //已写入计数器+1
+    written_block_count_++;
+    if(IsCommitDue())
+        GroupCommit();
+}
+
+void MassFile::GroupCommit()
+{
+    //数据落盘后才在日志中标记为有效
+    file_.Flush();
+    //设置content文件修改时间
+    file_.SetLastWriteTime();
+    {
+        std::lock_guard<std::mutex> guard(read_lock_);
+        for(auto it = pending_blocks_.begin(); it != pending_blocks_.end(); ++it)
+        {
+            journal_.UpdateBlockStatus(*it, true);
+            //完成的块已落盘, 不再占用系统缓存
+            uint64_t block_start = 0;
+            size_t block_size = 0;
+            if(GetBlockInfo(*it, block_start, block_size))
+                file_.DropCache(block_start, block_size);
+        }
+        pending_blocks_.clear();
+    }
+    CommitJournal();
+    last_commit_ = std::chrono::steady_clock::now();
+}
+
+bool MassFile::IsGroupCommit() const
+{
+    return durability_.block_count != 1 && 
+           (durability_.block_count || durability_.interval);
+}
+
+bool MassFile::IsCommitDue() const
+{
+    if(!IsGroupCommit())
+        return true;
+
+    if(durability_.block_count && 
+       pending_blocks_.size() >= durability_.block_count)
+        return true;
+
+    if(durability_.interval)
+    {
+        auto elapsed = std::chrono::steady_clock::now() - last_commit_;
+        if(elapsed >= std::chrono::milliseconds(durability_.interval))
+            return true;
+    }
+    return false;
+}
 
+void MassFile::CommitJournal()
+{
+    //未完成块的进度一并写入, 超出日志容量的部分在重启后需重新下载
+    uint32_t count = static_cast<uint32_t>(fragments_.size());
+    count = (std::min)(count, static_cast<uint32_t>(Journal::kMaxFragmentCount));
+    journal_.UpdateFragments(count ? &fragments_[0] : 0, count);
     //设置写入时间
     int64_t file_time = 0;
     file_.GetLastWriteTime(file_time);
     journal_.UpdateLastModify(file_time);
     journal_.UpdateCrc();
     journal_.Flush();
-    //已写入计数器+1
-    written_block_count_++;
+    uncommitted_size_ = 0;
+}
+
+void MassFile::LoadFragments()
+{
+    fragments_.clear();
+    uncommitted_size_ = 0;
+
+    Journal::Fragment loaded[Journal::kMaxFragmentCount];
+    uint32_t count = journal_.GetFragments(loaded, Journal::kMaxFragmentCount);
+    for(uint32_t i = 0; i < count; ++i)
+    {
+        auto & fragment = loaded[i];
+        uint64_t block_start = 0;
+        size_t block_size = 0;
+        if(!GetBlockInfo(fragment.block_id, block_start, block_size))
+            continue;
+        if(IsBlockValid(fragment.block_id))
+            continue;
+        if(fragment.offset > block_size || 
+           fragment.size > block_size - fragment.offset)
+            continue;
+        MergeFragment(fragment.block_id, fragment.offset, fragment.size);
+    }
+}
+
+void MassFile::MergeFragment(uint32_t block_id, uint32_t offset, uint32_t size)
+{
+    if(!size)
+        return;
+
+    uint32_t first = offset;
+    uint32_t last = offset + size;
+    //合并所有重叠或相邻的片段
+    for(size_t i = 0; i < fragments_.size();)
+    {
+        auto & fragment = fragments_[i];
+        uint32_t end = fragment.offset + fragment.size;
+        if(fragment.block_id == block_id && 
+           fragment.offset <= last && end >= first)
+        {
+            first = (std::min)(first, fragment.offset);
+            last = (std::max)(last, end);
+            fragments_.erase(fragments_.begin() + i);
+            continue;
+        }
+        ++i;
+    }
+
+    Journal::Fragment merged = {block_id, first, last - first, 0};
+    fragments_.push_back(merged);
+}
+
+void MassFile::RemoveFragments(uint32_t block_id)
+{
+    for(size_t i = 0; i < fragments_.size();)
+    {
+        if(fragments_[i].block_id == block_id)
+        {
+            fragments_.erase(fragments_.begin() + i);
+            continue;
+        }
+        ++i;
+    }
+}
+
+uint64_t MassFile::GetFragmentSize() const
+{
+    uint64_t size = 0;
+    for(size_t i = 0; i < fragments_.size(); ++i)
+        size += fragments_[i].size;
+    return size;
 }
 
 MassFile::Journal::Journal()
-    :data_(0)
+    :data_(0), size_(0)
 {
-    ;
+    static_assert(sizeof(Data) == kHeaderSize, "journal header size changed");
+    static_assert(sizeof(LegacyData) == kLegacySize, "legacy journal size changed");
 }
 
 MassFile::Journal::~Journal()
@@ -397,28 +871,27 @@ MassFile::Journal::~Journal()
 
 bool MassFile::Journal::Create(const char * journal_path)
 {
+    Close();
+    path_ = journal_path;
+
     BlockFile file_journal;
     if(!file_journal.Open(journal_path, true))
         return false;
+    file_journal.Close();
 
-    //创建日志文件成功
-    if(!file_journal.SetSize64(Journal::kExptectSize))
-    {//设置日志大小失败 则关闭文件并删除
-        file_journal.Close();
+    //空文件的日志只有头部
+    if(!Map(GetExpectSize(0, false)))
+    {
         BlockFile::RemoveFile(journal_path);
         return false;
     }
-
-    //改变日志大小成功 进行文件映射
-    if (void * p = BlockFile::OpenMapping(file_journal))
-        data_ = reinterpret_cast<Data*>(p);
-
-    file_journal.Close();
-    return Reset();
+    return Reset(0);
 }
 
 bool MassFile::Journal::Open(const char * journal_path)
 {
+    Close();
+
     //文件不存在 返回false
     if(!BlockFile::IsFileExist(journal_path))
         return false;
@@ -435,12 +908,12 @@ bool MassFile::Journal::Open(const char * journal_path)
         return false;
     }
 
-    if( Journal::kExptectSize != journal_size)
+    if(journal_size < kHeaderSize)
     {
         file_journal.Close();
         return false;
     }
-    //日志文件大小验证合格 使用FileMaping打开文件
+    //日志文件大小初步合格 使用FileMaping打开文件
     void * p = BlockFile::OpenMapping(file_journal);
     if(!p)
     {
@@ -449,13 +922,20 @@ bool MassFile::Journal::Open(const char * journal_path)
     }
 
     data_ = reinterpret_cast<Data *>(p);
+    size_ = journal_size;
+    path_ = journal_path;
     //关闭文件句柄
     file_journal.Close();
 
-    if(!Validate())
+    bool bret = false;
+    if(data_->head.magic == kLegacyMagic)
+        bret = Migrate();
+    else
+        bret = Validate();
+
+    if(!bret)
     {
-        BlockFile::CloseMapping(data_);
-        data_ = 0;
+        Close();
         return false;
     }
     return true;
@@ -465,19 +945,34 @@ void MassFile::Journal::Close()
 {
     if(data_)
     {        
-        BlockFile::CloseMapping(data_);
+        BlockFile::CloseMapping(data_, size_);
         data_ = 0;
     }
+    size_ = 0;
 }
 
 
-bool MassFile::Journal::Reset()
+bool MassFile::Journal::Reset(uint64_t file_size)
 {
     if(!data_)
         return false;
-    memset(data_, 0, sizeof(Journal));
+
+    uint64_t count64 = file_size / kMaxBlockSize;
+    if(file_size % kMaxBlockSize)
+        count64++;
+    if(count64 > kMaxBlockCount)
+        return false;
+
+    uint32_t block_count = static_cast<uint32_t>(count64);
+    if(!Map(GetExpectSize(block_count, false)))
+        return false;
+
+    memset(data_, 0, static_cast<size_t>(size_));
     //写入标志
     data_->head.magic = Journal::kMagic;
+    data_->body.file_size = file_size;
+    data_->body.block_size = kMaxBlockSize;
+    data_->body.block_count = block_count;
     return true;
 }
 
@@ -489,8 +984,30 @@ bool MassFile::Journal::Validate()
     if(data_->head.magic != Journal::kMagic)
         return false;
 
+    //块大小不同的日志暂不支持, 重新下载
+    if(data_->body.block_size != kMaxBlockSize)
+        return false;
+
+    uint64_t count64 = data_->body.file_size / kMaxBlockSize;
+    if(data_->body.file_size % kMaxBlockSize)
+        count64++;
+    if(count64 != data_->body.block_count)
+        return false;
+
+    //日志文件只会变长, 可以长于所需
+    bool reverify = data_->body.reverify_count != 0;
+    if(size_ < GetExpectSize(data_->body.block_count, reverify))
+        return false;
+
+    if(data_->body.valid_count > data_->body.block_count)
+        return false;
+
+    if(data_->body.reverify_count > data_->body.valid_count)
+        return false;
+
     //标志合格
-    uint32_t hash = crc32(0xffffffff, &data_->body, sizeof(data_->body));
+    uint32_t body_size = static_cast<uint32_t>(size_ - sizeof(data_->head));
+    uint32_t hash = crc32(0xffffffff, &data_->body, body_size);
     if(hash == data_->head.crc32)
     {//CRC32验证通过
         return true;
@@ -506,7 +1023,7 @@ bool MassFile::Journal::IsValid() const
 void MassFile::Journal::Flush()
 {
     if(data_)
-        BlockFile::FlushMapping(data_, Journal::kExptectSize);
+        BlockFile::FlushMapping(data_, static_cast<int32_t>(size_));
 }
 
 int64_t MassFile::Journal::GetLastModify() const
@@ -523,42 +1040,257 @@ uint64_t MassFile::Journal::GetFileSize() const
     return -1;
 }
 
+uint32_t MassFile::Journal::GetBlockCount() const
+{
+    if(data_)
+        return data_->body.block_count;
+    return 0;
+}
+
+uint32_t MassFile::Journal::GetValidCount() const
+{
+    if(data_)
+        return data_->body.valid_count;
+    return 0;
+}
+
 bool MassFile::Journal::GetBlockStatus(uint32_t block_id) const
 {
-    if(!data_)
+    if(!data_ || block_id >= data_->body.block_count)
         return false;
 
-    int index = block_id / 8;
-    int bit_index = block_id % 8;
-    return ( data_->body.block_status[index] >> bit_index ) & 0x1;
+    uint32_t index = block_id / 8;
+    uint32_t bit_index = block_id % 8;
+    return ( GetBitmap()[index] >> bit_index ) & 0x1;
 }
 
-void MassFile::Journal::UpdateFileSize(uint64_t file_size)
+void MassFile::Journal::UpdateLastModify(int64_t last_modify)
 {
     if(data_)
-        data_->body.file_size = file_size;
+        data_->body.last_modify = last_modify;
 }
 
-void MassFile::Journal::UpdateLastModify(int64_t last_modify)
+std::string MassFile::Journal::GetETag() const
+{
+    std::string etag;
+    if(data_ && data_->body.etag_size <= kMaxETagSize)
+        etag.assign(data_->body.etag, data_->body.etag_size);
+    return etag;
+}
+
+int64_t MassFile::Journal::GetOriginModified() const
 {
     if(data_)
-        data_->body.last_modify = last_modify;
+        return data_->body.origin_modified;
+    return 0;
+}
+
+void MassFile::Journal::UpdateValidator(const std::string & etag, 
+                                        int64_t origin_modified)
+{
+    if(!data_)
+        return;
+
+    memset(data_->body.etag, 0, sizeof(data_->body.etag));
+    data_->body.etag_size = 0;
+    if(etag.size() <= kMaxETagSize)
+    {
+        memcpy(data_->body.etag, etag.data(), etag.size());
+        data_->body.etag_size = static_cast<uint32_t>(etag.size());
+    }
+    data_->body.origin_modified = origin_modified;
 }
 
 void MassFile::Journal::UpdateBlockStatus(uint32_t block_id, bool valid)
 {
-    int byte_index = block_id / 8;
-    int bit_index = block_id % 8;
-    uint8_t value = valid ? 1 : 0;
+    if(!data_ || block_id >= data_->body.block_count)
+        return;
+
+    uint32_t byte_index = block_id / 8;
+    uint8_t mask = static_cast<uint8_t>(1 << (block_id % 8));
+    if(NeedsReverify(block_id))
+    {
+        GetReverifyBitmap()[byte_index] &= ~mask;
+        data_->body.reverify_count--;
+    }
+
+    uint8_t & status = GetBitmap()[byte_index];
+    if(valid == ((status & mask) != 0))
+        return;
+
+    if(valid)
+    {
+        status |= mask;
+        data_->body.valid_count++;
+    }
+    else
+    {
+        status &= ~mask;
+        data_->body.valid_count--;
+    }
+}
+
+uint32_t MassFile::Journal::GetReverifyCount() const
+{
     if(data_)
-        data_->body.block_status[byte_index] |= (value << bit_index);
+        return data_->body.reverify_count;
+    return 0;
+}
+
+bool MassFile::Journal::NeedsReverify(uint32_t block_id) const
+{
+    if(!data_ || !data_->body.reverify_count || block_id >= data_->body.block_count)
+        return false;
+
+    uint32_t index = block_id / 8;
+    uint32_t bit_index = block_id % 8;
+    return ( GetReverifyBitmap()[index] >> bit_index ) & 0x1;
+}
+
+uint32_t MassFile::Journal::BeginReverify()
+{
+    if(!data_ || !data_->body.valid_count)
+        return 0;
+
+    uint32_t block_count = data_->body.block_count;
+    size_t bitmap_size = (static_cast<size_t>(block_count) + 7) / 8;
+    if(!data_->body.reverify_count)
+    {//待校验位图中可能留有上次校验的内容
+        if(!Map(GetExpectSize(block_count, true)))
+            return 0;
+        memset(GetReverifyBitmap(), 0, bitmap_size);
+    }
+
+    uint32_t marked = 0;
+    for(uint32_t i = 0; i < block_count; ++i)
+    {
+        if(GetBlockStatus(i) && !NeedsReverify(i))
+        {
+            GetReverifyBitmap()[i / 8] |= static_cast<uint8_t>(1 << (i % 8));
+            data_->body.reverify_count++;
+            marked++;
+        }
+    }
+    return marked;
+}
+
+uint32_t MassFile::Journal::GetFragments(Fragment * fragments, 
+                                         uint32_t count) const
+{
+    if(!data_ || !fragments)
+        return 0;
+
+    uint32_t found = 0;
+    for(uint32_t i = 0; i < kMaxFragmentCount && found < count; ++i)
+    {
+        if(data_->body.fragments[i].size)
+            fragments[found++] = data_->body.fragments[i];
+    }
+    return found;
+}
+
+void MassFile::Journal::UpdateFragments(const Fragment * fragments, 
+                                        uint32_t count)
+{
+    if(!data_)
+        return;
+
+    memset(data_->body.fragments, 0, sizeof(data_->body.fragments));
+    count = (std::min)(count, static_cast<uint32_t>(kMaxFragmentCount));
+    for(uint32_t i = 0; i < count; ++i)
+        data_->body.fragments[i] = fragments[i];
 }
 
 void MassFile::Journal::UpdateCrc()
 {
     if(!data_)
         return;
-    data_->head.crc32 = crc32(0xffffffff, &data_->body, sizeof(data_->body));
+    uint32_t body_size = static_cast<uint32_t>(size_ - sizeof(data_->head));
+    data_->head.crc32 = crc32(0xffffffff, &data_->body, body_size);
+}
+
+bool MassFile::Journal::Map(uint64_t size)
+{
+    if(data_ && size_ >= size)
+        return true;
+
+    BlockFile file_journal;
+    if(!file_journal.Open(path_.data(), false))
+        return false;
+
+    //已映射的文件不能截短, 但可以加长
+    if(!file_journal.SetSize64(size))
+        return false;
+
+    void * p = BlockFile::OpenMapping(file_journal);
+    if(!p)
+    {//恢复原来的长度, 日志的CRC仍按原有映射计算
+        if(data_)
+            file_journal.SetSize64(size_);
+        return false;
+    }
+
+    //新的映射可用之后才释放原有映射
+    if(data_)
+        BlockFile::CloseMapping(data_, size_);
+    data_ = reinterpret_cast<Data *>(p);
+    size_ = size;
+    return true;
+}
+
+bool MassFile::Journal::Migrate()
+{
+    if(size_ != kLegacySize)
+        return false;
+
+    //先复制旧日志, 重新映射后原内容不再可用
+    LegacyData legacy;
+    memcpy(&legacy, data_, sizeof(LegacyData));
+
+    uint32_t hash = crc32(0xffffffff, &legacy.body, sizeof(legacy.body));
+    if(hash != legacy.head.crc32)
+        return false;
+
+    uint64_t file_size = legacy.body.file_size;
+    uint64_t count64 = file_size / kMaxBlockSize;
+    if(file_size % kMaxBlockSize)
+        count64++;
+    if(count64 > kLegacyMaxBlockCount)
+        return false;
+
+    if(!Reset(file_size))
+        return false;
+
+    //逐位复制, 同时统计有效块数
+    uint32_t block_count = data_->body.block_count;
+    for(uint32_t i = 0; i < block_count; ++i)
+    {
+        if((legacy.body.block_status[i / 8] >> (i % 8)) & 0x1)
+            UpdateBlockStatus(i, true);
+    }
+    memcpy(data_->body.fragments, legacy.body.fragments, 
+           sizeof(data_->body.fragments));
+    //保留最近写入时间, 目标文件的校验照常进行
+    data_->body.last_modify = legacy.body.last_modify;
+    UpdateCrc();
+    Flush();
+    return true;
+}
+
+uint8_t * MassFile::Journal::GetBitmap() const
+{
+    return reinterpret_cast<uint8_t *>(data_ + 1);
+}
+
+uint8_t * MassFile::Journal::GetReverifyBitmap() const
+{
+    return GetBitmap() + (static_cast<size_t>(data_->body.block_count) + 7) / 8;
+}
+
+uint64_t MassFile::Journal::GetExpectSize(uint32_t block_count, bool reverify)
+{
+    uint64_t bitmap_size = (static_cast<uint64_t>(block_count) + 7) / 8;
+    return kHeaderSize + (reverify ? bitmap_size * 2 : bitmap_size);
 }
 
 }
\ No newline at end of file
@@ -1,7 +1,13 @@
 ﻿#ifndef NWEB_MASS_FILE_H_
 #define NWEB_MASS_FILE_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <queue>
+#include <unordered_set>
+#include <vector>
 #include "block_file.h"
 
 
@@ -14,9 +20,24 @@ class MassFile
 {
 private:
     //日志文件的结构
+    //定长的头部之后是块状态位图, 位图长度随块数变化
+    //有块待重新校验时, 其后再跟一个同样长度的待校验位图
+    //日志文件只会变长, 超出的部分不使用
     class Journal
     {
     public:
+        static const uint32_t kMaxFragmentCount = 48;
+        //日志中可保存的最长ETag, 包括引号
+        static const uint32_t kMaxETagSize = 192;
+        //块内已连续写入的区间 [offset, offset + size), size为0表示未使用
+        struct Fragment
+        {
+            uint32_t block_id;
+            uint32_t offset;
+            uint32_t size;
+            uint32_t reserve;
+        };
+
         struct Data
         {
             struct
@@ -29,7 +50,38 @@ private:
             {
                 uint64_t file_size;
                 int64_t last_modify;
-                uint64_t reserve[125];
+                uint32_t block_size;
+                uint32_t block_count;
+                //已有效的块数, 打开时不必扫描位图
+                uint32_t valid_count;
+                //有效但待重新校验的块数, 为0时不使用待校验位图
+                uint32_t reverify_count;
+                //源文件的校验器, 见MassFile::SetValidator
+                int64_t origin_modified;
+                uint32_t etag_size;
+                uint32_t reserve_etag;
+                char etag[kMaxETagSize];
+                uint64_t reserve[1];
+                Fragment fragments[kMaxFragmentCount];
+                //uint8_t block_status[(block_count + 7) / 8]紧随其后
+            } body;
+        };
+
+        //旧版(NS00)日志, 位图定长, 最多0x1800块
+        struct LegacyData
+        {
+            struct
+            {
+                uint32_t magic;
+                uint32_t crc32;
+            } head;
+
+            struct
+            {
+                uint64_t file_size;
+                int64_t last_modify;
+                uint64_t reserve[29];
+                Fragment fragments[kMaxFragmentCount];
                 uint8_t block_status[3072];
             } body;
         };
@@ -39,12 +91,12 @@ private:
         ~Journal();
 
         bool Create(const char * journal_path);
-        //打开日志
+        //打开日志, 旧版日志转换为当前格式
         bool Open(const char * journal_path);
         //关闭日志
         void Close();
-        //重置日志
-        bool Reset();
+        //重置日志, 位图按文件大小重新分配
+        bool Reset(uint64_t file_size);
         //检查日志
         bool Validate();
 
@@ -54,26 +106,72 @@ private:
 
         uint64_t GetFileSize() const ;
 
+        uint32_t GetBlockCount() const;
+
+        uint32_t GetValidCount() const;
+
         bool GetBlockStatus(uint32_t block_id)const ;
 
-        void UpdateFileSize(uint64_t file_size);
-        
         void UpdateLastModify(int64_t last_modify);
 
+        std::string GetETag() const;
+
+        int64_t GetOriginModified() const;
+
+        void UpdateValidator(const std::string & etag, int64_t origin_modified);
+
+        //同时清除块的待校验标记
         void UpdateBlockStatus(uint32_t block_id, bool valid);
 
+        uint32_t GetReverifyCount() const;
+
+        bool NeedsReverify(uint32_t block_id) const;
+        //所有有效的块记为待校验, 有效位保留, 返回新记入的块数
+        uint32_t BeginReverify();
+
+        uint32_t GetFragments(Fragment * fragments, uint32_t count) const;
+
+        void UpdateFragments(const Fragment * fragments, uint32_t count);
+
         void UpdateCrc();
 
         void Flush();
+    private:
+        //日志文件不足指定大小时加长并重新映射, 原有内容保留
+        //新的映射成功之前原有映射保持可用, 失败时日志仍然有效
+        bool Map(uint64_t size);
+        //把已映射的旧版日志转换为当前格式
+        bool Migrate();
+
+        uint8_t * GetBitmap() const;
+
+        uint8_t * GetReverifyBitmap() const;
+
+        static uint64_t GetExpectSize(uint32_t block_count, bool reverify);
     private:
         Data * data_;
+        uint64_t size_;
+        std::string path_;
     private:
-        static const uint32_t kMagic = 0x30304e53;//NS00
-        static const uint32_t kExptectSize = 4096;
+        static const uint32_t kMagic = 0x31304e53;//NS01
+        static const uint32_t kHeaderSize = 1024;
+        static const uint32_t kLegacyMagic = 0x30304e53;//NS00
+        static const uint32_t kLegacySize = 4096;
+        static const uint32_t kLegacyMaxBlockCount = 0x1800;
     };
 
 public:
     static const uint32_t kInvalidBlockId = -1;
+
+    //块数据和日志的落盘策略
+    //写满的块先记在内存中, 数据落盘后才在日志中标记为有效,
+    //每累积block_count个块或距上次提交超过interval(ms)时统一落盘一次
+    //block_count为0表示不按块数, interval为0表示不按时间, 均为0时等同于逐块提交
+    struct Durability
+    {
+        uint32_t block_count;
+        uint32_t interval;
+    };
 public:
     MassFile();
 
@@ -90,12 +188,59 @@ public:
     void Close();
 
     bool Finish();//下载完成后删除日志文件
+    //默认逐块提交, 需在Create/Open之前设置
+    //批量提交时目标文件不再以write through方式打开
+    void SetDurability(const Durability & durability);
     //block_id [0, count)
     uint32_t GetBlockCount() const;
     bool IsBlockValid(uint32_t block_id) const;
     bool SaveBlock(uint32_t block_id, const void * blob, size_t size);
+    //SaveBlock的两个步骤, 供后台写入使用(见BlockWriter)
+    //只写入整块数据, 不读取也不更新日志, 日志重新映射时也可在其他线程调用
+    bool WriteBlockData(uint32_t block_id, const void * blob, size_t size);
+    //WriteBlockData完成后在下载线程把块记入日志
+    bool MarkBlockSaved(uint32_t block_id);
+    //目标文件的系统句柄
+    intptr_t GetNativeHandle() const;
+    //与source共享整块数据(reflink), 不更新日志, 可在其他线程调用
+    //文件系统不支持时返回false, 成功后同样由MarkBlockSaved记入日志
+    bool CloneBlockData(uint32_t block_id, const BlockFile & source);
+    //流式写入块内[offset, offset + size), 块写满后标记为有效
+    bool WriteBlock(uint32_t block_id, uint32_t offset, 
+                    const void * blob, size_t size);
+    //块内第一个未写入的区间, 块已有效时返回false
+    bool GetBlockHole(uint32_t block_id, uint32_t & offset, size_t & size) const;
+    //将流式写入的进度和尚未落盘的块提交到日志
+    void CommitProgress();
+    //写满的块不立即标记为有效, 由调用者校验后CommitBlock
+    void DeferValidation(bool defer);
+    //块已写满但尚未标记为有效
+    bool IsBlockFilled(uint32_t block_id) const;
+    //把写满的块标记为有效
+    bool CommitBlock(uint32_t block_id);
+    //丢弃块内已写入的数据, 块需重新下载
+    void DiscardBlock(uint32_t block_id);
+    //把所有有效的块退回写满未校验的状态, 数据保留, 由调用者重新校验后CommitBlock
+    //校验失败的块由DiscardBlock丢弃, 待校验的状态记入日志, 重新打开后仍然保留
+    //返回退回的块数
+    uint32_t ReopenBlocks();
+    //源文件的强ETag和Last-Modified, 随日志保存, 续传时用于判断源文件是否已改变
+    //etag为空或last_modified为0表示没有, 过长的etag不保存
+    void SetValidator(const std::string & etag, int64_t last_modified);
+    void GetValidator(std::string & etag, int64_t & last_modified) const;
+    //读取整块, 可在其他线程调用
+    bool ReadBlock(uint32_t block_id, void * blob, size_t size) const;
+    //只使用打开时记下的文件大小, 不访问日志, 可在其他线程调用
     bool GetBlockInfo(uint32_t block_id, uint64_t & start, size_t & size) const;
     uint32_t GetBlockId(uint64_t start, size_t size) const;
+    //包含文件位置offset的块
+    uint32_t FindBlock(uint64_t offset) const;
+    //读取文件[offset, offset + size), 可在其他线程调用
+    //只等待区间涉及的块通过校验, timeout(ms)为0时不等待, -1时一直等待
+    //超时, 越界或文件关闭时返回false
+    bool Read(uint64_t offset, void * blob, size_t size, uint32_t timeout);
+    //最近一次Read的位置, 尚未读取时为0
+    uint64_t GetReadCursor() const;
     //!返回已经写入的数据大小
     uint64_t GetWrittenSize() const;
     
@@ -113,6 +258,11 @@ private:
     void CloseJournal();
     bool CreateJournal(const char * file);
     void UpdateJournal(uint32_t block_id);
+    void CommitJournal();
+    //数据落盘, 把待提交的块标记为有效并写入日志
+    void GroupCommit();
+    bool IsGroupCommit() const;
+    bool IsCommitDue() const;
     //!内存映射打开日志文件
     bool OpenJournalMapping(void * journal_content);
     bool ResetJournal();
@@ -122,17 +272,46 @@ private:
     void UpdateDownloadedCount();
 
     void UpdateBlockCount();
+
+    //区间涉及的块均已有效, 调用者持有read_lock_
+    bool IsRangeReady(uint64_t offset, size_t size) const;
+
+    void LoadFragments();
+    void MergeFragment(uint32_t block_id, uint32_t offset, uint32_t size);
+    void RemoveFragments(uint32_t block_id);
+    uint64_t GetFragmentSize() const;
 private:
+    typedef std::vector<Journal::Fragment> Fragments;
+
     BlockFile file_;
 
     Journal journal_;
     std::string journal_path_;
     uint32_t written_block_count_;
+    //打开时从目标文件取得, 日志重新映射时后台线程仍在使用
     uint32_t total_block_count_;
+    uint64_t file_size_;
+    //未完成块的写入进度, 定期提交到日志
+    Fragments fragments_;
+    uint64_t uncommitted_size_;
+    bool defer_validation_;
+    Durability durability_;
+    //已写满但数据尚未落盘的块, 视为有效但不写入日志
+    std::unordered_set<uint32_t> pending_blocks_;
+    std::chrono::steady_clock::time_point last_commit_;
+    //块状态的变化通知等待中的Read
+    mutable std::mutex read_lock_;
+    std::condition_variable block_ready_;
+    std::atomic<uint64_t> read_cursor_;
+    //Finish之后日志已删除, 所有块视为有效
+    bool finished_;
 private:
-    static const uint32_t kMaxBlockCount = 0x1800;
+    //块编号为32位, 保留kInvalidBlockId
+    static const uint32_t kMaxBlockCount = 0xfffffffe;
     static const uint32_t kMaxBlockSize = 0x400000;
-    static const uint64_t kMaxFileSize = 1ll * kMaxBlockCount * kMaxBlockSize;
+    static const uint64_t kMaxFileSize = 1ull * kMaxBlockCount * kMaxBlockSize;
+    //流式写入每累积这么多字节提交一次日志
+    static const uint32_t kCommitStep = 0x100000;
     static const char * kJournalExt;
 };
 
@@ -1,8 +1,13 @@
-﻿#include "nweb_test.h"
+﻿#include <thread>
+#include "nweb_test.h"
 #include "mass_file.h"
+#include "block_file.h"
 
 #pragma execution_character_set("utf-8")
 
+extern "C" unsigned long crc32( unsigned long crc,
+                                const void *buf,
+                                unsigned int len);
 namespace 
 {
 namespace utils
@@ -189,6 +194,319 @@ TEST(MassFileTest, PublicFileTest)
 }
 
 
+//测试流式写入及块内断点
+TEST(MassFileTest, StreamingWriteTest)
+{
+    nweb::MassFile mass_file;
+
+    const char * content_path = ".\\build\\test\\\xe6\x88\x91s.txt";
+    const char * journal_path = ".\\build\\test\\\xe6\x88\x91s.txt.ns";
+    const size_t kChunk = 512 * 1024;
+
+    utils::RemoveFile(content_path);
+    utils::RemoveFile(journal_path);
+    //9M 文件分为3块
+    ASSERT_TRUE(mass_file.Create(content_path, 9 * 1024 * 1024));
+    ASSERT_EQ(3, mass_file.GetBlockCount());
+
+    char * mmm = new char[4 * 1024 * 1024];
+    memset(mmm, 1, (4 * 1024 * 1024));
+    //第2块写入前1.5M
+    for(uint32_t i = 0; i < 3; ++i)
+        ASSERT_TRUE(mass_file.WriteBlock(1, i * kChunk, mmm, kChunk));
+    //第2块写入[3M, 4M)
+    ASSERT_TRUE(mass_file.WriteBlock(1, 6 * kChunk, mmm, 2 * kChunk));
+    //越界写入失败
+    ASSERT_FALSE(mass_file.WriteBlock(1, 7 * kChunk, mmm, 2 * kChunk));
+    ASSERT_FALSE(mass_file.IsBlockValid(1));
+
+    uint32_t offset = 0;
+    size_t size = 0;
+    ASSERT_TRUE(mass_file.GetBlockHole(1, offset, size));
+    ASSERT_EQ(3 * kChunk, offset);
+    ASSERT_EQ(3 * kChunk, size);
+    ASSERT_EQ(5 * kChunk, mass_file.GetWrittenSize());
+    ::Sleep(1000);
+    mass_file.Close();
+
+    //重新打开后从块内断点继续
+    ASSERT_TRUE(mass_file.Open(content_path));
+    ASSERT_FALSE(mass_file.IsBlockValid(1));
+    ASSERT_TRUE(mass_file.GetBlockHole(1, offset, size));
+    ASSERT_EQ(3 * kChunk, offset);
+    ASSERT_EQ(3 * kChunk, size);
+    ASSERT_EQ(5 * kChunk, mass_file.GetWrittenSize());
+
+    ASSERT_TRUE(mass_file.WriteBlock(1, offset, mmm, size));
+    ASSERT_TRUE(mass_file.IsBlockValid(1));
+    ASSERT_FALSE(mass_file.GetBlockHole(1, offset, size));
+    ASSERT_EQ(4 * 1024 * 1024, mass_file.GetWrittenSize());
+
+    mass_file.Close();
+    utils::RemoveFile(content_path);
+    ASSERT_TRUE(mass_file.Finish());
+    delete [] mmm;
+}
+
+//测试边下载边读取
+TEST(MassFileTest, ProgressiveReadTest)
+{
+    nweb::MassFile mass_file;
+
+    const char * content_path = ".\\build\\test\\\xe6\x88\x91r.txt";
+    const char * journal_path = ".\\build\\test\\\xe6\x88\x91r.txt.ns";
+    const size_t kBlock = 4 * 1024 * 1024;
+
+    utils::RemoveFile(content_path);
+    utils::RemoveFile(journal_path);
+    ASSERT_TRUE(mass_file.Create(content_path, 9 * 1024 * 1024));
+
+    char * mmm = new char[kBlock];
+    char * out = new char[kBlock];
+    memset(mmm, 7, kBlock);
+    //所需的块未完成时不等待则失败
+    ASSERT_FALSE(mass_file.Read(100, out, 1000, 0));
+    ASSERT_EQ(2, mass_file.FindBlock(8 * 1024 * 1024));
+    ASSERT_EQ(nweb::MassFile::kInvalidBlockId, mass_file.FindBlock(9 * 1024 * 1024));
+
+    //等待中的读取在块完成后返回
+    bool read = false;
+    std::thread reader([&]()
+    {
+        read = mass_file.Read(kBlock - 10, out, 20, -1);
+    });
+    ::Sleep(100);
+    ASSERT_TRUE(mass_file.SaveBlock(0, mmm, kBlock));
+    ::Sleep(100);
+    ASSERT_FALSE(read);
+    ASSERT_TRUE(mass_file.SaveBlock(1, mmm, kBlock));
+    reader.join();
+    ASSERT_TRUE(read);
+    ASSERT_EQ(7, out[19]);
+    ASSERT_EQ(kBlock - 10, mass_file.GetReadCursor());
+
+    //超时
+    ASSERT_FALSE(mass_file.Read(8 * 1024 * 1024, out, 10, 50));
+    //越界
+    ASSERT_FALSE(mass_file.Read(9 * 1024 * 1024 - 5, out, 10, 0));
+
+    mass_file.Close();
+    utils::RemoveFile(content_path);
+    ASSERT_TRUE(mass_file.Finish());
+    delete [] out;
+    delete [] mmm;
+}
+
+//旧版(NS00)日志在打开时转换为当前格式
+TEST(MassFileTest, LegacyJournalTest)
+{
+    nweb::MassFile mass_file;
+
+    const char * content_path = ".\\build\\test\\\xe6\x88\x91l.txt";
+    const char * journal_path = ".\\build\\test\\\xe6\x88\x91l.txt.ns";
+    const size_t kBlock = 4 * 1024 * 1024;
+
+    utils::RemoveFile(content_path);
+    utils::RemoveFile(journal_path);
+    ASSERT_TRUE(mass_file.Create(content_path, 9 * 1024 * 1024));
+
+    char * mmm = new char[kBlock];
+    memset(mmm, 3, kBlock);
+    ASSERT_TRUE(mass_file.SaveBlock(0, mmm, kBlock));
+    mass_file.Close();
+
+    //沿用当前日志的文件大小和写入时间, 第1块有效
+    uint8_t legacy[4096] = {0};
+    nweb::BlockFile journal;
+    ASSERT_TRUE(journal.Open(journal_path, false));
+    ASSERT_TRUE(journal.Read(legacy, 24, 0));
+    *reinterpret_cast<uint32_t *>(legacy) = 0x30304e53;
+    legacy[1024] = 0x1;
+    *reinterpret_cast<uint32_t *>(legacy + 4) = 
+        crc32(0xffffffff, legacy + 8, sizeof(legacy) - 8);
+    ASSERT_TRUE(journal.SetSize64(sizeof(legacy)));
+    ASSERT_TRUE(journal.Write(legacy, sizeof(legacy), 0));
+    journal.Close();
+
+    ASSERT_TRUE(mass_file.Open(content_path));
+    ASSERT_EQ(3, mass_file.GetBlockCount());
+    ASSERT_TRUE(mass_file.IsBlockValid(0));
+    ASSERT_FALSE(mass_file.IsBlockValid(1));
+    ASSERT_EQ(kBlock, mass_file.GetWrittenSize());
+    mass_file.Close();
+
+    //转换后的日志可以再次打开
+    ASSERT_TRUE(mass_file.Open(content_path));
+    ASSERT_TRUE(mass_file.IsBlockValid(0));
+    ASSERT_TRUE(mass_file.SaveBlock(2, mmm, 1024 * 1024));
+    ASSERT_EQ(kBlock + 1024 * 1024, mass_file.GetWrittenSize());
+
+    mass_file.Close();
+    utils::RemoveFile(content_path);
+    ASSERT_TRUE(mass_file.Finish());
+    delete [] mmm;
+}
+
+//批量提交: 块数据落盘前不在日志中标记为有效
+TEST(MassFileTest, GroupCommitTest)
+{
+    nweb::MassFile mass_file;
+
+    const char * content_path = ".\\build\\test\\\xe6\x88\x91g.txt";
+    const char * journal_path = ".\\build\\test\\\xe6\x88\x91g.txt.ns";
+    const size_t kBlock = 4 * 1024 * 1024;
+
+    utils::RemoveFile(content_path);
+    utils::RemoveFile(journal_path);
+    nweb::MassFile::Durability durability = {2, 0};
+    mass_file.SetDurability(durability);
+    ASSERT_TRUE(mass_file.Create(content_path, 9 * 1024 * 1024));
+
+    char * mmm = new char[kBlock];
+    memset(mmm, 5, kBlock);
+    //日志头部之后是块状态位图
+    uint8_t status = 0;
+    nweb::BlockFile journal;
+
+    ASSERT_TRUE(mass_file.SaveBlock(0, mmm, kBlock));
+    ASSERT_TRUE(mass_file.IsBlockValid(0));
+    ASSERT_EQ(kBlock, mass_file.GetWrittenSize());
+    ASSERT_TRUE(journal.Open(journal_path, false));
+    ASSERT_TRUE(journal.Read(&status, 1, 1024));
+    ASSERT_EQ(0, status);
+
+    //第2块凑满一批, 一起落盘
+    ASSERT_TRUE(mass_file.SaveBlock(2, mmm, 1024 * 1024));
+    ASSERT_TRUE(journal.Read(&status, 1, 1024));
+    ASSERT_EQ(0x5, status);
+
+    //关闭时提交剩余的块
+    ASSERT_TRUE(mass_file.SaveBlock(1, mmm, kBlock));
+    ASSERT_TRUE(journal.Read(&status, 1, 1024));
+    ASSERT_EQ(0x5, status);
+    journal.Close();
+    mass_file.Close();
+
+    ASSERT_TRUE(mass_file.Open(content_path));
+    ASSERT_TRUE(mass_file.HasFinished());
+    mass_file.Close();
+    utils::RemoveFile(content_path);
+    ASSERT_TRUE(mass_file.Finish());
+    delete [] mmm;
+}
+
+TEST(MassFileTest, ValidatorTest)
+{
+    nweb::MassFile mass_file;
+
+    const char * content_path = ".\\build\\test\\\xe6\x88\x91v.txt";
+    const char * journal_path = ".\\build\\test\\\xe6\x88\x91v.txt.ns";
+    const size_t kBlock = 4 * 1024 * 1024;
+
+    utils::RemoveFile(content_path);
+    utils::RemoveFile(journal_path);
+    ASSERT_TRUE(mass_file.Create(content_path, 9 * 1024 * 1024));
+    mass_file.DeferValidation(true);
+
+    char * mmm = new char[kBlock];
+    memset(mmm, 6, kBlock);
+    ASSERT_TRUE(mass_file.SaveBlock(0, mmm, kBlock));
+    ASSERT_TRUE(mass_file.SaveBlock(2, mmm, 1024 * 1024));
+    mass_file.SetValidator("\"abc\"", 1400000000);
+    mass_file.Close();
+
+    //校验器随日志保存
+    std::string etag;
+    int64_t modified = 0;
+    ASSERT_TRUE(mass_file.Open(content_path));
+    mass_file.GetValidator(etag, modified);
+    ASSERT_EQ("\"abc\"", etag);
+    ASSERT_EQ(1400000000, modified);
+
+    //过长的ETag不保存
+    mass_file.SetValidator(std::string(256, 'x'), 1400000001);
+    mass_file.GetValidator(etag, modified);
+    ASSERT_TRUE(etag.empty());
+    ASSERT_EQ(1400000001, modified);
+
+    //有效的块退回写满未校验的状态, 校验后重新提交
+    ASSERT_EQ(2, mass_file.ReopenBlocks());
+    ASSERT_FALSE(mass_file.IsBlockValid(0));
+    ASSERT_TRUE(mass_file.IsBlockFilled(0));
+    ASSERT_TRUE(mass_file.IsBlockFilled(2));
+    ASSERT_EQ(3, mass_file.FindInvalidBlocks().size());
+    ASSERT_TRUE(mass_file.CommitBlock(0));
+    mass_file.DiscardBlock(2);
+    ASSERT_FALSE(mass_file.IsBlockFilled(2));
+    mass_file.Close();
+
+    ASSERT_TRUE(mass_file.Open(content_path));
+    ASSERT_TRUE(mass_file.IsBlockValid(0));
+    ASSERT_FALSE(mass_file.IsBlockValid(2));
+    mass_file.Close();
+    utils::RemoveFile(content_path);
+    utils::RemoveFile(journal_path);
+    delete [] mmm;
+}
+
+//重新校验中途关闭, 已下载的块不能丢失
+TEST(MassFileTest, ReverifyJournalTest)
+{
+    nweb::MassFile mass_file;
+
+    const char * content_path = ".\\build\\test\\\xe6\x88\x91r.txt";
+    const char * journal_path = ".\\build\\test\\\xe6\x88\x91r.txt.ns";
+    const size_t kBlock = 4 * 1024 * 1024;
+    //超过日志中可保存的片段数
+    const uint32_t kCount = 60;
+
+    utils::RemoveFile(content_path);
+    utils::RemoveFile(journal_path);
+    nweb::MassFile::Durability durability = {16, 0};
+    mass_file.SetDurability(durability);
+    ASSERT_TRUE(mass_file.Create(content_path, kCount * kBlock));
+    mass_file.DeferValidation(true);
+
+    char * mmm = new char[kBlock];
+    memset(mmm, 7, kBlock);
+    for(uint32_t i = 0; i < kCount; ++i)
+        ASSERT_TRUE(mass_file.SaveBlock(i, mmm, kBlock));
+    mass_file.Close();
+
+    ASSERT_TRUE(mass_file.Open(content_path));
+    ASSERT_EQ(kCount, mass_file.ReopenBlocks());
+    ASSERT_EQ(kCount, mass_file.FindInvalidBlocks().size());
+    ASSERT_EQ(kCount * kBlock, mass_file.GetWrittenSize());
+    //只校验了一部分, 其中一块不一致
+    for(uint32_t i = 0; i < 10; ++i)
+        ASSERT_TRUE(mass_file.CommitBlock(i));
+    mass_file.DiscardBlock(10);
+    mass_file.Close();
+
+    //其余的块仍待校验, 不需要重新下载
+    ASSERT_TRUE(mass_file.Open(content_path));
+    ASSERT_TRUE(mass_file.IsBlockValid(9));
+    ASSERT_FALSE(mass_file.IsBlockValid(10));
+    ASSERT_FALSE(mass_file.IsBlockFilled(10));
+    ASSERT_EQ(kCount - 10, mass_file.FindInvalidBlocks().size());
+    for(uint32_t i = 11; i < kCount; ++i)
+    {
+        ASSERT_FALSE(mass_file.IsBlockValid(i));
+        ASSERT_TRUE(mass_file.IsBlockFilled(i));
+        ASSERT_TRUE(mass_file.CommitBlock(i));
+    }
+    ASSERT_TRUE(mass_file.SaveBlock(10, mmm, kBlock));
+    ASSERT_TRUE(mass_file.HasFinished());
+    mass_file.Close();
+
+    ASSERT_TRUE(mass_file.Open(content_path));
+    ASSERT_TRUE(mass_file.HasFinished());
+    mass_file.Close();
+    utils::RemoveFile(content_path);
+    utils::RemoveFile(journal_path);
+    delete [] mmm;
+}
+
 //测试Journal FLUSH后 是否立刻写入到磁盘
 
 }
@@ -0,0 +1,225 @@
+﻿#include <float.h>
+#include "nweb.h"
+#include "mirror_set.h"
+
+namespace nweb
+{
+
+namespace
+{
+
+//失败率统计的窗口, 最近的请求次数
+const uint32_t kOutcomeWindow = 16;
+//统计失败率所需的最少请求次数
+const uint32_t kMinOutcomeCount = 4;
+//失败率达到该值时暂停
+const float kMaxErrorRate = 0.5f;
+//连续失败达到该次数时暂停
+const uint32_t kMaxFailuresInRow = 3;
+//首次暂停的时长(秒), 每次加倍
+const uint32_t kBenchTime = 5;
+const uint32_t kMaxBenchTime = 300;
+
+uint32_t PopCount(uint32_t bits)
+{
+    uint32_t count = 0;
+    for(; bits; bits &= bits - 1)
+        ++count;
+    return count;
+}
+
+}
+
+MirrorSet::MirrorSet()
+{
+}
+
+void MirrorSet::Clear()
+{
+    mirrors_.clear();
+}
+
+uint32_t MirrorSet::Add(const char * url)
+{
+    if(!url || !*url)
+        return kInvalidMirror;
+
+    for(size_t i = 0; i < mirrors_.size(); ++i)
+    {
+        if(mirrors_[i].url == url)
+            return static_cast<uint32_t>(i);
+    }
+
+    Mirror mirror;
+    mirror.url = url;
+    mirror.input = 0;
+    mirror.outcomes = 0;
+    mirror.outcome_count = 0;
+    mirror.failures_in_row = 0;
+    mirror.bench_count = 0;
+    mirror.bench_until = 0;
+    mirrors_.push_back(mirror);
+    return static_cast<uint32_t>(mirrors_.size() - 1);
+}
+
+size_t MirrorSet::Count() const
+{
+    return mirrors_.size();
+}
+
+const char * MirrorSet::GetUrl(uint32_t mirror) const
+{
+    if(mirror >= mirrors_.size())
+        return 0;
+    return mirrors_[mirror].url.data();
+}
+
+void MirrorSet::SetUrl(uint32_t mirror, const char * url)
+{
+    if(mirror < mirrors_.size() && url && *url)
+        mirrors_[mirror].url = url;
+}
+
+uint32_t MirrorSet::Pick(const std::vector<uint32_t> & active, 
+                         uint32_t exclude) const
+{
+    if(mirrors_.empty())
+        return kInvalidMirror;
+
+    //已测得吞吐率的镜像的平均值, 用于估计未测得的镜像
+    float total = 0.0f;
+    uint32_t measured = 0;
+    for(size_t i = 0; i < mirrors_.size(); ++i)
+    {
+        float speed = mirrors_[i].speed.Speed();
+        if(speed >= 0.0f && !IsBenched(static_cast<uint32_t>(i)))
+        {
+            total += speed;
+            ++measured;
+        }
+    }
+    float average = measured ? total / measured : 1.0f;
+
+    uint32_t best = kInvalidMirror;
+    float best_score = -1.0f;
+    for(int pass = 0; pass < 2 && best == kInvalidMirror; ++pass)
+    {
+        for(size_t i = 0; i < mirrors_.size(); ++i)
+        {
+            uint32_t index = static_cast<uint32_t>(i);
+            if(IsBenched(index))
+                continue;
+            //第一轮避开exclude
+            if(pass == 0 && index == exclude)
+                continue;
+            uint32_t busy = index < active.size() ? active[index] : 0;
+            float speed = mirrors_[i].speed.Speed();
+            float score = 0.0f;
+            if(speed < 0.0f)
+                score = busy ? average / (busy + 1) : FLT_MAX;
+            else
+                score = speed / (busy + 1);
+            if(score > best_score)
+            {
+                best_score = score;
+                best = index;
+            }
+        }
+    }
+    if(best != kInvalidMirror)
+        return best;
+
+    //全部暂停时选择最先恢复的
+    best = 0;
+    for(size_t i = 1; i < mirrors_.size(); ++i)
+    {
+        if(mirrors_[i].bench_until < mirrors_[best].bench_until)
+            best = static_cast<uint32_t>(i);
+    }
+    return best;
+}
+
+void MirrorSet::NoteInput(uint32_t mirror, uint32_t size)
+{
+    if(mirror >= mirrors_.size() || !size)
+        return;
+    Mirror & target = mirrors_[mirror];
+    target.input += size;
+    target.speed.Note(target.input);
+}
+
+void MirrorSet::NoteSuccess(uint32_t mirror)
+{
+    if(mirror < mirrors_.size())
+        NoteOutcome(mirrors_[mirror], false);
+}
+
+void MirrorSet::NoteFailure(uint32_t mirror)
+{
+    if(mirror < mirrors_.size())
+        NoteOutcome(mirrors_[mirror], true);
+}
+
+float MirrorSet::Speed(uint32_t mirror) const
+{
+    if(mirror >= mirrors_.size())
+        return -1.0f;
+    return mirrors_[mirror].speed.Speed();
+}
+
+float MirrorSet::ErrorRate(uint32_t mirror) const
+{
+    if(mirror >= mirrors_.size())
+        return 0.0f;
+    const Mirror & target = mirrors_[mirror];
+    if(!target.outcome_count)
+        return 0.0f;
+    uint32_t count = (std::min)(target.outcome_count, kOutcomeWindow);
+    return static_cast<float>(PopCount(target.outcomes)) / count;
+}
+
+bool MirrorSet::IsBenched(uint32_t mirror) const
+{
+    if(mirror >= mirrors_.size())
+        return true;
+    return mirrors_[mirror].bench_until > Now();
+}
+
+void MirrorSet::NoteOutcome(Mirror & mirror, bool failed)
+{
+    uint32_t mask = (1u << kOutcomeWindow) - 1;
+    mirror.outcomes = ((mirror.outcomes << 1) | (failed ? 1 : 0)) & mask;
+    mirror.outcome_count++;
+    if(!failed)
+    {
+        mirror.failures_in_row = 0;
+        //恢复后表现正常, 下次暂停重新计时
+        if(mirror.outcome_count >= kOutcomeWindow)
+            mirror.bench_count = 0;
+        return;
+    }
+
+    mirror.failures_in_row++;
+    uint32_t count = (std::min)(mirror.outcome_count, kOutcomeWindow);
+    float rate = static_cast<float>(PopCount(mirror.outcomes)) / count;
+    bool bench = mirror.failures_in_row >= kMaxFailuresInRow;
+    if(count >= kMinOutcomeCount && rate >= kMaxErrorRate)
+        bench = true;
+    if(!bench)
+        return;
+
+    uint32_t duration = kBenchTime << (std::min)(mirror.bench_count, 6u);
+    mirror.bench_until = Now() + (std::min)(duration, kMaxBenchTime);
+    mirror.bench_count++;
+    //恢复后重新统计
+    mirror.outcomes = 0;
+    mirror.outcome_count = 0;
+    mirror.failures_in_row = 0;
+}
+
+uint32_t MirrorSet::Now()
+{
+    return GetTickCount() / 1000;
+}
+
+}
@@ -0,0 +1,78 @@
+﻿#ifndef NWEB_MIRROR_SET_H_
+#define NWEB_MIRROR_SET_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "speed_meter.h"
+
+namespace nweb
+{
+
+//同一文件的多个下载源
+//记录每个镜像的吞吐率和最近请求的失败率, 块优先分配给健康且最快的镜像,
+//连续失败或失败率过高的镜像暂停使用一段时间
+class MirrorSet
+{
+public:
+    static const uint32_t kInvalidMirror = -1;
+
+public:
+    MirrorSet();
+
+    void Clear();
+
+    //返回镜像的序号, 重复添加返回已有的序号
+    uint32_t Add(const char * url);
+
+    size_t Count() const;
+
+    const char * GetUrl(uint32_t mirror) const;
+    //更新为重定向后的地址
+    void SetUrl(uint32_t mirror, const char * url);
+
+    //选择下一个请求使用的镜像, active为各镜像正在进行的请求数,
+    //尽量避开exclude, 所有镜像都暂停时选择最先恢复的
+    uint32_t Pick(const std::vector<uint32_t> & active, 
+                  uint32_t exclude = kInvalidMirror) const;
+
+    //收到的数据量
+    void NoteInput(uint32_t mirror, uint32_t size);
+
+    void NoteSuccess(uint32_t mirror);
+
+    void NoteFailure(uint32_t mirror);
+
+    //吞吐率(字节/秒), 尚未测得时返回负数
+    float Speed(uint32_t mirror) const;
+
+    //最近若干次请求中失败的比例
+    float ErrorRate(uint32_t mirror) const;
+
+    bool IsBenched(uint32_t mirror) const;
+
+private:
+    struct Mirror
+    {
+        std::string url;
+        SpeedMeter speed;
+        uint64_t input;
+        uint32_t outcomes;      //最近的请求结果, 每位一次, 1表示失败
+        uint32_t outcome_count;
+        uint32_t failures_in_row;
+        uint32_t bench_count;   //被暂停的次数, 决定暂停时长
+        uint32_t bench_until;
+    };
+    typedef std::vector<Mirror> Mirrors;
+
+    void NoteOutcome(Mirror & mirror, bool failed);
+
+    static uint32_t Now();
+
+private:
+    Mirrors mirrors_;
+};
+
+}
+
+#endif
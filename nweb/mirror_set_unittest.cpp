@@ -0,0 +1,78 @@
+﻿#include "nweb_test.h"
+#include "mirror_set.h"
+
+TEST(MirrorSet, BenchFailingMirror)
+{
+    using namespace nweb;
+
+    MirrorSet mirrors;
+    uint32_t primary = mirrors.Add("http://mirror1/file.bin");
+    uint32_t backup = mirrors.Add("http://mirror2/file.bin");
+    EXPECT_EQ(primary, mirrors.Add("http://mirror1/file.bin"));
+    EXPECT_EQ(2, mirrors.Count());
+
+    std::vector<uint32_t> active(mirrors.Count(), 0);
+    //尚未测速时避开exclude
+    EXPECT_EQ(backup, mirrors.Pick(active, primary));
+
+    //连续失败后暂停
+    for(int i = 0; i < 3; ++i)
+        mirrors.NoteFailure(primary);
+    EXPECT_TRUE(mirrors.IsBenched(primary));
+    EXPECT_FALSE(mirrors.IsBenched(backup));
+    EXPECT_EQ(backup, mirrors.Pick(active));
+    EXPECT_EQ(backup, mirrors.Pick(active, backup));
+
+    //全部暂停时仍能选出镜像
+    for(int i = 0; i < 3; ++i)
+        mirrors.NoteFailure(backup);
+    EXPECT_NE(MirrorSet::kInvalidMirror, mirrors.Pick(active));
+}
+
+TEST(MirrorSet, ErrorRate)
+{
+    using namespace nweb;
+
+    MirrorSet mirrors;
+    uint32_t mirror = mirrors.Add("http://mirror1/file.bin");
+    mirrors.NoteSuccess(mirror);
+    mirrors.NoteSuccess(mirror);
+    mirrors.NoteSuccess(mirror);
+    mirrors.NoteFailure(mirror);
+    EXPECT_FLOAT_EQ(0.25f, mirrors.ErrorRate(mirror));
+    EXPECT_FALSE(mirrors.IsBenched(mirror));
+}
+
+TEST(MirrorSet, SampleAfterGrowth)
+{
+    using namespace nweb;
+
+    //添加镜像使数组多次重新分配, 之前的测速记录须仍然有效
+    MirrorSet mirrors;
+    const uint32_t kCount = 40;
+    for(uint32_t i = 0; i < kCount; ++i)
+    {
+        char url[64];
+        sprintf_s(url, "http://mirror%u/file.bin", i);
+        uint32_t mirror = mirrors.Add(url);
+        ASSERT_EQ(i, mirror);
+        mirrors.NoteInput(mirror, 0x1000);
+    }
+    for(uint32_t i = 0; i < kCount; ++i)
+    {
+        mirrors.NoteInput(i, 0x1000);
+        //记录不满一轮时尚未测得速度
+        EXPECT_LT(mirrors.Speed(i), 0);
+    }
+
+    //复制后的测速器不再指向原对象
+    SpeedMeter meter;
+    meter.Note(100);
+    SpeedMeter copy(meter);
+    meter.Reset();
+    copy.Accum(100);
+    copy = meter;
+    copy.Accum(100);
+    EXPECT_LT(copy.Speed(), 0);
+    EXPECT_LT(meter.Speed(), 0);
+}
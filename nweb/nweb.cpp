@@ -1,6 +1,7 @@
 ﻿#include <curl\curl.h>
 #include <cares\ares.h>
 #include "nweb.h"
+#include "http_pool.h"
 
 namespace nweb
 {
@@ -13,6 +14,8 @@ void Initialize()
 
 void Uninitialize()
 {
+    //parked connections are closed while curl is still there
+    HttpConnectionPool::Global().Clear();
     curl_global_cleanup();
     ares_library_cleanup();
 }
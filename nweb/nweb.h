@@ -38,6 +38,7 @@ enum Result
     kResultFileSizeMismatch     = -4,
     kResultOpenFileFailded      = -5,
     kResultSaveBlockFailded     = -6,
+    kResultObjectChanged        = -7,
 };
 
 }
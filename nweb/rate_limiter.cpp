@@ -0,0 +1,182 @@
+#ifndef _WIN32
+#include <time.h>
+#endif
+#include <functional>
+#include <unordered_map>
+#include "rate_limiter.h"
+
+namespace nweb
+{
+
+namespace
+{
+
+uint64_t TickCount64()
+{
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    timespec now = {0};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+#endif
+}
+
+const uint32_t kHostShardCount = 8;
+//a shard drops the limiters nobody holds when it grows to this size,
+//then again at twice the size left
+const size_t kMinSweepSize = 64;
+
+struct HostShard
+{
+    HostShard() : sweep_at(kMinSweepSize) {}
+
+    std::mutex lock;
+    std::unordered_map<std::string, std::weak_ptr<RateLimiter> > limiters;
+    //hosts with a rate of their own keep their limiter
+    std::unordered_map<std::string, std::shared_ptr<RateLimiter> > pinned;
+    size_t sweep_at;
+};
+
+RateLimiter g_global_limiter;
+HostShard g_host_shards[kHostShardCount];
+std::atomic<uint64_t> g_default_host_rate(0);
+
+HostShard & ShardOf(const std::string & origin)
+{
+    return g_host_shards[std::hash<std::string>()(origin) % kHostShardCount];
+}
+
+//the caller holds the shard lock
+void Sweep(HostShard & shard)
+{
+    for(auto iter = shard.limiters.begin(); iter != shard.limiters.end();)
+    {
+        if(iter->second.expired())
+            iter = shard.limiters.erase(iter);
+        else
+            ++iter;
+    }
+    shard.sweep_at = (std::max)(kMinSweepSize, shard.limiters.size() * 2);
+}
+
+}
+
+RateLimiter::RateLimiter()
+    : rate_(0), tokens_(0), last_refill_(0), explicit_rate_(false)
+{
+}
+
+void RateLimiter::SetRate(uint64_t rate)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    rate_ = rate;
+    //start with a full burst, debt of the old rate is kept
+    last_refill_ = TickCount64();
+    uint64_t burst = (std::max)(rate * kBurstTime, static_cast<uint64_t>(kMinBurst) * 1000);
+    if(tokens_ >= 0)
+        tokens_ = static_cast<int64_t>(burst);
+}
+
+uint64_t RateLimiter::GetRate() const
+{
+    return rate_;
+}
+
+bool RateLimiter::IsReady()
+{
+    if(!rate_)
+        return true;
+
+    std::lock_guard<std::mutex> guard(lock_);
+    Refill(TickCount64());
+    return tokens_ > 0;
+}
+
+void RateLimiter::Consume(size_t size)
+{
+    if(!rate_)
+        return;
+
+    std::lock_guard<std::mutex> guard(lock_);
+    Refill(TickCount64());
+    tokens_ -= static_cast<int64_t>(size) * 1000;
+}
+
+uint32_t RateLimiter::Delay()
+{
+    uint64_t rate = rate_;
+    if(!rate)
+        return 0;
+
+    std::lock_guard<std::mutex> guard(lock_);
+    Refill(TickCount64());
+    if(tokens_ > 0)
+        return 0;
+    //each millisecond brings [rate] tokens in 1/1000 bytes
+    return static_cast<uint32_t>(-tokens_ / rate + 1);
+}
+
+RateLimiter & RateLimiter::Global()
+{
+    return g_global_limiter;
+}
+
+std::shared_ptr<RateLimiter> RateLimiter::ForHost(const std::string & origin)
+{
+    HostShard & shard = ShardOf(origin);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto & entry = shard.limiters[origin];
+    std::shared_ptr<RateLimiter> limiter = entry.lock();
+    if(limiter)
+        return limiter;
+
+    //the debt of a freed limiter is forgotten, no connection was using it
+    limiter.reset(new RateLimiter());
+    limiter->SetRate(g_default_host_rate);
+    entry = limiter;
+    if(shard.limiters.size() >= shard.sweep_at)
+        Sweep(shard);
+    return limiter;
+}
+
+void RateLimiter::SetHostRate(const std::string & origin, uint64_t rate)
+{
+    std::shared_ptr<RateLimiter> limiter = ForHost(origin);
+    HostShard & shard = ShardOf(origin);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.pinned[origin] = limiter;
+    limiter->explicit_rate_ = true;
+    limiter->SetRate(rate);
+}
+
+void RateLimiter::SetDefaultHostRate(uint64_t rate)
+{
+    //limiters created from here on start with the new rate
+    g_default_host_rate = rate;
+    for(uint32_t i = 0; i < kHostShardCount; ++i)
+    {
+        HostShard & shard = g_host_shards[i];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        for(auto iter = shard.limiters.begin(); iter != shard.limiters.end(); ++iter)
+        {
+            std::shared_ptr<RateLimiter> limiter = iter->second.lock();
+            if(limiter && !limiter->explicit_rate_)
+                limiter->SetRate(rate);
+        }
+    }
+}
+
+void RateLimiter::Refill(uint64_t now)
+{
+    uint64_t rate = rate_;
+    if(now <= last_refill_)
+        return;
+
+    uint64_t burst = (std::max)(rate * kBurstTime, static_cast<uint64_t>(kMinBurst) * 1000);
+    int64_t tokens = tokens_ + static_cast<int64_t>((now - last_refill_) * rate);
+    tokens_ = (std::min)(tokens, static_cast<int64_t>(burst));
+    last_refill_ = now;
+}
+
+}
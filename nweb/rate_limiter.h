@@ -0,0 +1,76 @@
+#ifndef NWEB_RATE_LIMITER_H_
+#define NWEB_RATE_LIMITER_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "nweb.h"
+
+namespace nweb
+{
+
+//RateLimiter is a token bucket for received bytes.
+//Limiters form three levels: the global one, one per host and an optional
+//one per job. A connection draws from all of its levels and is paused
+//while any of them is in debt, so a busy job never takes a host's or the
+//process' whole budget.
+class RateLimiter
+{
+public:
+    //Burst allowed on top of the rate, in milliseconds of rate.
+    static const uint32_t kBurstTime = 100;
+    //Smallest burst in bytes, so tiny rates still move whole packets.
+    static const uint32_t kMinBurst = 0x4000;
+
+public:
+    RateLimiter();
+
+    //Bytes per second, 0 means unlimited. Takes effect immediately.
+    void SetRate(uint64_t rate);
+
+    uint64_t GetRate() const;
+
+    //A transfer may receive now.
+    bool IsReady();
+
+    //Charge [size] received bytes, the bucket may go into debt.
+    void Consume(size_t size);
+
+    //Milliseconds until IsReady, 0 when ready now.
+    uint32_t Delay();
+
+    //The process wide limiter.
+    static RateLimiter & Global();
+
+    //The limiter shared by every connection to [origin] (see URL::Origin).
+    //A host limiter is freed with the last connection holding it, unless
+    //the host has a rate of its own. Hosts are spread over several locks.
+    static std::shared_ptr<RateLimiter> ForHost(const std::string & origin);
+
+    //Rate of one host, overrides the default host rate.
+    static void SetHostRate(const std::string & origin, uint64_t rate);
+
+    //Rate of the hosts without a rate of their own.
+    static void SetDefaultHostRate(uint64_t rate);
+
+private:
+    RateLimiter(const RateLimiter &);
+    RateLimiter & operator=(const RateLimiter &);
+
+    void Refill(uint64_t now);
+
+private:
+    std::mutex lock_;
+    std::atomic<uint64_t> rate_;
+    //tokens are kept in 1/1000 bytes so that refill by milliseconds is exact
+    int64_t tokens_;
+    uint64_t last_refill_;
+    //host limiters: rate set by SetHostRate instead of the default one,
+    //guarded by the lock of the host's shard
+    bool explicit_rate_;
+};
+
+}
+
+#endif
@@ -0,0 +1,84 @@
+#include "nweb_test.h"
+#include "rate_limiter.h"
+
+TEST(RateLimiter, Unlimited)
+{
+    using namespace nweb;
+
+    RateLimiter limiter;
+    EXPECT_EQ(0, limiter.GetRate());
+    limiter.Consume(0x10000000);
+    EXPECT_TRUE(limiter.IsReady());
+    EXPECT_EQ(0, limiter.Delay());
+}
+
+TEST(RateLimiter, PauseAndResume)
+{
+    using namespace nweb;
+
+    RateLimiter limiter;
+    limiter.SetRate(0x100000);
+    EXPECT_TRUE(limiter.IsReady());
+
+    //one second of rate leaves the bucket in debt
+    limiter.Consume(0x100000);
+    EXPECT_FALSE(limiter.IsReady());
+    uint32_t delay = limiter.Delay();
+    EXPECT_LT(0, delay);
+    EXPECT_GE(1000, delay);
+
+    //the debt is paid in time
+    Sleep(delay + 50);
+    EXPECT_TRUE(limiter.IsReady());
+
+    //lifting the limit takes effect at once
+    limiter.Consume(0x1000000);
+    EXPECT_FALSE(limiter.IsReady());
+    limiter.SetRate(0);
+    EXPECT_TRUE(limiter.IsReady());
+}
+
+TEST(RateLimiter, HostLimiters)
+{
+    using namespace nweb;
+
+    std::shared_ptr<RateLimiter> host = RateLimiter::ForHost("http://rate-test-host");
+    EXPECT_EQ(host, RateLimiter::ForHost("http://rate-test-host"));
+    EXPECT_EQ(0, host->GetRate());
+
+    RateLimiter::SetHostRate("http://rate-test-host", 0x10000);
+    RateLimiter::SetDefaultHostRate(0x20000);
+    //an explicit rate wins over the default one
+    EXPECT_EQ(0x10000, host->GetRate());
+    EXPECT_EQ(0x20000, RateLimiter::ForHost("http://rate-test-other")->GetRate());
+
+    RateLimiter::SetDefaultHostRate(0);
+    RateLimiter::SetHostRate("http://rate-test-host", 0);
+    EXPECT_EQ(0, RateLimiter::ForHost("http://rate-test-other")->GetRate());
+}
+
+TEST(RateLimiter, HostLimitersFreed)
+{
+    using namespace nweb;
+
+    //nobody holds it any more
+    std::weak_ptr<RateLimiter> gone = RateLimiter::ForHost("http://rate-test-gone");
+    EXPECT_TRUE(gone.expired());
+
+    //a host with a rate of its own keeps its limiter
+    RateLimiter::SetHostRate("http://rate-test-kept", 0x10000);
+    std::weak_ptr<RateLimiter> kept = RateLimiter::ForHost("http://rate-test-kept");
+    EXPECT_FALSE(kept.expired());
+    EXPECT_EQ(0x10000, RateLimiter::ForHost("http://rate-test-kept")->GetRate());
+
+    //many short lived hosts
+    char origin[64] = {0};
+    for(int i = 0; i < 1000; ++i)
+    {
+        sprintf_s(origin, "http://rate-test-%d", i);
+        std::shared_ptr<RateLimiter> limiter = RateLimiter::ForHost(origin);
+        EXPECT_TRUE(limiter != 0);
+    }
+    EXPECT_EQ(0x10000, RateLimiter::ForHost("http://rate-test-kept")->GetRate());
+    RateLimiter::SetHostRate("http://rate-test-kept", 0);
+}
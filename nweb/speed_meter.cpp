@@ -16,6 +16,29 @@ SpeedMeter::SpeedMeter()
     Reset();
 }
 
+SpeedMeter::SpeedMeter(const SpeedMeter & other)
+{
+    *this = other;
+}
+
+SpeedMeter & SpeedMeter::operator=(const SpeedMeter & other)
+{
+    if(this == &other)
+        return *this;
+
+    for(uint8_t i  = 0; i < kMaxRecord; ++i)
+    {
+        uint8_t next = (i + 1) % kMaxRecord;
+        records_[i].next = &records_[next];
+        records_[i].value = other.records_[i].value;
+        records_[i].tick = other.records_[i].tick;
+    }
+    first_ = &records_[other.first_ - other.records_];
+    last_ = &records_[other.last_ - other.records_];
+    hit_count_ = other.hit_count_;
+    return *this;
+}
+
 void SpeedMeter::Reset()
 {
     memset(records_, 0, sizeof(records_));
@@ -19,6 +19,11 @@ class SpeedMeter
 public:
     SpeedMeter();
 
+    //记录之间以指针相连, 复制时按下标重建
+    SpeedMeter(const SpeedMeter & other);
+
+    SpeedMeter & operator=(const SpeedMeter & other);
+
     void Reset();
 
     void Note(uint64_t value);
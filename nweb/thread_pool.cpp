@@ -0,0 +1,57 @@
+﻿#include "thread_pool.h"
+
+namespace nweb
+{
+
+ThreadPool::ThreadPool(uint32_t thread_count)
+    : thread_count_((std::max)(1u, thread_count)), stop_(false)
+{
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stop_ = true;
+    }
+    ready_.notify_all();
+    for(size_t i = 0; i < threads_.size(); ++i)
+        threads_[i].join();
+}
+
+void ThreadPool::SetThreadCount(uint32_t count)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    thread_count_ = (std::max)(1u, count);
+}
+
+void ThreadPool::Post(const std::function<void()> & task)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        tasks_.push_back(task);
+        while(threads_.size() < thread_count_)
+            threads_.push_back(std::thread(&ThreadPool::Run, this));
+    }
+    ready_.notify_one();
+}
+
+void ThreadPool::Run()
+{
+    while(true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> guard(lock_);
+            while(!stop_ && tasks_.empty())
+                ready_.wait(guard);
+            if(tasks_.empty())
+                return;
+            task = tasks_.front();
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
+
+}
@@ -0,0 +1,46 @@
+﻿#ifndef NWEB_THREAD_POOL_H_
+#define NWEB_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "nweb.h"
+
+namespace nweb
+{
+
+//后台任务线程池, 第一次提交任务时启动线程
+class ThreadPool
+{
+public:
+    explicit ThreadPool(uint32_t thread_count);
+
+    //等待线程结束, 已提交的任务仍会执行完
+    ~ThreadPool();
+
+    //线程数, 对之后启动的线程生效
+    void SetThreadCount(uint32_t count);
+
+    void Post(const std::function<void()> & task);
+
+private:
+    ThreadPool(const ThreadPool &);
+    ThreadPool & operator=(const ThreadPool &);
+
+    void Run();
+
+private:
+    std::mutex lock_;
+    std::condition_variable ready_;
+    std::deque<std::function<void()> > tasks_;
+    std::vector<std::thread> threads_;
+    uint32_t thread_count_;
+    bool stop_;
+};
+
+}
+
+#endif
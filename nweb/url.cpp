@@ -423,6 +423,20 @@ bool URL::IsValid() const
     return true;
 }
 
+std::string URL::Origin() const
+{
+    std::string origin;
+    origin += scheme_;
+    origin += "://";
+    origin += host_;
+    if(!port_.empty())
+    {
+        origin += ':';
+        origin += port_;
+    }
+    return origin;
+}
+
 std::string URL::Escaped() const
 {
     std::string escaped;
@@ -25,6 +25,9 @@ public:
 
     std::string Escaped() const;
 
+    //scheme://host[:port], identifies the server of the url
+    std::string Origin() const;
+
     void AppendPath(const char * part);
 
     void ClearPath();